@@ -0,0 +1,273 @@
+#include "main.h"
+
+// 基准测试：直接调用引擎，测量插入、按键查找和全表扫描的吞吐量和延迟
+// 编译：gcc -O2 -DSQLIT_NO_MAIN bench.c main.c -lpthread -o bench
+
+#define BENCH_DB_FILENAME "bench.db"
+#define BENCH_DEFAULT_BATCH 1000     // 每个事务插入的行数
+
+uint64_t bench_now(void);
+void bench_reset(const char* filename);
+void bench_shuffle(uint32_t* keys, uint32_t num_keys);
+int compare_latency(const void* a, const void* b);
+void bench_report(const char* name, uint64_t* latencies, uint32_t num_ops, uint64_t elapsed);
+void bench_insert(Table* table, uint32_t* keys, uint32_t num_keys, uint32_t batch, uint64_t* latencies);
+void bench_find(Table* table, uint32_t* keys, uint32_t num_keys, uint64_t* latencies);
+void bench_find_email(Table* table, uint32_t* keys, uint32_t num_keys, uint64_t* latencies);
+uint32_t bench_scan(Table* table, uint64_t* latencies);
+
+// 单调时钟，纳秒
+uint64_t bench_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// 删除上一次测试留下的数据库、日志和页映射文件
+// filename: 数据库文件名
+void bench_reset(const char* filename)
+{
+    char path[256];
+    unlink(filename);
+    snprintf(path, sizeof(path), "%s-wal", filename);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s-map", filename);
+    unlink(path);
+}
+
+// 随机打乱键的顺序
+// keys: 键
+// num_keys: 键的数量
+void bench_shuffle(uint32_t* keys, uint32_t num_keys)
+{
+    for (uint32_t i = num_keys - 1; i > 0; i--) {
+        uint32_t j = rand() % (i + 1);
+        uint32_t key = keys[i];
+        keys[i] = keys[j];
+        keys[j] = key;
+    }
+}
+
+int compare_latency(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// 输出一项测试的每秒操作数和延迟的中位数、99 分位数
+// name: 测试名
+// latencies: 每次操作的耗时（纳秒），会被排序
+// num_ops: 操作数
+// elapsed: 总耗时（纳秒）
+void bench_report(const char* name, uint64_t* latencies, uint32_t num_ops, uint64_t elapsed)
+{
+    qsort(latencies, num_ops, sizeof(uint64_t), compare_latency);
+    printf("  %-12s %10.0f ops/s   p50 %8.2f us   p99 %8.2f us\n",
+            name,
+            num_ops / (elapsed / 1e9),
+            latencies[num_ops / 2] / 1e3,
+            latencies[(uint64_t)num_ops * 99 / 100] / 1e3);
+    fflush(stdout);
+}
+
+// 按给定顺序插入行，每 batch 行一个显式事务，提交的耗时计入事务最后一次插入
+// table: 表
+// keys: 插入的 id
+// num_keys: 行数
+// batch: 每个事务的行数
+// latencies: 返回每次插入的耗时
+void bench_insert(Table* table, uint32_t* keys, uint32_t num_keys, uint32_t batch, uint64_t* latencies)
+{
+    Statement begin = { .type = STATEMENT_BEGIN };
+    Statement commit = { .type = STATEMENT_COMMIT };
+    Statement insert = { .type = STATEMENT_INSERT };
+    bool in_transaction = false;
+
+    for (uint32_t i = 0; i < num_keys; i++) {
+        insert.row_to_insert.id = keys[i];
+        snprintf(insert.row_to_insert.username, sizeof(insert.row_to_insert.username), "user%u", keys[i]);
+        snprintf(insert.row_to_insert.email, sizeof(insert.row_to_insert.email), "person%u@example.com", keys[i]);
+
+        uint64_t start = bench_now();
+        if (i % batch == 0) {
+            execute_transaction(&begin, table, &in_transaction);
+        }
+        ExecuteResult result = execute_insert(&insert, table, in_transaction);
+        if (i % batch == batch - 1 || i == num_keys - 1) {
+            execute_transaction(&commit, table, &in_transaction);
+        }
+        latencies[i] = bench_now() - start;
+
+        if (result != EXECUTE_SUCCESS) {
+            fprintf(stderr, "Insert %u failed: %d\n", keys[i], result);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// 按给定顺序用 table_find 查找每个键，每次查找取一个快照
+// table: 表
+// keys: 查找的 id，必须都在表中
+// num_keys: 查找次数
+// latencies: 返回每次查找的耗时
+void bench_find(Table* table, uint32_t* keys, uint32_t num_keys, uint64_t* latencies)
+{
+    VersionStore* versions = table->pager->versions;
+    for (uint32_t i = 0; i < num_keys; i++) {
+        uint64_t start = bench_now();
+        uint64_t snapshot = version_store_begin_snapshot(versions);
+        Cursor* cursor = table_find(table, keys[i], snapshot);
+        bool found = cursor->cell_num < *leaf_node_num_cells(cursor->node) &&
+                     *leaf_node_key(cursor->node, cursor->cell_num) == keys[i];
+        cursor_free(cursor);
+        version_store_end_snapshot(versions, snapshot);
+        latencies[i] = bench_now() - start;
+
+        if (!found) {
+            fprintf(stderr, "Key %u not found\n", keys[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// 按 email 在二级索引中查找每个键对应的行，每次查找取一个快照
+// table: 表，必须有索引
+// keys: 查找的行的 id，email 为插入时生成的值
+// num_keys: 查找次数
+// latencies: 返回每次查找的耗时
+void bench_find_email(Table* table, uint32_t* keys, uint32_t num_keys, uint64_t* latencies)
+{
+    VersionStore* versions = table->pager->versions;
+    char email[COLUMN_EMAIL_SIZE + 1];
+    for (uint32_t i = 0; i < num_keys; i++) {
+        snprintf(email, sizeof(email), "person%u@example.com", keys[i]);
+        uint64_t start = bench_now();
+        uint64_t snapshot = version_store_begin_snapshot(versions);
+        uint32_t* ids;
+        uint32_t num_ids = index_find(table->indexes[INDEX_EMAIL], email, snapshot, &ids);
+        bool found = num_ids == 1 && ids[0] == keys[i];
+        free(ids);
+        version_store_end_snapshot(versions, snapshot);
+        latencies[i] = bench_now() - start;
+
+        if (!found) {
+            fprintf(stderr, "Email %s not found\n", email);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// 用 table_start 和 cursor_advance 扫描全表，读出每一行
+// table: 表
+// latencies: 返回每一行的耗时
+// 返回扫描的行数
+uint32_t bench_scan(Table* table, uint64_t* latencies)
+{
+    VersionStore* versions = table->pager->versions;
+    uint64_t snapshot = version_store_begin_snapshot(versions);
+    Cursor* cursor = table_start(table, snapshot);
+    uint32_t num_rows = 0;
+    Row row;
+    while (!cursor->end_of_table) {
+        uint64_t start = bench_now();
+        deserialize_row(cursor_value(cursor), &row);
+        cursor_advance(cursor);
+        latencies[num_rows] = bench_now() - start;
+        num_rows += 1;
+    }
+    cursor_free(cursor);
+    version_store_end_snapshot(versions, snapshot);
+    return num_rows;
+}
+
+int main(int argc, char* argv[])
+{
+    PagerOptions options;
+    options.max_frames = PAGER_DEFAULT_MAX_FRAMES;
+    options.use_mmap = false;
+    options.compress = false;
+    uint32_t batch = BENCH_DEFAULT_BATCH;
+    uint32_t seed = 1;
+    uint32_t row_counts[argc];
+    uint32_t num_row_counts = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            options.max_frames = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            batch = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--log") == 0 && i + 1 < argc && log_parse_level(argv[i + 1], &log_level)) {
+            i += 1;
+        }
+        else if (atoi(argv[i]) > 0) {
+            row_counts[num_row_counts++] = atoi(argv[i]);
+        }
+        else {
+            printf("Usage: %s [--frames N] [--batch N] [--seed N] [--log LEVEL] [ROWS...]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (num_row_counts == 0) {
+        row_counts[num_row_counts++] = 10000;
+        row_counts[num_row_counts++] = 100000;
+    }
+
+    for (uint32_t r = 0; r < num_row_counts; r++) {
+        uint32_t num_rows = row_counts[r];
+        uint32_t* keys = malloc(sizeof(uint32_t) * num_rows);
+        uint64_t* latencies = malloc(sizeof(uint64_t) * num_rows);
+        printf("rows %u, frames %u, batch %u\n", num_rows, options.max_frames, batch);
+        srand(seed);
+
+        // 1. 顺序插入
+        for (uint32_t i = 0; i < num_rows; i++) {
+            keys[i] = i + 1;
+        }
+        bench_reset(BENCH_DB_FILENAME);
+        Table* table = db_open(BENCH_DB_FILENAME, &options);
+        uint64_t start = bench_now();
+        bench_insert(table, keys, num_rows, batch, latencies);
+        bench_report("insert seq", latencies, num_rows, bench_now() - start);
+        db_close(table);
+
+        // 2. 随机插入
+        bench_shuffle(keys, num_rows);
+        bench_reset(BENCH_DB_FILENAME);
+        table = db_open(BENCH_DB_FILENAME, &options);
+        start = bench_now();
+        bench_insert(table, keys, num_rows, batch, latencies);
+        bench_report("insert rand", latencies, num_rows, bench_now() - start);
+
+        // 3. 在随机插入的表中按另一个随机顺序按 id 和按 email 查找
+        bench_shuffle(keys, num_rows);
+        start = bench_now();
+        bench_find(table, keys, num_rows, latencies);
+        bench_report("find", latencies, num_rows, bench_now() - start);
+
+        start = bench_now();
+        bench_find_email(table, keys, num_rows, latencies);
+        bench_report("find email", latencies, num_rows, bench_now() - start);
+
+        // 4. 全表扫描
+        start = bench_now();
+        uint32_t num_scanned = bench_scan(table, latencies);
+        bench_report("scan", latencies, num_scanned, bench_now() - start);
+        if (num_scanned != num_rows) {
+            fprintf(stderr, "Scanned %u rows, expected %u\n", num_scanned, num_rows);
+            exit(EXIT_FAILURE);
+        }
+
+        db_close(table);
+        free(keys);
+        free(latencies);
+    }
+
+    bench_reset(BENCH_DB_FILENAME);
+    return 0;
+}
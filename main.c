@@ -9,7 +9,13 @@ const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
 const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
 
 const uint32_t ROWS_PER_PAGE = PAGE_SIZE / ROW_SIZE;
-const uint32_t TABLE_MAX_ROWS = ROWS_PER_PAGE * TABLE_MAX_PAGES;
+
+// 行编码布局（变长）
+// 1. id
+// 2. 用户名长度 + 用户名
+// 3. 邮箱长度 + 邮箱
+const uint32_t ROW_LENGTH_SIZE = sizeof(uint8_t);  // 1 Byte
+const uint32_t ROW_MAX_SIZE = ID_SIZE + ROW_LENGTH_SIZE + COLUMN_USERNAME_SIZE + ROW_LENGTH_SIZE + COLUMN_EMAIL_SIZE;
 
 // 公共节点头部布局
 // 1. 节点类型
@@ -26,26 +32,30 @@ const uint32_t COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_
 // 叶子节点头部布局
 // 1. 单元的数量
 // 2. 下一个节点
+// 3. 单元内容区的起始位置
 const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t); // 4 Byte
 const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET = LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
-const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE; // 14 Byte
+const uint32_t LEAF_NODE_CONTENT_START_SIZE = sizeof(uint16_t); // 2 Byte
+const uint32_t LEAF_NODE_CONTENT_START_OFFSET = LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE
+                                       + LEAF_NODE_CONTENT_START_SIZE; // 16 Byte
 
-// 叶子节点体布局
-// 1. 键
-// 2. 数据
+// 叶子节点体布局（槽页）
+// 头部之后是按键排序的槽数组，每个槽记录键、数据的位置和长度
+// 数据从页尾向前存放，槽数组和数据之间是空闲空间
+// |头部|槽0|槽1|...|   空闲   |数据1|数据0|
 const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);   // 4 Byte
 const uint32_t LEAF_NODE_KEY_OFFSET = 0;
-const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
-const uint32_t LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_SIZE;
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
+const uint32_t LEAF_NODE_VALUE_OFFSET_SIZE = sizeof(uint16_t);  // 2 Byte
+const uint32_t LEAF_NODE_VALUE_OFFSET_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
+const uint32_t LEAF_NODE_VALUE_LENGTH_SIZE = sizeof(uint16_t);  // 2 Byte
+const uint32_t LEAF_NODE_VALUE_LENGTH_OFFSET = LEAF_NODE_VALUE_OFFSET_OFFSET + LEAF_NODE_VALUE_OFFSET_SIZE;
+const uint32_t LEAF_NODE_SLOT_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_OFFSET_SIZE + LEAF_NODE_VALUE_LENGTH_SIZE; // 8 Byte
 const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
-
-// 需把插入数据算入，左边的数>=右边的数
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
+// 单个数据的上限，保证一个节点至少能放下4个单元，拆分后两边都放得下
+const uint32_t LEAF_NODE_MAX_VALUE_SIZE = LEAF_NODE_SPACE_FOR_CELLS / 4 - LEAF_NODE_SLOT_SIZE;
 
 // 内部节点头部布局
 const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);      // 子节点的数比键数多1
@@ -58,57 +68,53 @@ const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + INTERNAL_NO
 const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
+const uint32_t INTERNAL_NODE_SPACE_FOR_CELLS = PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE;
+const uint32_t INTERNAL_NODE_MAX_CELLS = INTERNAL_NODE_SPACE_FOR_CELLS / INTERNAL_NODE_CELL_SIZE;
+
+// 当前日志级别，命令行 --log 或元命令 .log 修改
+LogLevel log_level = LOG_DEFAULT_LEVEL;
+
+const char* LOG_LEVEL_NAMES[] = { "error", "warn", "info", "debug" };
+
+// 线程本地的游标和页缓冲池，线程退出时由 thread_pool_key 的析构函数释放
+__thread ThreadPool thread_pool;
+pthread_key_t thread_pool_key;
+pthread_once_t thread_pool_once = PTHREAD_ONCE_INIT;
+
+// 输出一条日志到标准错误，调用者用 log_message 按级别过滤
+// level: 级别
+// format: printf 格式
+void log_write(LogLevel level, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    flockfile(stderr);
+    fprintf(stderr, "[%s] ", log_level_name(level));
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    funlockfile(stderr);
+    va_end(args);
+}
 
-InputBuffer* new_input_buffer(void);
-void print_prompt(void);
-void read_input(InputBuffer* input_buffer);
-void close_input_buffer(InputBuffer* input_buffer);
-Table* db_open(const char* filename);
-void db_close(Table* table);
-MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table* table);
-PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement);
-PrepareResult prepare_statement(InputBuffer *input_buffer, Statement *statement);
-void serialize_row(Row* source, void* destination);
-void deserialize_row(void* source, Row* destination);
-void* get_page(Pager* pager, uint32_t page_num);
-void* row_slot(Table* table, uint32_t row_num);
-ExecuteResult execute_insert(Statement* statement, Table* table);
-void print_row(Row* row);
-ExecuteResult execute_select(Statement* statement, Table* table);
-Pager* pager_open(const char* filename);
-void pager_flush(Pager* pager, uint32_t i);
-void free_table(Table* table);
-ExecuteResult execute_statement(Statement* statement, Table* table);
-Cursor* table_start(Table* table);
-Cursor* table_end(Table* table);
-void cursor_advance(Cursor* cursor);
-void print_constants(void);
-void print_leaf_node(void* node);
-
-uint32_t* leaf_node_num_cells(void* node);
-void* leaf_node_cell(void* node, uint32_t cell_num);
-uint32_t* leaf_node_key(void* node, uint32_t cell_num);
-void* leaf_node_value(void* node, uint32_t cell_num);
-void initialize_leaf_node(void* node);
-NodeType get_node_type(void* node);
-void set_node_type(void* node, NodeType type);
-void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value);
-Cursor* table_find(Table* table, uint32_t key);
-Cursor* leaf_node_find(Table* table,uint32_t page_num, uint32_t key);
-void leaf_node_split_and_insert(Cursor* cursor,uint32_t key,Row* value);
-uint32_t get_unused_page_num(Pager* pager);
-bool is_node_root(void* node);
-void set_node_root(void* node, bool is_root);
-void create_new_root(Table* table, uint32_t page_num);
-uint32_t* internal_node_child(void* node, uint32_t child_num);
-uint32_t* internal_node_key(void* node, uint32_t key_num);
-uint32_t get_node_max_key(void* node);
-uint32_t* internal_node_right_child(void* node);
-uint32_t* internal_node_num_keys(void* node);
-void indent(uint32_t level);
-void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level);
-Cursor* internal_node_find(Table* table, uint32_t root_page_num, uint32_t key);
-uint32_t* leaf_node_next_leaf(void* node);
+// 解析级别名
+// name: error、warn、info 或 debug
+// level: 返回级别
+bool log_parse_level(const char* name, LogLevel* level)
+{
+    for (uint32_t i = LOG_ERROR; i <= LOG_DEBUG; i++) {
+        if (strcmp(name, LOG_LEVEL_NAMES[i]) == 0) {
+            *level = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// 级别名
+const char* log_level_name(LogLevel level)
+{
+    return LOG_LEVEL_NAMES[level];
+}
 
 // 创建输入缓存
 InputBuffer* new_input_buffer()
@@ -154,44 +160,62 @@ void db_close(Table* table)
 {
     Pager* pager = table->pager;
 
-    // 1. 将完整页存入磁盘，并释放内存
-    for(uint32_t i = 0; i < pager->num_pages; i++) {
-        if (pager->pages[i] == NULL) {
-            continue;
-        }
-
-        pager_flush(pager, i); // 将整页存入磁盘
-
-        free(pager->pages[i]); // 释放内存
-        pager->pages[i] = NULL;
-    }
+    // 1. 提交剩余的修改，停止后台检查点，把日志全部写回文件
+    pager_begin_write(pager);
+    pager_commit(pager);
+    wal_stop_checkpointer(pager->wal);
+    wal_checkpoint(pager->wal);
 
-    // 2. 关闭文件
+    // 2. 关闭文件，删除日志
     int result = close(pager->file_descriptor);
     if (result == -1) {
         printf("Error closing db file.\n");
         exit(EXIT_FAILURE);
     }
+    wal_close(pager->wal);
+    if (pager->page_map != NULL) {
+        page_map_close(pager->page_map);
+    }
 
     // 3. 释放内存
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        void* page = pager->pages[i];
-        if (page) {
-            free(page);
-            pager->pages[i] = NULL;
-        }
+    for (uint32_t i = 0; i < pager->max_frames; i++) {
+        pthread_rwlock_destroy(&pager->frames[i].latch);
+    }
+    pthread_mutex_destroy(&pager->mutex);
+    pthread_cond_destroy(&pager->loaded);
+    pthread_cond_destroy(&pager->flushed);
+    pthread_mutex_destroy(&pager->write_mutex);
+    version_store_close(pager->versions);
+    free(pager->write_set);
+    free(pager->savepoint_pages);
+    page_set_close(&pager->write_set_pages);
+    page_set_close(&pager->savepoint_set);
+    node_cache_close(&pager->node_cache);
+    if (pager->map != NULL) {
+        munmap(pager->map, pager->map_length);
     }
 
+    free(pager->frame_slab);
+    free(pager->frames);
+    free(pager->dirty_frames);
+    free(pager->page_table);
     free(pager);
+    for (uint32_t i = 0; i < INDEX_COUNT; i++) {
+        free(table->indexes[i]);
+    }
     free(table);
 }
 
 // 执行元命令
-MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table* table)
+// in_transaction: 是否在显式事务中
+MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table* table, bool in_transaction)
 {
     // 退出
     if (strcmp(input_buffer->buffer, ".exit") == 0) {
-        // 1. 关闭数据库
+        // 1. 回滚未提交的事务，关闭数据库
+        if (in_transaction) {
+            table_rollback(table);
+        }
         db_close(table);
         // 2. 释放输入缓存
         close_input_buffer(input_buffer);
@@ -208,31 +232,154 @@ MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table* table)
         print_tree(table->pager, 0, 0);
         return META_COMMAND_SUCCESS;
     }
+    else if (strcmp(input_buffer->buffer, ".stats") == 0) {
+        TableStats stats;
+        table_stats(table, &stats);
+        printf("Stats:\n");
+        print_stats(&stats);
+        return META_COMMAND_SUCCESS;
+    }
+    else if (strcmp(input_buffer->buffer, ".log") == 0 || strncmp(input_buffer->buffer, ".log ", 5) == 0) {
+        // .log 显示当前级别，.log <级别> 修改
+        if (input_buffer->buffer[4] == '\0') {
+            printf("Log level: %s\n", log_level_name(log_level));
+        }
+        else if (!log_parse_level(input_buffer->buffer + 5, &log_level)) {
+            printf("Usage: .log [error|warn|info|debug]\n");
+        }
+        return META_COMMAND_SUCCESS;
+    }
+    else if (strncmp(input_buffer->buffer, ".import ", 8) == 0) {
+        // .import <文件> [装填百分比]，批量导入自己开始写操作，不能在事务中
+        if (in_transaction) {
+            printf("Error: Cannot import inside a transaction.\n");
+            return META_COMMAND_SUCCESS;
+        }
+        strtok(input_buffer->buffer, " ");
+        char* filename = strtok(NULL, " ");
+        char* fill_string = strtok(NULL, " ");
+        uint32_t fill_factor = fill_string ? atoi(fill_string) : BULK_LOAD_DEFAULT_FILL_FACTOR;
+        if (filename == NULL || fill_factor == 0 || fill_factor > 100) {
+            printf("Usage: .import <file> [fill factor 1-100]\n");
+            return META_COMMAND_SUCCESS;
+        }
+        import_file(table, filename, fill_factor);
+        return META_COMMAND_SUCCESS;
+    }
     else {
         return META_COMMAND_UNRECOGNIZED_COMMAND;
     }
 }
 
 // 准备插入
-// 从输入缓存中解析出插入数据
+// 从输入缓存中解析出插入数据，每列可以是 ? 参数
+// 多行用逗号分隔：insert 1 a a@x, 2 b b@x，多行时不能有参数
 PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement)
 {
     // 1. 设置类型
     statement->type = STATEMENT_INSERT;
+    statement->num_params = 0;
+    statement->rows = NULL;
+    statement->num_rows = 1;
 
-    // 2. 分离输入
-    char* keyword = strtok(input_buffer->buffer, " ");
-    char* id_string = strtok(NULL, " ");
-    char* username = strtok(NULL, " ");
-    char* email = strtok(NULL, " ");
+    // 2. 分离输入，服务器的多个工作线程同时解析，不能用 strtok
+    char* saveptr;
+    strtok_r(input_buffer->buffer, " ", &saveptr);
+    char* id_string = strtok_r(NULL, " ", &saveptr);
+    char* username = strtok_r(NULL, " ", &saveptr);
+    char* email = strtok_r(NULL, " ", &saveptr);
+    bool more = prepare_tuple_end(email);
+
+    // 3. 参数先按 0 和空串校验，执行前绑定
+    id_string = prepare_param(statement, id_string, PARAM_ID, "0");
+    username = prepare_param(statement, username, PARAM_USERNAME, "");
+    email = prepare_param(statement, email, PARAM_EMAIL, "");
+
+    // 4. 校验并设置数据
+    PrepareResult result = parse_row(id_string, username, email, &statement->row_to_insert);
+    if (result != PREPARE_SUCCESS || !more) {
+        return result;
+    }
+    if (statement->num_params > 0) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    // 5. 其余各行
+    uint32_t capacity = 16;
+    statement->rows = malloc(capacity * sizeof(Row));
+    statement->rows[0] = statement->row_to_insert;
+    while (more) {
+        id_string = strtok_r(NULL, " ", &saveptr);
+        username = strtok_r(NULL, " ", &saveptr);
+        email = strtok_r(NULL, " ", &saveptr);
+        more = prepare_tuple_end(email);
+        if (statement->num_rows == capacity) {
+            capacity *= 2;
+            statement->rows = realloc(statement->rows, capacity * sizeof(Row));
+        }
+        result = parse_row(id_string, username, email, &statement->rows[statement->num_rows]);
+        if (result != PREPARE_SUCCESS) {
+            statement_free(statement);
+            return result;
+        }
+        statement->num_rows += 1;
+    }
+    return PREPARE_SUCCESS;
+}
+
+// 一行的最后一列以逗号结尾时后面还有行，去掉逗号
+// token: 一行的最后一列
+bool prepare_tuple_end(char* token)
+{
+    if (token == NULL) {
+        return false;
+    }
+    size_t length = strlen(token);
+    if (length == 0 || token[length - 1] != ',') {
+        return false;
+    }
+    token[length - 1] = 0;
+    return true;
+}
+
+// 释放多行插入的行，语句本身由调用者管理
+// statement: 语句
+void statement_free(Statement* statement)
+{
+    free(statement->rows);
+    statement->rows = NULL;
+}
+
+// 记录 ? 参数
+// 是 ? 时记录参数绑定的位置，返回代替它校验的文本；否则原样返回
+// statement: 语句
+// token: 输入的词
+// param: 参数绑定的位置
+// placeholder: 代替参数的文本
+char* prepare_param(Statement* statement, char* token, StatementParam param, char* placeholder)
+{
+    if (token == NULL || strcmp(token, "?") != 0) {
+        return token;
+    }
+    statement->params[statement->num_params++] = param;
+    return placeholder;
+}
 
-    // 3. 校验输入
+// 校验输入的各列，并设置到行中
+// id_string: id 文本
+// username: 用户名
+// email: 邮箱
+// row: 行
+PrepareResult parse_row(char* id_string, char* username, char* email, Row* row)
+{
+    // 1. 校验输入
     if (id_string == NULL || username == NULL || email == NULL) {
         return PREPARE_SYNTAX_ERROR;
     }
-    int id = atoi(id_string);
-    if (id < 0) {
-        return PREPARE_NEGATIVE_ID;
+    uint32_t id;
+    PrepareResult result = parse_id(id_string, &id);
+    if (result != PREPARE_SUCCESS) {
+        return result;
     }
     if (strlen(username) > COLUMN_USERNAME_SIZE) {
         return PREPARE_STRING_TOO_LONG;
@@ -241,10 +388,10 @@ PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement)
         return PREPARE_STRING_TOO_LONG;
     }
 
-    // 4. 设置数据
-    statement->row_to_insert.id = id;
-    strcpy(statement->row_to_insert.username, username);
-    strcpy(statement->row_to_insert.email, email);
+    // 2. 设置数据
+    row->id = id;
+    strcpy(row->username, username);
+    strcpy(row->email, email);
     return PREPARE_SUCCESS;
 }
 
@@ -255,746 +402,4896 @@ PrepareResult prepare_statement(InputBuffer *input_buffer, Statement *statement)
     if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
         return prepare_insert(input_buffer, statement);
     }
-    if (strcmp(input_buffer->buffer, "select") == 0) {
-        statement->type = STATEMENT_SELECT;
+    if (strncmp(input_buffer->buffer, "select", 6) == 0) {
+        return prepare_select(input_buffer, statement);
+    }
+    return prepare_transaction(input_buffer, statement);
+}
+
+// 准备事务语句：begin、commit、rollback
+PrepareResult prepare_transaction(InputBuffer *input_buffer, Statement *statement)
+{
+    if (strcmp(input_buffer->buffer, "begin") == 0) {
+        statement->type = STATEMENT_BEGIN;
+    }
+    else if (strcmp(input_buffer->buffer, "commit") == 0) {
+        statement->type = STATEMENT_COMMIT;
+    }
+    else if (strcmp(input_buffer->buffer, "rollback") == 0) {
+        statement->type = STATEMENT_ROLLBACK;
+    }
+    else {
+        return PREPARE_UNRECOGNIZED_STATEMENT;
+    }
+    statement->rows = NULL;
+    statement->num_params = 0;
+    return PREPARE_SUCCESS;
+}
+
+// 准备查询
+// 支持 select、select where id = a、select where id between a and b，
+// 以及 >、>=、<、<= 条件，a、b 可以是 ? 参数，执行时由 statement_select_range 转换为闭区间；
+// select where username = a、select where email = a 按列值相等查询，操作数存放在 row_to_insert 中
+PrepareResult prepare_select(InputBuffer *input_buffer, Statement *statement)
+{
+    // 1. 设置类型，默认查询全部
+    statement->type = STATEMENT_SELECT;
+    statement->rows = NULL;
+    statement->op = SELECT_ALL;
+    statement->lower = 0;
+    statement->upper = 0;
+    statement->num_params = 0;
+
+    // 2. 分离输入
+    char* saveptr;
+    char* keyword = strtok_r(input_buffer->buffer, " ", &saveptr);
+    if (strcmp(keyword, "select") != 0) {
+        return PREPARE_UNRECOGNIZED_STATEMENT;
+    }
+    char* where = strtok_r(NULL, " ", &saveptr);
+    if (where == NULL) {
+        return PREPARE_SUCCESS;
+    }
+    char* column = strtok_r(NULL, " ", &saveptr);
+    char* op = strtok_r(NULL, " ", &saveptr);
+    if (strcmp(where, "where") != 0 || column == NULL || op == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    // 按 username 或 email 查询，只支持 =
+    bool username = strcmp(column, "username") == 0;
+    if (username || strcmp(column, "email") == 0) {
+        char* text = prepare_param(statement, strtok_r(NULL, " ", &saveptr), username ? PARAM_USERNAME : PARAM_EMAIL, "");
+        if (strcmp(op, "=") != 0 || text == NULL || strtok_r(NULL, " ", &saveptr) != NULL) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        if (strlen(text) > (username ? COLUMN_USERNAME_SIZE : COLUMN_EMAIL_SIZE)) {
+            return PREPARE_STRING_TOO_LONG;
+        }
+        strcpy(username ? statement->row_to_insert.username : statement->row_to_insert.email, text);
+        statement->op = username ? SELECT_USERNAME_EQUAL : SELECT_EMAIL_EQUAL;
         return PREPARE_SUCCESS;
     }
-    return PREPARE_UNRECOGNIZED_STATEMENT;
+
+    char* value_string = prepare_param(statement, strtok_r(NULL, " ", &saveptr), PARAM_LOWER, "0");
+    if (strcmp(column, "id") != 0 || value_string == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    PrepareResult result = parse_id(value_string, &statement->lower);
+    if (result != PREPARE_SUCCESS) {
+        return result;
+    }
+
+    // 3. 记录条件
+    if (strcmp(op, "between") == 0) {
+        char* and = strtok_r(NULL, " ", &saveptr);
+        char* upper_string = prepare_param(statement, strtok_r(NULL, " ", &saveptr), PARAM_UPPER, "0");
+        if (and == NULL || strcmp(and, "and") != 0 || upper_string == NULL) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        result = parse_id(upper_string, &statement->upper);
+        if (result != PREPARE_SUCCESS) {
+            return result;
+        }
+        statement->op = SELECT_BETWEEN;
+    }
+    else if (strcmp(op, "=") == 0) {
+        statement->op = SELECT_EQUAL;
+    }
+    else if (strcmp(op, ">=") == 0) {
+        statement->op = SELECT_GREATER_EQUAL;
+    }
+    else if (strcmp(op, ">") == 0) {
+        statement->op = SELECT_GREATER;
+    }
+    else if (strcmp(op, "<=") == 0) {
+        statement->op = SELECT_LESS_EQUAL;
+    }
+    else if (strcmp(op, "<") == 0) {
+        statement->op = SELECT_LESS;
+    }
+    else {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    if (strtok_r(NULL, " ", &saveptr) != NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return PREPARE_SUCCESS;
+}
+
+// 把查询条件转换为闭区间 [min_id, max_id]，开区间的边界超出范围时结果为空（min_id > max_id）
+// statement: 查询语句
+// min_id: 返回的下界
+// max_id: 返回的上界
+void statement_select_range(Statement* statement, uint32_t* min_id, uint32_t* max_id)
+{
+    *min_id = 0;
+    *max_id = UINT32_MAX;
+    uint32_t value = statement->lower;
+    switch (statement->op) {
+        case (SELECT_ALL):
+            break;
+        case (SELECT_EQUAL):
+            *min_id = value;
+            *max_id = value;
+            break;
+        case (SELECT_BETWEEN):
+            *min_id = value;
+            *max_id = statement->upper;
+            break;
+        case (SELECT_GREATER_EQUAL):
+            *min_id = value;
+            break;
+        case (SELECT_GREATER):
+            *min_id = value + 1;
+            if (value == UINT32_MAX) {
+                *min_id = 1;
+                *max_id = 0;
+            }
+            break;
+        case (SELECT_LESS_EQUAL):
+            *max_id = value;
+            break;
+        case (SELECT_LESS):
+            *max_id = value - 1;
+            if (value == 0) {
+                *min_id = 1;
+                *max_id = 0;
+            }
+            break;
+        case (SELECT_USERNAME_EQUAL):
+        case (SELECT_EMAIL_EQUAL):
+            break;
+    }
+}
+
+// 解析 id
+// id_string: id 文本
+// id: 返回的 id
+PrepareResult parse_id(char* id_string, uint32_t* id)
+{
+    char* end;
+    long long value = strtoll(id_string, &end, 10);
+    if (end == id_string || *end != '\0') {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (value < 0) {
+        return PREPARE_NEGATIVE_ID;
+    }
+    if (value > UINT32_MAX) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    *id = (uint32_t)value;
+    return PREPARE_SUCCESS;
 }
 
-// 序列化行
-void serialize_row(Row* source, void* destination)
+// 序列化行，字符串只保存实际长度
+// 返回编码后的字节数，不超过 ROW_MAX_SIZE
+uint32_t serialize_row(Row* source, void* destination)
 {
-    memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
-    strncpy(destination + USERNAME_OFFSET, source->username, USERNAME_SIZE);
-    strncpy(destination + EMAIL_OFFSET, source->email, EMAIL_SIZE);
+    uint8_t username_length = strlen(source->username);
+    uint8_t email_length = strlen(source->email);
+    void* out = destination;
+
+    memcpy(out, &(source->id), ID_SIZE);
+    out += ID_SIZE;
+    *(uint8_t*)out = username_length;
+    memcpy(out + ROW_LENGTH_SIZE, source->username, username_length);
+    out += ROW_LENGTH_SIZE + username_length;
+    *(uint8_t*)out = email_length;
+    memcpy(out + ROW_LENGTH_SIZE, source->email, email_length);
+    out += ROW_LENGTH_SIZE + email_length;
+
+    return out - destination;
 }
 
 // 反序列化行
 void deserialize_row(void* source, Row* destination)
 {
-    memcpy(&(destination->id), source+ID_OFFSET, ID_SIZE);
-    memcpy(&(destination->username), source+USERNAME_OFFSET, USERNAME_SIZE);
-    memcpy(&(destination->email), source+EMAIL_OFFSET, EMAIL_SIZE);
+    memcpy(&(destination->id), source, ID_SIZE);
+    source += ID_SIZE;
+    uint8_t username_length = *(uint8_t*)source;
+    memcpy(destination->username, source + ROW_LENGTH_SIZE, username_length);
+    destination->username[username_length] = '\0';
+    source += ROW_LENGTH_SIZE + username_length;
+    uint8_t email_length = *(uint8_t*)source;
+    memcpy(destination->email, source + ROW_LENGTH_SIZE, email_length);
+    destination->email[email_length] = '\0';
 }
 
-// 根据页数获取页地址，如果为空，从磁盘中读
+// 根据页数获取页地址，如果不在缓冲池中，从磁盘中读
+// 返回的页被固定，用完后需调用 unpin_page
+// 其他线程读取页内容时通过 pager_read_page 读取快照中的版本
 // pager: 分页器
 // page_num: 第几页
 void* get_page(Pager* pager, uint32_t page_num)
 {
-    // 1. 页数是否超限
-    if(page_num > TABLE_MAX_PAGES) {
-        printf("Tried to fetch page number out of bounds. %d > %d\n", page_num, TABLE_MAX_PAGES);
-        exit(EXIT_FAILURE);
+    return pager_pin(pager, page_num)->data;
+}
+
+// 固定页并返回所在的帧
+// 未命中时先把帧加入页表并标记为读入中，释放缓冲池锁后再读磁盘，其他页的访问不被阻塞
+// pager: 分页器
+// page_num: 第几页
+Frame* pager_pin(Pager* pager, uint32_t page_num)
+{
+    pthread_mutex_lock(&pager->mutex);
+
+    // 1. 命中缓冲池，其他线程正在读入时等待读入完成
+    int32_t frame_num = pager_lookup(pager, page_num);
+    if (frame_num != INVALID_FRAME_NUM) {
+        Frame* frame = &pager->frames[frame_num];
+        frame->pin_count += 1;
+        frame->referenced = true;
+        stats_add(&pager->stats.cache_hits, 1);
+        while (frame->loading) {
+            pthread_cond_wait(&pager->loaded, &pager->mutex);
+        }
+        pthread_mutex_unlock(&pager->mutex);
+        return frame;
     }
 
-    // 2. 如果内存中页内容为空，从磁盘中读取
-    if(pager->pages[page_num] == NULL) {
-        // 创建页内存
-        void* page = malloc(PAGE_SIZE);
-        // 计算磁盘文件中页数
-        uint32_t num_pages = pager->file_length / PAGE_SIZE;
-        if (pager->file_length % PAGE_SIZE) {
-            num_pages += 1;
+    // 2. 未命中，找一个空闲帧或淘汰一帧，加入页表
+    //    淘汰脏页时释放过缓冲池锁，其他线程可能已读入该页，此时空出的帧留给之后使用，按命中处理
+    stats_add(&pager->stats.cache_misses, 1);
+    uint32_t victim_num = pager_find_victim(pager);
+    frame_num = pager_lookup(pager, page_num);
+    if (frame_num != INVALID_FRAME_NUM) {
+        Frame* frame = &pager->frames[frame_num];
+        frame->pin_count += 1;
+        frame->referenced = true;
+        while (frame->loading) {
+            pthread_cond_wait(&pager->loaded, &pager->mutex);
         }
+        pthread_mutex_unlock(&pager->mutex);
+        return frame;
+    }
+    frame_num = victim_num;
+    Frame* frame = &pager->frames[frame_num];
+    uint32_t bucket = page_num & pager->page_table_mask;
+    frame->page_num = page_num;
+    frame->pin_count = 1;
+    frame->dirty = false;
+    frame->referenced = true;
+    frame->in_use = true;
+    frame->loading = true;
+    frame->next = pager->page_table[bucket];
+    pager->page_table[bucket] = frame_num;
+
+    // 如果获取的页数大于等于记录的页数，增加页
+    if (page_num >= pager->num_pages) {
+        pager->num_pages = page_num + 1;
+    }
+    pthread_mutex_unlock(&pager->mutex);
 
-        // 从磁盘中读取数据
-        if (page_num  <= num_pages) {
-            // 移动到第几页
-            lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-            // 读取整页
-            ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
+    // 3. 日志中的版本比文件新，优先从日志读取
+    if (wal_read_page(pager->wal, page_num, frame->buffer)) {
+        frame->data = frame->buffer;
+        frame->mapped = false;
+    }
+    else if ((off_t)(page_num + 1) * PAGE_SIZE <= pager->map_length) {
+        // 4. 映射范围内的页直接指向映射，不需要系统调用和拷贝
+        //    映射是私有的，修改时由内核写时复制，不会影响文件
+        frame->data = pager->map + (off_t)page_num * PAGE_SIZE;
+        frame->mapped = true;
+    }
+    else {
+        // 5. 从磁盘中读取数据，文件外的新页置零
+        //    检查点在后台扩展文件，以实际读到的长度为准
+        frame->data = frame->buffer;
+        frame->mapped = false;
+        if (pager->page_map != NULL) {
+            page_map_read(pager->page_map, pager->file_descriptor, page_num, frame->data);
+        }
+        else {
+            ssize_t bytes_read = pread(pager->file_descriptor, frame->data, PAGE_SIZE, (off_t)page_num * PAGE_SIZE);
             if (bytes_read == -1) {
                 printf("Error reading file: %d\n", errno);
                 exit(EXIT_FAILURE);
             }
-        }
-
-        pager->pages[page_num] = page;
-
-        // 如果获取的页数大于等于记录的页数，增加页
-        if (page_num >= pager->num_pages) {
-            pager->num_pages = page_num + 1;
+            stats_add(&pager->stats.bytes_read, bytes_read);
+            memset(frame->data + bytes_read, 0, PAGE_SIZE - bytes_read);
         }
     }
 
-    return pager->pages[page_num];
+    // 6. 读入完成，唤醒等待该页的线程
+    pthread_mutex_lock(&pager->mutex);
+    frame->loading = false;
+    pthread_cond_broadcast(&pager->loaded);
+    pthread_mutex_unlock(&pager->mutex);
+    return frame;
 }
 
-// 根据行数返回数据地址
-void* cursor_value(Cursor* cursor)
+// 解除页的固定，固定计数为0的页可以被淘汰
+// pager: 分页器
+// page_num: 第几页
+void unpin_page(Pager* pager, uint32_t page_num)
 {
-    printf("cursor_value page_num:%d cell_num:%d\n", cursor->page_num, cursor->cell_num);
-    uint32_t page_num = cursor->page_num;
-    void* page = get_page(cursor->table->pager, page_num);
-    return leaf_node_value(page, cursor->cell_num);
+    pthread_mutex_lock(&pager->mutex);
+    int32_t frame_num = pager_lookup(pager, page_num);
+    if (frame_num == INVALID_FRAME_NUM || pager->frames[frame_num].pin_count == 0) {
+        printf("Tried to unpin page %d which is not pinned\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    pager->frames[frame_num].pin_count -= 1;
+    pthread_mutex_unlock(&pager->mutex);
 }
 
-// 将行插入到表中
-ExecuteResult execute_insert(Statement* statement, Table* table)
+// 读取页在快照中的版本，拷贝到 page
+// 快照之后被修改过的页读旧版本，否则读当前页
+// 拷贝当前页时持有共享闩锁，写者要先保存旧版本才能修改，保存需要排他闩锁
+// pager: 分页器
+// page_num: 第几页
+// snapshot: 快照
+// page: 目标内存
+void pager_read_page(Pager* pager, uint32_t page_num, uint64_t snapshot, void* page)
 {
-    void* node = get_page(table->pager, table->root_page_num);
-    uint32_t num_cells = (*leaf_node_num_cells(node));
-
-    // 根据键值找到游标
-    Row* row_to_insert = &(statement->row_to_insert);
-    uint32_t key_to_insert = row_to_insert->id;
-    Cursor* cursor = table_find(table, key_to_insert);
-
-    // id 重复，返回错误
-    if (cursor->cell_num < num_cells) {
-        uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-        if (key_at_index == key_to_insert) {
-            return EXECUTE_DUPLICATE_KEY;
-        }
+    if (version_store_read(pager->versions, page_num, snapshot, page)) {
+        return;
     }
 
-    // 插入数据
-    leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
-
-    // 释放游标
-    free(cursor);
-    return EXECUTE_SUCCESS;
+    // 加锁后再查一次，写者可能刚保存了旧版本
+    Frame* frame = pager_pin(pager, page_num);
+    pthread_rwlock_rdlock(&frame->latch);
+    if (!version_store_read(pager->versions, page_num, snapshot, page)) {
+        memcpy(page, frame->data, PAGE_SIZE);
+    }
+    pthread_rwlock_unlock(&frame->latch);
+    unpin_page(pager, page_num);
 }
 
-// 根据键返回游标
-// table: 表
-// key: 键值
-Cursor* table_find(Table* table, uint32_t key)
+// 初始化上层节点缓存
+// cache: 缓存
+void node_cache_init(NodeCache* cache)
 {
-    uint32_t root_page_num = table->root_page_num;
-    void* root_node = get_page(table->pager, root_page_num);
-
-    if (get_node_type(root_node) == NODE_LEAF) {
-        return leaf_node_find(table, root_page_num, key);
+    for (uint32_t i = 0; i < NODE_CACHE_SIZE; i++) {
+        cache->entries[i].page_num = INVALID_PAGE_NUM;
+        cache->entries[i].data = NULL;
     }
-    else {
-        return internal_node_find(table, root_page_num, key);
+    cache->next_victim = 0;
+    cache->generation = 0;
+    pthread_rwlock_init(&cache->lock, NULL);
+}
+
+// 释放上层节点缓存
+// cache: 缓存
+void node_cache_close(NodeCache* cache)
+{
+    for (uint32_t i = 0; i < NODE_CACHE_SIZE; i++) {
+        free(cache->entries[i].data);
     }
-    return NULL;
+    pthread_rwlock_destroy(&cache->lock);
 }
 
-// 返回游标
-// page_num: 第几页
+// 在缓存的内部节点中查找键所在的子节点
+// 缓存项从加入起没有被修改过，快照不早于加入时的提交就能看到同样的内容
+// pager: 分页器
+// page_num: 内部节点所在页
+// snapshot: 快照
 // key: 键值
-Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key)
+// child_page_num: 命中时返回子节点所在页
+// generation: 未命中时返回查找时的代数，读取该页后传给 node_cache_put
+// 返回是否命中
+bool node_cache_find_child(Pager* pager, uint32_t page_num, uint64_t snapshot, uint32_t key, uint32_t* child_page_num, uint64_t* generation)
 {
-    void* node = get_page(table->pager, page_num);
-    uint32_t num_cells = *leaf_node_num_cells(node);
+    NodeCache* cache = &pager->node_cache;
+    pthread_rwlock_rdlock(&cache->lock);
+    for (uint32_t i = 0; i < NODE_CACHE_SIZE; i++) {
+        NodeCacheEntry* entry = &cache->entries[i];
+        if (entry->page_num == page_num && snapshot >= entry->since) {
+            *child_page_num = *internal_node_child(entry->data, internal_node_find_child(entry->data, key));
+            pthread_rwlock_unlock(&cache->lock);
+            stats_add(&pager->stats.node_cache_hits, 1);
+            return true;
+        }
+    }
+    *generation = cache->generation;
+    pthread_rwlock_unlock(&cache->lock);
+    return false;
+}
 
-    Cursor* cursor = malloc(sizeof(Cursor));
-    cursor->table = table;
-    cursor->page_num = page_num;
+// 把读者刚读到的内部节点加入缓存
+// 读取前后都没有写者，且快照是最近一次提交时，读到的副本就是当前页，才可以加入
+// pager: 分页器
+// page_num: 内部节点所在页
+// node: 快照中的副本
+// snapshot: 读取副本的快照
+// generation: 读取前 node_cache_find_child 返回的代数
+void node_cache_put(Pager* pager, uint32_t page_num, void* node, uint64_t snapshot, uint64_t generation)
+{
+    NodeCache* cache = &pager->node_cache;
+    if (generation % 2 == 1) {
+        return;
+    }
 
-    // 二分查找找到键的位置
-    uint32_t min_index = 0;
-    uint32_t one_past_max_index = num_cells;
+    pthread_rwlock_wrlock(&cache->lock);
+    // 1. 期间有写者或快照不是最近的提交时，副本可能不是当前页
+    //    代数不变说明没有写者，最近一次提交的版本号也不会变
+    if (cache->generation != generation || snapshot != pager->versions->commit_version) {
+        pthread_rwlock_unlock(&cache->lock);
+        return;
+    }
 
-    while(one_past_max_index != min_index) {
-        uint32_t index = min_index + (one_past_max_index - min_index) / 2;
-        uint32_t key_at_index = *leaf_node_key(node, index);
-        if (key == key_at_index) {
-            cursor->cell_num = index;
-            return cursor;
+    // 2. 其他读者可能已经加入了该页；否则优先用空项，没有时轮流替换
+    NodeCacheEntry* victim = NULL;
+    for (uint32_t i = 0; i < NODE_CACHE_SIZE; i++) {
+        NodeCacheEntry* entry = &cache->entries[i];
+        if (entry->page_num == page_num) {
+            pthread_rwlock_unlock(&cache->lock);
+            return;
         }
-        if (key < key_at_index) {
-            one_past_max_index = index;
+        if (victim == NULL && entry->page_num == INVALID_PAGE_NUM) {
+            victim = entry;
         }
-        else {
-            min_index = index + 1;
+    }
+    if (victim == NULL) {
+        victim = &cache->entries[cache->next_victim];
+        cache->next_victim = (cache->next_victim + 1) % NODE_CACHE_SIZE;
+    }
+
+    // 3. 保存副本
+    if (victim->data == NULL) {
+        victim->data = malloc(PAGE_SIZE);
+    }
+    memcpy(victim->data, node, PAGE_SIZE);
+    victim->page_num = page_num;
+    victim->since = snapshot;
+    pthread_rwlock_unlock(&cache->lock);
+}
+
+// 写者修改页之前调用，页在缓存中时使其失效
+// pager: 分页器
+// page_num: 第几页
+void node_cache_invalidate(Pager* pager, uint32_t page_num)
+{
+    NodeCache* cache = &pager->node_cache;
+    pthread_rwlock_wrlock(&cache->lock);
+    for (uint32_t i = 0; i < NODE_CACHE_SIZE; i++) {
+        if (cache->entries[i].page_num == page_num) {
+            cache->entries[i].page_num = INVALID_PAGE_NUM;
         }
     }
+    pthread_rwlock_unlock(&cache->lock);
+}
 
-    cursor->cell_num = min_index;
-    printf("leaf_node_find cursor page_num:%d cell_num:%d\n", page_num, min_index);
-    return cursor;
+// 写操作开始和结束时调用，写操作进行中读者不加入新项
+// pager: 分页器
+void node_cache_advance(Pager* pager)
+{
+    NodeCache* cache = &pager->node_cache;
+    pthread_rwlock_wrlock(&cache->lock);
+    cache->generation += 1;
+    pthread_rwlock_unlock(&cache->lock);
 }
 
-Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key)
+// 开始写操作，同一时间只有一个写者，由 pager_commit 结束
+// pager: 分页器
+void pager_begin_write(Pager* pager)
 {
-    void* node = get_page(table->pager, page_num);
-    uint32_t num_keys = *internal_node_num_keys(node);
+    pthread_mutex_lock(&pager->write_mutex);
+    pager->write_num_pages = pager->num_pages;
+    node_cache_advance(pager);
+}
 
-    uint32_t min_index = 0;
-    uint32_t max_index = num_keys; // 子节点比键多1
+// 标记页为脏页，修改已固定的页内容前调用
+// 事务中第一次修改页时先保存旧版本，快照读者读旧版本，不需要等待写者
+// pager: 分页器
+// page_num: 第几页
+void pager_mark_dirty(Pager* pager, uint32_t page_num)
+{
+    // 1. 保存旧版本，排他闩锁等待正在拷贝当前页的读者
+    //    本次写操作第一次修改页时使上层节点缓存中的副本失效，写操作结束前不会再加入
+    int32_t index = pager->exclusive_write ? -1 : page_set_find(&pager->write_set_pages, page_num);
+    if (!pager->exclusive_write && index == -1) {
+        Frame* frame = pager_pin(pager, page_num);
+        pthread_rwlock_wrlock(&frame->latch);
+        version_store_save(pager->versions, page_num, frame->data);
+        pthread_rwlock_unlock(&frame->latch);
+        unpin_page(pager, page_num);
 
-    while (min_index != max_index) {
-        uint32_t index = min_index + (max_index - min_index) / 2;
-        uint32_t key_to_right =  *internal_node_key(node, index);
-        if (key_to_right >= key) {
-            max_index = index;
-        } else {
-            min_index = index + 1;
+        if (pager->write_set_size == pager->write_set_capacity) {
+            pager->write_set_capacity *= 2;
+            pager->write_set = realloc(pager->write_set, pager->write_set_capacity * sizeof(uint32_t));
         }
+        page_set_put(&pager->write_set_pages, page_num, pager->write_set_size);
+        pager->write_set[pager->write_set_size++] = page_num;
     }
-    uint32_t child_num = *internal_node_child(node, min_index);
-    void* child = get_page(table->pager, child_num);
-    switch (get_node_type(child)) {
-        case NODE_LEAF:
-            return leaf_node_find(table, child_num, key);
-            break;
-        case NODE_INTERNAL:
-            return internal_node_find(table, child_num, key);
-            break;
-        default:
-            break;
+
+    if (index == -1) {
+        node_cache_invalidate(pager, page_num);
     }
 
-    return NULL;
+    // 2. 保存点之前已修改过的页，旧版本不是语句开始时的内容，另存一份
+    if (pager->savepoint_active && index != -1 && (uint32_t)index < pager->savepoint_write_set_size) {
+        pager_savepoint_save(pager, page_num);
+    }
+
+    // 3. 标记脏页
+    pthread_mutex_lock(&pager->mutex);
+    int32_t frame_num = pager_lookup(pager, page_num);
+    if (frame_num == INVALID_FRAME_NUM || pager->frames[frame_num].pin_count == 0) {
+        printf("Tried to modify page %d which is not pinned\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    pager->frames[frame_num].dirty = true;
+    pthread_mutex_unlock(&pager->mutex);
 }
 
-// 打印数据
-void print_row(Row* row)
+// 初始化空的页集合
+// set: 集合
+void page_set_init(PageSet* set)
 {
-    printf("(%d %s %s)\n", row->id, row->username, row->email);
+    set->mask = 15;
+    set->count = 0;
+    set->generation = 1;
+    set->slots = calloc(set->mask + 1, sizeof(PageSetSlot));
 }
 
-// 打印常量
-void print_constants()
+// 释放页集合
+// set: 集合
+void page_set_close(PageSet* set)
 {
-    printf("uint8_t: %lu\n", sizeof(uint8_t));
-    printf("uint32_t: %lu\n", sizeof(uint32_t));
-    printf("ROW_SIZE: %d\n", ROW_SIZE);
-    printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-    printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
-    printf("INTERNAL_NODE_HEADER_SIZE %d\n", INTERNAL_NODE_HEADER_SIZE);
-    printf("INTERNAL_NODE_CELL_SIZE %d\n", INTERNAL_NODE_CELL_SIZE);
+    free(set->slots);
 }
 
-// 打印叶节点
-void print_leaf_node(void* node)
+// 清空页集合，代数回绕时才真正清除所有槽
+// set: 集合
+void page_set_clear(PageSet* set)
 {
-    uint32_t num_cells = *leaf_node_num_cells(node);
-    printf("leaf (size %d)\n", num_cells);
-    for (uint32_t i = 0; i < num_cells; i++) {
-        uint32_t key = *leaf_node_key(node, i);
-        printf("  - %d : %d\n", i, key);
+    set->count = 0;
+    set->generation += 1;
+    if (set->generation == 0) {
+        memset(set->slots, 0, (set->mask + 1) * sizeof(PageSetSlot));
+        set->generation = 1;
     }
 }
 
-// 打印进度
-void indent(uint32_t level)
+// 查找页在对应数组中的下标，不在集合中时返回 -1
+// set: 集合
+// page_num: 第几页
+int32_t page_set_find(PageSet* set, uint32_t page_num)
 {
-    for (uint32_t i = 0; i < level; i++) {
-        printf("  ");
+    for (uint32_t i = page_num & set->mask; set->slots[i].generation == set->generation; i = (i + 1) & set->mask) {
+        if (set->slots[i].page_num == page_num) {
+            return set->slots[i].position;
+        }
     }
+    return -1;
 }
 
-// 打印数据
-void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level)
+// 加入不在集合中的页，装填超过一半时槽数加倍
+// set: 集合
+// page_num: 第几页
+// position: 页在对应数组中的下标
+void page_set_put(PageSet* set, uint32_t page_num, uint32_t position)
 {
-    void* node = get_page(pager, page_num);
-    uint32_t num_keys, child;
-
-    switch (get_node_type(node)) {
-        case (NODE_LEAF):
-            num_keys = *leaf_node_num_cells(node);
-            indent(indentation_level);
-            printf("- leaf (size %d)\n", num_keys);
-            for (uint32_t i = 0; i < num_keys; i++) {
-                indent(indentation_level + 1);
-                printf("- %d\n", *leaf_node_key(node, i));
-            }
-            break;
-        case (NODE_INTERNAL):
-            num_keys = *internal_node_num_keys(node);
-            indent(indentation_level);
-            printf("- internal (size %d)\n", num_keys);
-            for (uint32_t i = 0; i < num_keys; i++) {
-                child = *internal_node_child(node, i);
-                print_tree(pager, child, indentation_level + 1);
-                indent(indentation_level + 1);
-                printf("- key %d\n", *internal_node_key(node, i));
+    if (2 * (set->count + 1) > set->mask + 1) {
+        PageSetSlot* old_slots = set->slots;
+        uint32_t old_size = set->mask + 1;
+        uint32_t old_generation = set->generation;
+        set->mask = 2 * old_size - 1;
+        set->generation = 1;
+        set->slots = calloc(set->mask + 1, sizeof(PageSetSlot));
+        set->count = 0;
+        for (uint32_t i = 0; i < old_size; i++) {
+            if (old_slots[i].generation == old_generation) {
+                page_set_put(set, old_slots[i].page_num, old_slots[i].position);
             }
-        child = *internal_node_right_child(node);
-        print_tree(pager, child, indentation_level + 1);
-        break;
+        }
+        free(old_slots);
     }
+
+    uint32_t i = page_num & set->mask;
+    while (set->slots[i].generation == set->generation) {
+        i = (i + 1) & set->mask;
+    }
+    set->slots[i].page_num = page_num;
+    set->slots[i].position = position;
+    set->slots[i].generation = set->generation;
+    set->count += 1;
 }
 
+// 在页表中查找页所在的帧，调用时需持有缓冲池锁
+// pager: 分页器
+// page_num: 第几页
+int32_t pager_lookup(Pager* pager, uint32_t page_num)
+{
+    int32_t frame_num = pager->page_table[page_num & pager->page_table_mask];
+    while (frame_num != INVALID_FRAME_NUM) {
+        if (pager->frames[frame_num].page_num == page_num) {
+            return frame_num;
+        }
+        frame_num = pager->frames[frame_num].next;
+    }
+    return INVALID_FRAME_NUM;
+}
 
-// 获取数据
-ExecuteResult execute_select(Statement* statement, Table* table)
+// 获取一个可用的帧，调用时需持有缓冲池锁
+// 1. 帧预算未用完时分配新帧
+// 2. 否则按 CLOCK 算法淘汰一个未固定的帧，脏页先写回日志，写回期间释放缓冲池锁
+// pager: 分页器
+uint32_t pager_find_victim(Pager* pager)
 {
-    Cursor* cursor = table_start(table);
-    Row row;
+    if (pager->num_frames_used < pager->max_frames) {
+        return pager->num_frames_used++;
+    }
 
-    while(!cursor->end_of_table) {
-        // 根据游标，反序列化
-        deserialize_row(cursor_value(cursor), &row);
-        // 打印
-        print_row(&row);
-        // 移动游标
-        cursor_advance(cursor);
+    // 转两圈：第一圈清除引用位，第二圈必然能找到未固定的帧
+    // 写回期间被其他线程固定或再次修改的帧不能淘汰，同样计入圈数，其他线程一直占用时按缓冲池耗尽处理
+    // 找不到时如果有写回或提交中临时固定的帧，等它们解除固定后再转两圈
+    while (true) {
+        for (uint32_t i = 0; i < 2 * pager->max_frames; i++) {
+            uint32_t frame_num = pager->clock_hand;
+            pager->clock_hand = (pager->clock_hand + 1) % pager->max_frames;
+
+            Frame* frame = &pager->frames[frame_num];
+            if (!frame->in_use) {
+                return frame_num;
+            }
+            if (frame->pin_count > 0) {
+                continue;
+            }
+            if (frame->referenced) {
+                frame->referenced = false;
+                continue;
+            }
+
+            // 写回脏页
+            if (frame->dirty) {
+                pager_flush(pager, frame_num);
+                if (frame->pin_count > 0 || frame->dirty) {
+                    continue;
+                }
+            }
+            // 丢弃映射页的私有副本，之后再访问时从文件重新映射
+            if (frame->mapped) {
+                madvise(frame->data, PAGE_SIZE, MADV_DONTNEED);
+            }
+
+            // 从页表中移除
+            int32_t* link = &pager->page_table[frame->page_num & pager->page_table_mask];
+            while (*link != (int32_t)frame_num) {
+                link = &pager->frames[*link].next;
+            }
+            *link = frame->next;
+            frame->in_use = false;
+            return frame_num;
+        }
+
+        if (pager->num_flushing == 0 && pager->num_committing == 0) {
+            break;
+        }
+        pthread_cond_wait(&pager->flushed, &pager->mutex);
     }
 
-    free(cursor);
+    printf("Buffer pool exhausted: all %d frames are pinned\n", pager->max_frames);
+    exit(EXIT_FAILURE);
+}
 
-    return EXECUTE_SUCCESS;
+// 根据行数返回数据地址
+void* cursor_value(Cursor* cursor)
+{
+    log_message(LOG_DEBUG, "cursor_value page_num:%d cell_num:%d", cursor->page_num, cursor->cell_num);
+    if (cursor->node != NULL) {
+        return leaf_node_value(cursor->node, cursor->cell_num);
+    }
+    uint32_t page_num = cursor->page_num;
+    // 游标已固定该页，这里取得地址后即可解除本次固定
+    void* page = get_page(cursor->table->pager, page_num);
+    unpin_page(cursor->table->pager, page_num);
+    return leaf_node_value(page, cursor->cell_num);
 }
 
-// 从文件中读取数据到内存
-// filename: 文件名
-Pager* pager_open(const char* filename)
+// 读取读者游标所在叶子节点中从当前单元开始的所有行，游标移到下一个叶子节点
+// 批次和游标交换副本，不拷贝行，返回的指针在下一次调用前有效
+// 游标已到表尾时返回 false
+// cursor: 游标
+// batch: 批次
+bool cursor_next_batch(Cursor* cursor, RowBatch* batch)
 {
-    // 1. 打开文件
-    int fd = open(filename,
-                    O_RDWR | O_CREAT,
-                    S_IWUSR | S_IRUSR
-                  ); // S_IWUSR  00200 user has write permission, 00400 user has read permission
-    if (fd == -1) {
-        printf("Unable to open file\n");
-        exit(EXIT_FAILURE);
+    if (cursor->end_of_table) {
+        return false;
     }
 
-    // 2. 移动到文件尾
-    off_t file_length = lseek(fd, 0, SEEK_END);
-    printf("pager_open file length:%lld\n", file_length);
-    // 整页保存，大小只能为4k的倍数
-    if (file_length % PAGE_SIZE != 0) {
-        printf("Db file is not a whole number of pages. Corrupt file.\n");
-        exit(EXIT_FAILURE);
+    // 1. 当前叶子节点的副本交给批次，收集行的位置
+    void* node = cursor->node;
+    cursor->node = batch->node;
+    batch->node = node;
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    batch->num_rows = 0;
+    for (uint32_t i = cursor->cell_num; i < num_cells; i++) {
+        batch->keys[batch->num_rows] = *leaf_node_key(node, i);
+        batch->values[batch->num_rows] = leaf_node_value(node, i);
+        batch->num_rows += 1;
     }
 
-    // 3. 初始化分页器
-    Pager* pager = malloc(sizeof(Pager));
-    pager->file_descriptor = fd;
-    pager->file_length = file_length;
-    pager->num_pages = (file_length / PAGE_SIZE);
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        pager->pages[i] = NULL;
+    // 2. 游标读取快照中的下一个叶子节点
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    if (next_page_num == 0) {
+        cursor->end_of_table = true;
     }
+    else {
+        pager_read_page(cursor->table->pager, next_page_num, cursor->snapshot, cursor->node);
+        cursor->page_num = next_page_num;
+        cursor->cell_num = 0;
+    }
+    return true;
+}
 
-    return pager;
+// 创建输出缓存
+// stream: 写出的目标
+OutputBuffer* new_output_buffer(FILE* stream)
+{
+    OutputBuffer* output = malloc(sizeof(OutputBuffer));
+    output->data = malloc(OUTPUT_BUFFER_INITIAL_SIZE);
+    output->length = 0;
+    output->capacity = OUTPUT_BUFFER_INITIAL_SIZE;
+    output->stream = stream;
+    return output;
 }
 
-// 打开数据库
-// 1、打开文件，初始化分页器
-// 2、使用分页器初始化表
-// filename: 文件名
-Table* db_open(const char* filename)
+// 保证输出缓存还能写入 length 字节
+// output: 输出缓存
+// length: 需要的字节数
+void output_reserve(OutputBuffer* output, size_t length)
 {
-    // 从文件中初始化分页器
-    Pager* pager = pager_open(filename);
+    if (output->length + length <= output->capacity) {
+        return;
+    }
+    while (output->length + length > output->capacity) {
+        output->capacity *= 2;
+    }
+    output->data = realloc(output->data, output->capacity);
+}
 
-    Table* table = malloc(sizeof(Table));
-    table->pager = pager;
-    table->root_page_num = 0;
+// 按 print_row 的格式把页内的行写入输出缓存
+// output: 输出缓存
+// key: 键
+// value: 序列化的行
+void output_row(OutputBuffer* output, uint32_t key, void* value)
+{
+    uint8_t username_length = *(uint8_t*)(value + ID_SIZE);
+    char* username = value + ID_SIZE + ROW_LENGTH_SIZE;
+    uint8_t email_length = *(uint8_t*)(username + username_length);
+    char* email = username + username_length + ROW_LENGTH_SIZE;
+    output_reserve(output, 10 + username_length + email_length + 5);
 
-    if(pager->num_pages == 0) {
-        void* root_node = get_page(pager, 0);
-        initialize_leaf_node(root_node);
-        set_node_root(root_node, true);
+    // 1. id，从低位开始转换
+    char digits[10];
+    uint32_t num_digits = 0;
+    do {
+        digits[num_digits++] = '0' + key % 10;
+        key /= 10;
+    } while (key > 0);
+
+    char* out = output->data + output->length;
+    *out++ = '(';
+    while (num_digits > 0) {
+        *out++ = digits[--num_digits];
     }
 
-    return table;
+    // 2. 用户名和邮箱
+    *out++ = ' ';
+    memcpy(out, username, username_length);
+    out += username_length;
+    *out++ = ' ';
+    memcpy(out, email, email_length);
+    out += email_length;
+    *out++ = ')';
+    *out++ = '\n';
+    output->length = out - output->data;
 }
 
-// 将分页器数据存入磁盘
-// pager:       分页器
-// page_num:    第几页
-void pager_flush(Pager* pager, uint32_t page_num)
+// 写出输出缓存中的内容
+// output: 输出缓存
+void output_flush(OutputBuffer* output)
 {
-    printf("pager_flush page_num:%d\n", page_num);
-    // 1. 判断数据是否为空
-    if(pager->pages[page_num] == NULL) {
-        printf("Tried to flush null page\n");
-        exit(EXIT_FAILURE);
+    if (output->length > 0) {
+        fwrite(output->data, 1, output->length, output->stream);
+        output->length = 0;
     }
+}
 
-    // 2. 移动到第n页头
-    off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-    if (offset == -1) {
-        printf("Error seeking: %d\n", errno);
-        exit(EXIT_FAILURE);
+// 写出剩余内容并释放输出缓存
+// output: 输出缓存
+void close_output_buffer(OutputBuffer* output)
+{
+    output_flush(output);
+    free(output->data);
+    free(output);
+}
+
+// 将行插入到表中
+// 多行时按 id 排序后在一个事务中插入，连续落在同一叶子节点的行不必再从根节点查找；
+// 任何一行重复时回滚整条语句
+// statement: 语句
+// table: 表
+// in_transaction: 是否在显式事务中，是时写锁已持有，由 commit 提交
+ExecuteResult execute_insert(Statement* statement, Table* table, bool in_transaction)
+{
+    // 1. 排序，语句内重复的 id 不需要修改表就能发现
+    Row* rows = statement->rows != NULL ? statement->rows : &statement->row_to_insert;
+    uint32_t num_rows = statement->rows != NULL ? statement->num_rows : 1;
+    if (num_rows > 1) {
+        qsort(rows, num_rows, sizeof(Row), compare_row_id);
+        for (uint32_t i = 1; i < num_rows; i++) {
+            if (rows[i].id == rows[i - 1].id) {
+                return EXECUTE_DUPLICATE_KEY;
+            }
+        }
     }
 
-    // 3. 写入数据
-    ssize_t bytes_written = write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
-    if (bytes_written == -1) {
-        printf("Error writing: %d\n", errno);
-        exit(EXIT_FAILURE);
+    // 2. 逐行插入，显式事务中失败时只撤销本语句
+    if (in_transaction) {
+        pager_savepoint(table->pager);
+    }
+    else {
+        pager_begin_write(table->pager);
+    }
+    uint32_t leaf_page_num = INVALID_PAGE_NUM;
+    for (uint32_t i = 0; i < num_rows; i++) {
+        ExecuteResult result = table_insert_row(table, &rows[i], &leaf_page_num);
+        if (result == EXECUTE_SUCCESS) {
+            continue;
+        }
+        if (in_transaction) {
+            pager_rollback_savepoint(table->pager);
+            table->rightmost_leaf_page_num = INVALID_PAGE_NUM; // 可能是被丢弃的页
+        }
+        else {
+            table_rollback(table);
+        }
+        return result;
+    }
+
+    // 3. 整条语句一起提交
+    if (in_transaction) {
+        pager_release_savepoint(table->pager);
+    }
+    else {
+        pager_commit(table->pager);
     }
+    return EXECUTE_SUCCESS;
 }
 
-// 释放表
-// table：表
-void free_table(Table* table)
+// 开始、提交或回滚显式事务
+// 事务从 begin 持有写锁到 commit 或 rollback，其间其他连接的插入等待，查询不受影响
+// statement: 语句
+// table: 表
+// in_transaction: 是否在显式事务中，返回执行后的状态
+ExecuteResult execute_transaction(Statement* statement, Table* table, bool* in_transaction)
 {
-    for (uint32_t i = 0; i < TABLE_MAX_ROWS; i ++) {
-        free(table->pager->pages);
+    if (statement->type == STATEMENT_BEGIN) {
+        if (*in_transaction) {
+            return EXECUTE_NESTED_TRANSACTION;
+        }
+        pager_begin_write(table->pager);
+        *in_transaction = true;
+        return EXECUTE_SUCCESS;
     }
-    free(table->pager);
-    free(table);
+
+    if (!*in_transaction) {
+        return EXECUTE_NO_TRANSACTION;
+    }
+    if (statement->type == STATEMENT_COMMIT) {
+        pager_commit(table->pager);
+    }
+    else {
+        table_rollback(table);
+    }
+    *in_transaction = false;
+    return EXECUTE_SUCCESS;
 }
 
-// 根据类型执行操作
-ExecuteResult execute_statement(Statement* statement, Table* table)
+// 回滚当前写操作并结束写操作
+// table: 表
+void table_rollback(Table* table)
 {
-    switch(statement->type) {
-        case (STATEMENT_INSERT):
-            printf("This is where we would do an insert.\n");
-            printf("> insert %d %s %s\n", statement->row_to_insert.id, statement->row_to_insert.username, statement->row_to_insert.email);
-            return execute_insert(statement, table);
-            break;
-        case (STATEMENT_SELECT):
-            printf("This is where we would do a select.\n");
-            return execute_select(statement, table);
-            break;
-    }
+    pager_rollback(table->pager);
+    table->rightmost_leaf_page_num = INVALID_PAGE_NUM; // 可能是被丢弃的页
 }
 
-// 创建开始游标
-Cursor* table_start(Table* table)
+// 在写操作中插入一行
+// leaf_page_num 记住上一行所在的叶子节点：键比该节点的最大键小，或该节点是最右叶子节点时，
+// 键一定属于该节点，直接在节点内查找位置
+// table: 表
+// row: 行
+// leaf_page_num: 上一行所在的叶子节点，返回本行所在的叶子节点，节点被拆分时为 INVALID_PAGE_NUM
+ExecuteResult table_insert_row(Table* table, Row* row, uint32_t* leaf_page_num)
 {
-    Cursor* cursor = table_find(table, 0);
+    // 1. 根据键值找到游标
+    Pager* pager = table->pager;
+    uint32_t key_to_insert = row->id;
+    Cursor* cursor = NULL;
+    if (*leaf_page_num != INVALID_PAGE_NUM) {
+        void* node = get_page(pager, *leaf_page_num);
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        if (*leaf_node_next_leaf(node) == 0 || (num_cells > 0 && key_to_insert < *leaf_node_key(node, num_cells - 1))) {
+            cursor = leaf_node_find(table, *leaf_page_num, node, key_to_insert);
+        }
+        else {
+            unpin_page(pager, *leaf_page_num);
+        }
+    }
+    if (cursor == NULL) {
+        cursor = table_find_append(table, key_to_insert);
+    }
+    if (cursor == NULL) {
+        cursor = table_find_for_insert(table, key_to_insert);
+    }
 
-    void* node = get_page(table->pager, cursor->page_num);
-    uint32_t num_cells = *leaf_node_num_cells(node);
-    cursor->end_of_table = (num_cells == 0);
+    // 2. id 重复，返回错误
+    void* node = get_page(pager, cursor->page_num);
+    uint32_t num_cells = (*leaf_node_num_cells(node));
+    bool duplicate = cursor->cell_num < num_cells && *leaf_node_key(node, cursor->cell_num) == key_to_insert;
+    if (*leaf_node_next_leaf(node) == 0) {
+        table->rightmost_leaf_page_num = cursor->page_num; // 记住最右叶子节点
+    }
+    if (duplicate) {
+        unpin_page(pager, cursor->page_num);
+        cursor_free(cursor);
+        return EXECUTE_DUPLICATE_KEY;
+    }
 
-    return cursor;
+    // 3. 编码后插入数据，Row 的定长布局不小于编码的最大长度
+    char value[sizeof(Row)];
+    uint32_t length = serialize_row(row, value);
+    bool split = leaf_node_free_space(node) < length + LEAF_NODE_SLOT_SIZE;
+    unpin_page(pager, cursor->page_num);
+    leaf_node_insert(cursor, key_to_insert, value, length);
+
+    // 4. 拆分后行可能在新节点中，下一行重新查找
+    *leaf_page_num = split ? INVALID_PAGE_NUM : cursor->page_num;
+    cursor_free(cursor);
+
+    // 5. 维护二级索引
+    for (uint32_t i = 0; i < INDEX_COUNT; i++) {
+        if (table->indexes[i] != NULL) {
+            index_insert(table->indexes[i], row->id, row_column(row, i));
+        }
+    }
+    return EXECUTE_SUCCESS;
 }
 
-// 创建结束游标
-Cursor* table_end(Table* table)
+// 按 id 比较行，用于排序
+int compare_row_id(const void* a, const void* b)
 {
-    Cursor* cursor = malloc(sizeof(Cursor));
-    cursor->table = table;
-    cursor->page_num = table->root_page_num;
-
-    void* root_node = get_page(table->pager, table->root_page_num);
-    uint32_t num_cells = *leaf_node_num_cells(root_node);
-    cursor->cell_num = num_cells;
-    cursor->end_of_table = true;
-    return cursor;
+    uint32_t id_a = ((Row*)a)->id;
+    uint32_t id_b = ((Row*)b)->id;
+    return (id_a > id_b) - (id_a < id_b);
 }
 
-// 向前移动游标
-void cursor_advance(Cursor* cursor)
+// 比较 id，用于排序
+int compare_id(const void* a, const void* b)
 {
-    uint32_t page_num = cursor->page_num;
-    void* node = get_page(cursor->table->pager, page_num);
+    uint32_t id_a = *(uint32_t*)a;
+    uint32_t id_b = *(uint32_t*)b;
+    return (id_a > id_b) - (id_a < id_b);
+}
 
-    cursor->cell_num += 1;
-    if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
-        // 移动到下一个兄弟叶子节点
-        uint32_t next_page_num = *leaf_node_next_leaf(node);
-        if (next_page_num == 0) {
-            // 最右边节点
-            cursor->end_of_table = true;
+// 打开二级索引，索引是与表共用分页器的 B 树，根节点所在页记录在文件头中
+// table: 表
+// header: 文件头
+void table_open_indexes(Table* table, DbHeader* header)
+{
+    Pager* pager = table->pager;
+    for (uint32_t i = 0; i < INDEX_COUNT; i++) {
+        table->indexes[i] = NULL;
+        if (header->index_root_page_nums[i] == 0) {
+            continue;
         }
-        else {
-            cursor->page_num = next_page_num;
-            cursor->cell_num = 0;
+        if (header->index_root_page_nums[i] >= pager->num_pages) {
+            printf("Index root page %d is beyond the end of the database\n", header->index_root_page_nums[i]);
+            exit(EXIT_FAILURE);
         }
+
+        Table* index = malloc(sizeof(Table));
+        index->pager = pager;
+        index->root_page_num = header->index_root_page_nums[i];
+        index->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+        index->leaf_splits = 0;
+        index->internal_splits = 0;
+        for (uint32_t j = 0; j < INDEX_COUNT; j++) {
+            index->indexes[j] = NULL;
+        }
+        table->indexes[i] = index;
     }
 }
 
-// 叶子节点单元的数量
-// node: 节点
-uint32_t* leaf_node_num_cells(void* node)
+// 为表中所有行建立二级索引，批量导入后在同一个写操作中调用
+// table: 表
+void table_build_indexes(Table* table)
 {
-    return node + LEAF_NODE_NUM_CELLS_OFFSET;
+    if (table->indexes[0] == NULL) {
+        return;
+    }
+
+    Cursor* cursor = table_start(table, SNAPSHOT_LATEST);
+    RowBatch* batch = malloc(sizeof(RowBatch));
+    batch->node = page_buffer_alloc();
+    Row row;
+    while (cursor_next_batch(cursor, batch)) {
+        for (uint32_t i = 0; i < batch->num_rows; i++) {
+            deserialize_row(batch->values[i], &row);
+            for (uint32_t j = 0; j < INDEX_COUNT; j++) {
+                index_insert(table->indexes[j], row.id, row_column(&row, j));
+            }
+        }
+    }
+    page_buffer_free(batch->node);
+    free(batch);
+    cursor_free(cursor);
 }
 
-// 获取单元
-// node: 节点
-// cell_num: 第几个cell
-void* leaf_node_cell(void* node, uint32_t cell_num)
+// 行中建有索引的列
+// row: 行
+// column: 列
+char* row_column(Row* row, IndexColumn column)
 {
-    return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+    return column == INDEX_USERNAME ? row->username : row->email;
 }
 
-// 获取页节点键
-// node: 节点
-// cell_num: 第几个cell
-uint32_t* leaf_node_key(void* node, uint32_t cell_num)
+// 列值在索引中的键，FNV-1a 哈希
+// value: 列值
+uint32_t index_key(const char* value)
 {
-    return leaf_node_cell(node, cell_num);
+    uint32_t hash = 2166136261u;
+    for (const char* c = value; *c != '\0'; c++) {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    return hash;
 }
 
-// 获取页节点数据
-// node: 节点
-// cell_num: 第几个cell
-void* leaf_node_value(void* node, uint32_t cell_num)
+// 把 (列值, id) 插入索引
+// 索引的键是列值的哈希，允许重复，哈希相同的项相邻存放，插入到这段的开头，只需一次从根节点的查找
+// 单元的数据为 id + 列值长度 + 列值，与行的编码方式相同
+// index: 索引
+// id: 行的 id
+// value: 列值
+void index_insert(Table* index, uint32_t id, const char* value)
 {
-    return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+    uint32_t length = strlen(value);
+    uint8_t entry[sizeof(Row)];
+    memcpy(entry, &id, ID_SIZE);
+    entry[ID_SIZE] = length;
+    memcpy(entry + ID_SIZE + ROW_LENGTH_SIZE, value, length);
+
+    uint32_t key = index_key(value);
+    Cursor* cursor = table_find_for_insert(index, key);
+    leaf_node_insert(cursor, key, entry, ID_SIZE + ROW_LENGTH_SIZE + length);
+    cursor_free(cursor);
 }
 
-// 初始化叶子节点
-// 1. 设置节点类型
-// 2. 设置为非根节点
-// 3. 重置单元数
-// 4. 重置下一个兄弟节点
-// node: 节点
-void initialize_leaf_node(void* node)
+// 在快照中查找列值等于 value 的行的 id
+// index: 索引
+// value: 列值
+// snapshot: 快照
+// ids: 返回按 id 排序的数组，由调用者释放
+// 返回 id 的个数
+uint32_t index_find(Table* index, const char* value, uint64_t snapshot, uint32_t** ids)
 {
-    set_node_type(node, NODE_LEAF);
-    set_node_root(node, false);
-    *leaf_node_num_cells(node) = 0;
-    *leaf_node_next_leaf(node) = 0; // 0 表示没有兄弟节点
+    uint32_t key = index_key(value);
+    uint32_t length = strlen(value);
+    uint32_t num_ids = 0;
+    uint32_t capacity = 16;
+    *ids = malloc(capacity * sizeof(uint32_t));
+
+    // 从哈希相同的第一项开始读，列值相同的项就是要找的行，其余是哈希冲突的其他列值
+    Cursor* cursor = table_seek(index, key, snapshot);
+    while (!cursor->end_of_table && *leaf_node_key(cursor->node, cursor->cell_num) == key) {
+        uint8_t* entry = leaf_node_value(cursor->node, cursor->cell_num);
+        if (entry[ID_SIZE] == length && memcmp(entry + ID_SIZE + ROW_LENGTH_SIZE, value, length) == 0) {
+            if (num_ids == capacity) {
+                capacity *= 2;
+                *ids = realloc(*ids, capacity * sizeof(uint32_t));
+            }
+            memcpy(&(*ids)[num_ids++], entry, ID_SIZE);
+        }
+        cursor_advance(cursor);
+    }
+    cursor_free(cursor);
+
+    qsort(*ids, num_ids, sizeof(uint32_t), compare_id);
+    return num_ids;
 }
 
-// 初始化内部节点
-// 1、设置节点类型
-// 2、设置为非根节点
-// 3、重置键数
-// node: 节点
-void initialize_internal_node(void* node)
+// 根据键返回快照中的游标，读者使用
+// 每层读取节点在快照中的副本，快照中的树是一致的，不需要锁住路径
+// 根节点附近的内部节点在上层节点缓存中时直接使用缓存的副本
+// table: 表
+// key: 键值
+// snapshot: 快照
+Cursor* table_find(Table* table, uint32_t key, uint64_t snapshot)
 {
-    set_node_type(node, NODE_INTERNAL);
-    set_node_root(node, false);
-    *internal_node_num_keys(node) = 0;
+    Pager* pager = table->pager;
+    uint32_t page_num = table->root_page_num;
+    uint32_t depth = 0;
+    void* node = page_buffer_alloc();
+    while (true) {
+        // 1. 上层内部节点先查缓存，命中时不经过缓冲池
+        uint64_t generation = 1;
+        if (depth < NODE_CACHE_LEVELS && node_cache_find_child(pager, page_num, snapshot, key, &page_num, &generation)) {
+            depth += 1;
+            continue;
+        }
+
+        // 2. 读取快照中的副本，未命中的上层内部节点读取后加入缓存
+        pager_read_page(pager, page_num, snapshot, node);
+        if (get_node_type(node) == NODE_LEAF) {
+            break;
+        }
+        if (depth < NODE_CACHE_LEVELS) {
+            node_cache_put(pager, page_num, node, snapshot, generation);
+        }
+        page_num = *internal_node_child(node, internal_node_find_child(node, key));
+        depth += 1;
+    }
+
+    Cursor* cursor = leaf_node_find(table, page_num, node, key);
+    cursor->snapshot = snapshot;
+    cursor->node = node;
+    return cursor;
+}
+
+// 根据键返回插入位置的游标，写者使用
+// 写者是唯一修改页的线程，直接读取当前页，游标持有叶子节点的固定
+// table: 表
+// key: 键值
+Cursor* table_find_for_insert(Table* table, uint32_t key)
+{
+    Pager* pager = table->pager;
+    uint32_t page_num = table->root_page_num;
+
+    // 缓存项没有失效时就是当前页，写者也可以使用
+    uint64_t generation;
+    for (uint32_t depth = 0; depth < NODE_CACHE_LEVELS; depth++) {
+        if (!node_cache_find_child(pager, page_num, SNAPSHOT_LATEST, key, &page_num, &generation)) {
+            break;
+        }
+    }
+
+    while (true) {
+        void* node = get_page(pager, page_num);
+        if (get_node_type(node) == NODE_LEAF) {
+            return leaf_node_find(table, page_num, node, key);
+        }
+        uint32_t child_page_num = *internal_node_child(node, internal_node_find_child(node, key));
+        unpin_page(pager, page_num);
+        page_num = child_page_num;
+    }
+}
+
+// 键大于表中所有键时，直接返回最右叶子节点末尾的游标，省去从根节点的查找
+// 否则返回 NULL
+// 没有兄弟节点的叶子节点一定是最右叶子节点，所以记住的页只需检查这一点
+// table: 表
+// key: 键值
+Cursor* table_find_append(Table* table, uint32_t key)
+{
+    uint32_t page_num = table->rightmost_leaf_page_num;
+    if (page_num == INVALID_PAGE_NUM) {
+        return NULL;
+    }
+
+    void* node = get_page(table->pager, page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (get_node_type(node) != NODE_LEAF || *leaf_node_next_leaf(node) != 0 ||
+        (num_cells > 0 && key <= *leaf_node_key(node, num_cells - 1))) {
+        unpin_page(table->pager, page_num);
+        return NULL;
+    }
+
+    // 游标持有该页的固定
+    Cursor* cursor = cursor_alloc();
+    cursor->table = table;
+    cursor->page_num = page_num;
+    cursor->cell_num = num_cells;
+    cursor->end_of_table = true;
+    cursor->snapshot = 0;
+    cursor->node = NULL;
+    return cursor;
+}
+
+// 节点是否在树的最右边，即其最右子树的叶子节点没有兄弟节点
+// pager: 分页器
+// page_num: 节点所在页
+bool node_is_rightmost(Pager* pager, uint32_t page_num)
+{
+    while (true) {
+        void* node = get_page(pager, page_num);
+        if (get_node_type(node) == NODE_LEAF) {
+            bool rightmost = *leaf_node_next_leaf(node) == 0;
+            unpin_page(pager, page_num);
+            return rightmost;
+        }
+        uint32_t right_child_page_num = *internal_node_right_child(node);
+        unpin_page(pager, page_num);
+        page_num = right_child_page_num;
+    }
+}
+
+// 在叶子节点中查找键，返回游标
+// 写者的游标持有调用者对该页的固定，读者的游标由调用者设置快照和副本
+// table: 表
+// page_num: 第几页
+// node: 节点
+// key: 键值
+Cursor* leaf_node_find(Table* table, uint32_t page_num, void* node, uint32_t key)
+{
+    uint32_t num_cells = *leaf_node_num_cells(node);
+
+    Cursor* cursor = cursor_alloc();
+    cursor->table = table;
+    cursor->page_num = page_num;
+    cursor->snapshot = 0;
+    cursor->node = NULL;
+
+    // 第一个不小于键的位置，键存在时即键所在的单元，否则为插入位置
+    cursor->cell_num = node_lower_bound(leaf_node_cell(node, 0), LEAF_NODE_SLOT_SIZE, LEAF_NODE_KEY_OFFSET, num_cells, key);
+    log_message(LOG_DEBUG, "leaf_node_find cursor page_num:%d cell_num:%d", page_num, cursor->cell_num);
+    return cursor;
+}
+
+// 返回键所在子节点的序号
+// node: 内部节点
+// key: 键值
+uint32_t internal_node_find_child(void* node, uint32_t key)
+{
+    // 第一个不小于键的键对应的子节点，都小于时为最右子节点（子节点比键多1）
+    uint32_t num_keys = *internal_node_num_keys(node);
+    return node_lower_bound((uint8_t*)internal_node_cell(node, 0), INTERNAL_NODE_CELL_SIZE, INTERNAL_NODE_CHILD_SIZE, num_keys, key);
+}
+
+// 在节点的有序键中查找第一个不小于 key 的位置，键都小于 key 时返回 num_keys
+// 键存放在等长的单元中（叶子节点的槽、内部节点的单元），与数据分开，相邻的键相隔 cell_size 字节
+// 1. 无分支二分查找：每次比较的结果通过条件传送更新下界，没有难以预测的分支，范围缩小到 NODE_SEARCH_WINDOW 个键以内
+// 2. 剩余的键与 key 逐个比较，小于 key 的个数即下界在范围内的偏移；有 SSE2 且单元为 8 字节时一次比较 4 个键
+// cells: 第一个单元
+// cell_size: 单元大小
+// key_offset: 键在单元中的偏移
+// num_keys: 键数
+// key: 键值
+uint32_t node_lower_bound(uint8_t* cells, uint32_t cell_size, uint32_t key_offset, uint32_t num_keys, uint32_t key)
+{
+    // 下界始终在 [base, base + n] 中
+    uint32_t base = 0;
+    uint32_t n = num_keys;
+    while (n > NODE_SEARCH_WINDOW) {
+        uint32_t half = n / 2;
+        uint32_t key_at_half = *(uint32_t*)(cells + (base + half - 1) * cell_size + key_offset);
+        base = key_at_half < key ? base + half : base;
+        n -= half;
+    }
+
+    uint32_t count = 0;
+    uint32_t i = 0;
+#ifdef __SSE2__
+    if (cell_size == 8) {
+        // 两次加载 4 个单元，取出其中的键；SSE2 只有有符号比较，两边都翻转符号位
+        __m128i sign = _mm_set1_epi32(INT32_MIN);
+        __m128i target = _mm_xor_si128(_mm_set1_epi32(key), sign);
+        for (; i + 4 <= n; i += 4) {
+            uint8_t* cell = cells + (base + i) * cell_size;
+            __m128 low = _mm_loadu_ps((float*)cell);
+            __m128 high = _mm_loadu_ps((float*)(cell + 16));
+            __m128 keys = key_offset == 0 ? _mm_shuffle_ps(low, high, _MM_SHUFFLE(2, 0, 2, 0))
+                                          : _mm_shuffle_ps(low, high, _MM_SHUFFLE(3, 1, 3, 1));
+            __m128i less = _mm_cmplt_epi32(_mm_xor_si128(_mm_castps_si128(keys), sign), target);
+            count += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(less)));
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        count += *(uint32_t*)(cells + (base + i) * cell_size + key_offset) < key;
+    }
+    return base + count;
+}
+
+// 打印数据
+void print_row(Row* row)
+{
+    printf("(%d %s %s)\n", row->id, row->username, row->email);
+}
+
+// 打印常量
+void print_constants()
+{
+    printf("uint8_t: %lu\n", sizeof(uint8_t));
+    printf("uint32_t: %lu\n", sizeof(uint32_t));
+    printf("ROW_SIZE: %d\n", ROW_SIZE);
+    printf("ROW_MAX_SIZE: %d\n", ROW_MAX_SIZE);
+    printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+    printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+    printf("LEAF_NODE_SLOT_SIZE: %d\n", LEAF_NODE_SLOT_SIZE);
+    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
+    printf("LEAF_NODE_MAX_VALUE_SIZE: %d\n", LEAF_NODE_MAX_VALUE_SIZE);
+    printf("INTERNAL_NODE_HEADER_SIZE %d\n", INTERNAL_NODE_HEADER_SIZE);
+    printf("INTERNAL_NODE_CELL_SIZE %d\n", INTERNAL_NODE_CELL_SIZE);
+    printf("INTERNAL_NODE_MAX_CELLS %d\n", INTERNAL_NODE_MAX_CELLS);
+}
+
+// 统计计数加上 value，多个线程可能同时增加同一个计数
+// counter: 计数
+// value: 增量
+void stats_add(uint64_t* counter, uint64_t value)
+{
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+// 收集表的统计：分页器和拆分（包括二级索引）的计数，以及遍历快照中的主键树得到的高度、节点数和叶子节点装填率
+// table: 表
+// stats: 返回统计
+void table_stats(Table* table, TableStats* stats)
+{
+    // 1. 计数，在遍历之前读取，不包括遍历本身的读取
+    PagerStats* pager_stats = &table->pager->stats;
+    stats->pager.cache_hits = __atomic_load_n(&pager_stats->cache_hits, __ATOMIC_RELAXED);
+    stats->pager.cache_misses = __atomic_load_n(&pager_stats->cache_misses, __ATOMIC_RELAXED);
+    stats->pager.bytes_read = __atomic_load_n(&pager_stats->bytes_read, __ATOMIC_RELAXED);
+    stats->pager.bytes_written = __atomic_load_n(&pager_stats->bytes_written, __ATOMIC_RELAXED);
+    stats->pager.flushes = __atomic_load_n(&pager_stats->flushes, __ATOMIC_RELAXED);
+    stats->pager.node_cache_hits = __atomic_load_n(&pager_stats->node_cache_hits, __ATOMIC_RELAXED);
+    stats->leaf_splits = __atomic_load_n(&table->leaf_splits, __ATOMIC_RELAXED);
+    stats->internal_splits = __atomic_load_n(&table->internal_splits, __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < INDEX_COUNT; i++) {
+        if (table->indexes[i] != NULL) {
+            stats->leaf_splits += __atomic_load_n(&table->indexes[i]->leaf_splits, __ATOMIC_RELAXED);
+            stats->internal_splits += __atomic_load_n(&table->indexes[i]->internal_splits, __ATOMIC_RELAXED);
+        }
+    }
+
+    // 2. 遍历树
+    stats->tree_height = 0;
+    stats->num_internal_nodes = 0;
+    stats->num_leaf_nodes = 0;
+    stats->num_rows = 0;
+    uint64_t used_bytes = 0;
+    VersionStore* versions = table->pager->versions;
+    uint64_t snapshot = version_store_begin_snapshot(versions);
+    table_stats_visit(table, table->root_page_num, 1, snapshot, stats, &used_bytes);
+    version_store_end_snapshot(versions, snapshot);
+    stats->leaf_fill = (double)used_bytes / ((double)stats->num_leaf_nodes * LEAF_NODE_SPACE_FOR_CELLS);
+}
+
+// 递归统计子树
+// table: 表
+// page_num: 子树的根节点
+// depth: 节点所在层，根节点为 1
+// snapshot: 快照
+// stats: 累加统计
+// used_bytes: 累加叶子节点已用的空间
+void table_stats_visit(Table* table, uint32_t page_num, uint32_t depth, uint64_t snapshot, TableStats* stats, uint64_t* used_bytes)
+{
+    void* node = page_buffer_alloc();
+    pager_read_page(table->pager, page_num, snapshot, node);
+    if (get_node_type(node) == NODE_LEAF) {
+        if (depth > stats->tree_height) {
+            stats->tree_height = depth;
+        }
+        stats->num_leaf_nodes += 1;
+        stats->num_rows += *leaf_node_num_cells(node);
+        *used_bytes += LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(node);
+    }
+    else {
+        stats->num_internal_nodes += 1;
+        uint32_t num_keys = *internal_node_num_keys(node);
+        for (uint32_t i = 0; i <= num_keys; i++) {
+            table_stats_visit(table, *internal_node_child(node, i), depth + 1, snapshot, stats, used_bytes);
+        }
+    }
+    page_buffer_free(node);
+}
+
+// 打印统计
+void print_stats(TableStats* stats)
+{
+    uint64_t lookups = stats->pager.cache_hits + stats->pager.cache_misses;
+    printf("cache_hits: %" PRIu64 "\n", stats->pager.cache_hits);
+    printf("cache_misses: %" PRIu64 "\n", stats->pager.cache_misses);
+    printf("cache_hit_rate: %.1f%%\n", lookups > 0 ? 100.0 * stats->pager.cache_hits / lookups : 0.0);
+    printf("bytes_read: %" PRIu64 "\n", stats->pager.bytes_read);
+    printf("bytes_written: %" PRIu64 "\n", stats->pager.bytes_written);
+    printf("flushes: %" PRIu64 "\n", stats->pager.flushes);
+    printf("node_cache_hits: %" PRIu64 "\n", stats->pager.node_cache_hits);
+    printf("leaf_splits: %" PRIu64 "\n", stats->leaf_splits);
+    printf("internal_splits: %" PRIu64 "\n", stats->internal_splits);
+    printf("tree_height: %d\n", stats->tree_height);
+    printf("internal_nodes: %d\n", stats->num_internal_nodes);
+    printf("leaf_nodes: %d\n", stats->num_leaf_nodes);
+    printf("rows: %" PRIu64 "\n", stats->num_rows);
+    printf("leaf_fill: %.1f%%\n", 100.0 * stats->leaf_fill);
+}
+
+// 打印叶节点
+void print_leaf_node(void* node)
+{
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    printf("leaf (size %d)\n", num_cells);
+    for (uint32_t i = 0; i < num_cells; i++) {
+        uint32_t key = *leaf_node_key(node, i);
+        printf("  - %d : %d\n", i, key);
+    }
+}
+
+// 打印进度
+void indent(uint32_t level)
+{
+    for (uint32_t i = 0; i < level; i++) {
+        printf("  ");
+    }
+}
+
+// 打印数据
+void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level)
+{
+    void* node = get_page(pager, page_num);
+    uint32_t num_keys, child;
+
+    switch (get_node_type(node)) {
+        case (NODE_LEAF):
+            num_keys = *leaf_node_num_cells(node);
+            indent(indentation_level);
+            printf("- leaf (size %d)\n", num_keys);
+            for (uint32_t i = 0; i < num_keys; i++) {
+                indent(indentation_level + 1);
+                printf("- %d\n", *leaf_node_key(node, i));
+            }
+            break;
+        case (NODE_INTERNAL):
+            num_keys = *internal_node_num_keys(node);
+            indent(indentation_level);
+            printf("- internal (size %d)\n", num_keys);
+            for (uint32_t i = 0; i < num_keys; i++) {
+                child = *internal_node_child(node, i);
+                print_tree(pager, child, indentation_level + 1);
+                indent(indentation_level + 1);
+                printf("- key %d\n", *internal_node_key(node, i));
+            }
+        child = *internal_node_right_child(node);
+        print_tree(pager, child, indentation_level + 1);
+        break;
+    }
+    unpin_page(pager, page_num);
+}
+
+
+// 获取数据
+// stream: 结果写出的目标
+ExecuteResult execute_select(Statement* statement, Table* table, bool in_transaction, FILE* stream)
+{
+    if (statement->op == SELECT_USERNAME_EQUAL || statement->op == SELECT_EMAIL_EQUAL) {
+        return execute_select_column(statement, table, in_transaction, stream);
+    }
+
+    uint32_t min_id;
+    uint32_t max_id;
+    statement_select_range(statement, &min_id, &max_id);
+    if (min_id > max_id) {
+        return EXECUTE_SUCCESS;
+    }
+
+    // 在快照中从下界开始沿叶子节点链表扫描，每次取一个叶子节点的所有行，超过上界时停止
+    // 扫描不持有任何锁，同时进行的插入不会被阻塞，也不会被看到
+    // 显式事务中已持有写锁，直接读取当前页，看到事务自己的修改
+    VersionStore* versions = table->pager->versions;
+    uint64_t snapshot = in_transaction ? SNAPSHOT_LATEST : version_store_begin_snapshot(versions);
+    Cursor* cursor = table_seek(table, min_id, snapshot);
+    OutputBuffer* output = new_output_buffer(stream);
+    RowBatch* batch = malloc(sizeof(RowBatch));
+    batch->node = page_buffer_alloc();
+
+    bool done = false;
+    while (!done && cursor_next_batch(cursor, batch)) {
+        // 直接从页内格式化，不反序列化
+        for (uint32_t i = 0; i < batch->num_rows; i++) {
+            if (batch->keys[i] > max_id) {
+                done = true;
+                break;
+            }
+            output_row(output, batch->keys[i], batch->values[i]);
+        }
+        // 每批写出一次
+        output_flush(output);
+    }
+
+    page_buffer_free(batch->node);
+    free(batch);
+    close_output_buffer(output);
+    cursor_free(cursor);
+    if (!in_transaction) {
+        version_store_end_snapshot(versions, snapshot);
+    }
+
+    return EXECUTE_SUCCESS;
+}
+
+// 按 username 或 email 相等查询，结果按 id 排序
+// 有索引时从索引得到 id 再逐个按 id 查找，否则扫描全表比较该列
+// stream: 结果写出的目标
+ExecuteResult execute_select_column(Statement* statement, Table* table, bool in_transaction, FILE* stream)
+{
+    IndexColumn column = statement->op == SELECT_USERNAME_EQUAL ? INDEX_USERNAME : INDEX_EMAIL;
+    char* value = row_column(&statement->row_to_insert, column);
+    VersionStore* versions = table->pager->versions;
+    uint64_t snapshot = in_transaction ? SNAPSHOT_LATEST : version_store_begin_snapshot(versions);
+    OutputBuffer* output = new_output_buffer(stream);
+
+    if (table->indexes[column] != NULL) {
+        // 1. 同一快照中索引和表是一致的，索引中的 id 应当都在表中
+        //    仍检查游标确实停在该 id 上，索引损坏时跳过该项，不读越界的单元
+        uint32_t* ids;
+        uint32_t num_ids = index_find(table->indexes[column], value, snapshot, &ids);
+        for (uint32_t i = 0; i < num_ids; i++) {
+            Cursor* cursor = table_find(table, ids[i], snapshot);
+            if (cursor->cell_num < *leaf_node_num_cells(cursor->node) &&
+                *leaf_node_key(cursor->node, cursor->cell_num) == ids[i]) {
+                output_row(output, ids[i], leaf_node_value(cursor->node, cursor->cell_num));
+            }
+            else {
+                log_message(LOG_WARN, "index entry %d has no row in the table", ids[i]);
+            }
+            cursor_free(cursor);
+        }
+        free(ids);
+    }
+    else {
+        // 2. 没有索引，扫描全表
+        Cursor* cursor = table_start(table, snapshot);
+        RowBatch* batch = malloc(sizeof(RowBatch));
+        batch->node = page_buffer_alloc();
+        Row row;
+        while (cursor_next_batch(cursor, batch)) {
+            for (uint32_t i = 0; i < batch->num_rows; i++) {
+                deserialize_row(batch->values[i], &row);
+                if (strcmp(row_column(&row, column), value) == 0) {
+                    output_row(output, batch->keys[i], batch->values[i]);
+                }
+            }
+        }
+        page_buffer_free(batch->node);
+        free(batch);
+        cursor_free(cursor);
+    }
+
+    output_flush(output);
+    close_output_buffer(output);
+    if (!in_transaction) {
+        version_store_end_snapshot(versions, snapshot);
+    }
+    return EXECUTE_SUCCESS;
+}
+
+// 打开数据库文件，初始化缓冲池
+// filename: 文件名
+// options: 分页器选项
+Pager* pager_open(const char* filename, PagerOptions* options)
+{
+    // 1. 打开文件
+    int fd = open(filename,
+                    O_RDWR | O_CREAT,
+                    S_IWUSR | S_IRUSR
+                  ); // S_IWUSR  00200 user has write permission, 00400 user has read permission
+    if (fd == -1) {
+        printf("Unable to open file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // 2. 移动到文件尾
+    off_t file_length = lseek(fd, 0, SEEK_END);
+    log_message(LOG_INFO, "pager_open file length:%lld", (long long)file_length);
+
+    // 3. 初始化分页器
+    //    有页映射的数据库是压缩存储的，新建的数据库按选项决定是否压缩
+    Pager* pager = malloc(sizeof(Pager));
+    pager->file_descriptor = fd;
+    memset(&pager->stats, 0, sizeof(PagerStats));
+    pager->map = NULL;
+    pager->map_length = 0;
+    pager->page_map = page_map_open(filename, options->compress && file_length == 0, &pager->stats);
+    if (pager->page_map != NULL) {
+        pager->num_pages = pager->page_map->num_entries;
+    }
+    else {
+        if (options->compress && file_length > 0) {
+            printf("Database was created without compression\n");
+            exit(EXIT_FAILURE);
+        }
+        // 整页保存，大小只能为4k的倍数
+        if (file_length % PAGE_SIZE != 0) {
+            printf("Db file is not a whole number of pages. Corrupt file.\n");
+            exit(EXIT_FAILURE);
+        }
+        pager->num_pages = (file_length / PAGE_SIZE);
+    }
+
+    // 4. 重放日志中已提交的页，写回文件后清空日志，再启动后台检查点
+    pager->wal = wal_open(filename, fd, &pager->stats);
+    pager->wal->page_map = pager->page_map;
+    wal_recover(pager->wal, &pager->num_pages);
+    if (pager->wal->num_frames > 0) {
+        wal_checkpoint(pager->wal);
+        file_length = lseek(fd, 0, SEEK_END);
+    }
+    wal_start_checkpointer(pager->wal);
+
+    // 5. 映射文件中已有的页，之后新增的页走普通的帧
+    //    压缩的页不能直接映射
+    if (options->use_mmap && pager->page_map == NULL && file_length > 0) {
+        void* map = mmap(NULL, file_length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            printf("Error mapping file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        pager->map = map;
+        pager->map_length = file_length;
+    }
+
+    // 6. 初始化缓冲池，哈希桶数取不小于帧数两倍的2的幂
+    uint32_t max_frames = options->max_frames;
+    if (max_frames < PAGER_MIN_FRAMES) {
+        max_frames = PAGER_MIN_FRAMES;
+    }
+    pager->max_frames = max_frames;
+    pager->num_frames_used = 0;
+    pager->clock_hand = 0;
+    pager->frames = calloc(max_frames, sizeof(Frame));
+    pager->dirty_frames = malloc(max_frames * sizeof(Frame*));
+
+    // 所有帧的页内存一次分配，够大时按大页对齐并建议内核使用透明大页
+    size_t slab_size = (size_t)max_frames * PAGE_SIZE;
+    size_t slab_align = slab_size >= FRAME_SLAB_HUGE_PAGE_SIZE ? FRAME_SLAB_HUGE_PAGE_SIZE : PAGE_SIZE;
+    if (posix_memalign(&pager->frame_slab, slab_align, slab_size) != 0) {
+        printf("Unable to allocate buffer pool\n");
+        exit(EXIT_FAILURE);
+    }
+#ifdef MADV_HUGEPAGE
+    if (slab_align == FRAME_SLAB_HUGE_PAGE_SIZE) {
+        madvise(pager->frame_slab, slab_size, MADV_HUGEPAGE);
+    }
+#endif
+    for (uint32_t i = 0; i < max_frames; i++) {
+        pager->frames[i].buffer = pager->frame_slab + (size_t)i * PAGE_SIZE;
+    }
+
+    // 页闩锁偏向写者，持续的读者不会让写者饿死
+    pthread_rwlockattr_t latch_attr;
+    pthread_rwlockattr_init(&latch_attr);
+    pthread_rwlockattr_setkind_np(&latch_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (uint32_t i = 0; i < max_frames; i++) {
+        pthread_rwlock_init(&pager->frames[i].latch, &latch_attr);
+    }
+    pthread_rwlockattr_destroy(&latch_attr);
+
+    uint32_t page_table_size = 1;
+    while (page_table_size < 2 * max_frames) {
+        page_table_size <<= 1;
+    }
+    pager->page_table_mask = page_table_size - 1;
+    pager->page_table = malloc(page_table_size * sizeof(int32_t));
+    for (uint32_t i = 0; i < page_table_size; i++) {
+        pager->page_table[i] = INVALID_FRAME_NUM;
+    }
+
+    // 7. 并发控制
+    pthread_mutex_init(&pager->mutex, NULL);
+    pthread_cond_init(&pager->loaded, NULL);
+    pthread_cond_init(&pager->flushed, NULL);
+    pager->num_flushing = 0;
+    pager->num_committing = 0;
+    pthread_mutex_init(&pager->write_mutex, NULL);
+    pager->versions = version_store_open();
+    pager->write_set_capacity = 16;
+    pager->write_set_size = 0;
+    pager->write_set = malloc(pager->write_set_capacity * sizeof(uint32_t));
+    page_set_init(&pager->write_set_pages);
+    pager->exclusive_write = false;
+    pager->savepoint_active = false;
+    pager->savepoint_size = 0;
+    pager->savepoint_capacity = 16;
+    pager->savepoint_pages = malloc(pager->savepoint_capacity * sizeof(SavepointPage));
+    page_set_init(&pager->savepoint_set);
+    node_cache_init(&pager->node_cache);
+
+    return pager;
+}
+
+// 打开数据库
+// 1、打开文件，初始化分页器
+// 2、使用分页器初始化表
+// filename: 文件名
+// options: 分页器选项
+Table* db_open(const char* filename, PagerOptions* options)
+{
+    // 从文件中初始化分页器
+    Pager* pager = pager_open(filename, options);
+
+    // 新建数据库时写文件头，创建表和二级索引的根节点
+    if(pager->num_pages == 0) {
+        pager_begin_write(pager);
+        DbHeader* header = get_page(pager, DB_HEADER_PAGE_NUM);
+        pager_mark_dirty(pager, DB_HEADER_PAGE_NUM);
+        memset(header, 0, PAGE_SIZE);
+        header->magic = DB_MAGIC;
+        header->version = DB_FORMAT_VERSION;
+        header->page_size = PAGE_SIZE;
+        header->root_page_num = DB_HEADER_PAGE_NUM + 1;
+        for (uint32_t i = 0; i < INDEX_COUNT; i++) {
+            header->index_root_page_nums[i] = header->root_page_num + 1 + i;
+        }
+        unpin_page(pager, DB_HEADER_PAGE_NUM);
+        for (uint32_t page_num = DB_HEADER_PAGE_NUM + 1; page_num <= DB_HEADER_PAGE_NUM + 1 + INDEX_COUNT; page_num++) {
+            void* root_node = get_page(pager, page_num);
+            pager_mark_dirty(pager, page_num);
+            initialize_leaf_node(root_node);
+            set_node_root(root_node, true);
+            unpin_page(pager, page_num);
+        }
+        pager_commit(pager);
+    }
+
+    DbHeader header;
+    db_read_header(pager, filename, &header);
+    Table* table = malloc(sizeof(Table));
+    table->pager = pager;
+    table->root_page_num = header.root_page_num;
+    table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+    table->leaf_splits = 0;
+    table->internal_splits = 0;
+    table_open_indexes(table, &header);
+
+    return table;
+}
+
+// 读取并校验文件头，不是本格式的文件时退出
+// pager: 分页器
+// filename: 文件名
+// header: 返回的文件头
+void db_read_header(Pager* pager, const char* filename, DbHeader* header)
+{
+    void* page = get_page(pager, DB_HEADER_PAGE_NUM);
+    memcpy(header, page, sizeof(DbHeader));
+    unpin_page(pager, DB_HEADER_PAGE_NUM);
+
+    if (header->magic != DB_MAGIC || header->page_size != PAGE_SIZE) {
+        printf("File '%s' is not a database or uses an older format without a header\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    if (header->version != DB_FORMAT_VERSION) {
+        printf("Unsupported database format version %d in '%s'\n", header->version, filename);
+        exit(EXIT_FAILURE);
+    }
+    if (header->root_page_num == DB_HEADER_PAGE_NUM || header->root_page_num >= pager->num_pages) {
+        printf("Table root page %d in '%s' is out of range\n", header->root_page_num, filename);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// 将淘汰的脏页写入日志，作为未提交的帧，调用时需持有缓冲池锁
+// 之后读取该页时从日志中读取，提交时随提交帧一起生效
+// 写日志期间释放缓冲池锁，其他线程固定页不必等待 I/O，返回时重新持有锁
+// pager:       分页器
+// frame_num:   第几帧
+void pager_flush(Pager* pager, uint32_t frame_num)
+{
+    Frame* frame = &pager->frames[frame_num];
+    log_message(LOG_DEBUG, "pager_flush page_num:%d", frame->page_num);
+    stats_add(&pager->stats.flushes, 1);
+
+    // 1. 先清除脏标记并固定帧，写者在写回期间再次修改时会重新标记
+    frame->dirty = false;
+    frame->pin_count += 1;
+    pager->num_flushing += 1;
+    pthread_mutex_unlock(&pager->mutex);
+
+    // 2. 追加到日志，不需要落盘，共享闩锁防止拷贝时写者正在修改
+    pthread_rwlock_rdlock(&frame->latch);
+    wal_append(pager->wal, &frame, 1, 0);
+    pthread_rwlock_unlock(&frame->latch);
+
+    // 3. 解除固定，通知等待写回完成的提交和截断
+    pthread_mutex_lock(&pager->mutex);
+    frame->pin_count -= 1;
+    pager->num_flushing -= 1;
+    pthread_cond_broadcast(&pager->flushed);
+}
+
+// 提交当前修改，结束 pager_begin_write 开始的写操作
+// 脏页按页号排序后追加到日志，最后一帧标记为提交帧，等待日志落盘后返回
+// 追加后即对新快照可见并释放写锁，下一个写者不必等待 fsync
+// 数据库文件本身只在检查点时写入
+// pager: 分页器
+void pager_commit(Pager* pager)
+{
+    // 1. 收集并固定脏页，追加期间不会被读者淘汰
+    //    先等读者正在写回的脏页追加完，这些未提交的帧必须在提交帧之前
+    pthread_mutex_lock(&pager->mutex);
+    while (pager->num_flushing > 0) {
+        pthread_cond_wait(&pager->flushed, &pager->mutex);
+    }
+    Frame** dirty_frames = pager->dirty_frames;
+    uint32_t num_dirty = 0;
+    for (uint32_t i = 0; i < pager->num_frames_used; i++) {
+        Frame* frame = &pager->frames[i];
+        if (frame->in_use && frame->dirty) {
+            frame->pin_count += 1;
+            dirty_frames[num_dirty++] = frame;
+        }
+    }
+    pager->num_committing = num_dirty;
+    pthread_mutex_unlock(&pager->mutex);
+    qsort(dirty_frames, num_dirty, sizeof(Frame*), compare_frame_page_num);
+
+    // 2. 没有修改时不需要提交，读者淘汰脏页时也会追加未提交的帧
+    pthread_mutex_lock(&pager->wal->mutex);
+    bool uncommitted = pager->wal->uncommitted;
+    pthread_mutex_unlock(&pager->wal->mutex);
+    if (num_dirty == 0 && !uncommitted) {
+        pager->write_set_size = 0;
+        page_set_clear(&pager->write_set_pages);
+        pager->exclusive_write = false;
+        node_cache_advance(pager);
+        pthread_mutex_unlock(&pager->write_mutex);
+        return;
+    }
+
+    // 3. 一次顺序追加写入所有脏页和提交标记
+    off_t commit_length = wal_append(pager->wal, dirty_frames, num_dirty, pager->num_pages);
+    pthread_mutex_lock(&pager->mutex);
+    for (uint32_t i = 0; i < num_dirty; i++) {
+        dirty_frames[i]->dirty = false;
+        dirty_frames[i]->pin_count -= 1;
+    }
+    pager->num_committing = 0;
+    pthread_cond_broadcast(&pager->flushed);
+    pthread_mutex_unlock(&pager->mutex);
+
+    // 4. 新的版本号生效，之后开始的快照看到本次修改
+    version_store_commit(pager->versions);
+    pager->write_set_size = 0;
+    page_set_clear(&pager->write_set_pages);
+    pager->exclusive_write = false;
+    node_cache_advance(pager);
+    pthread_mutex_unlock(&pager->write_mutex);
+
+    // 5. 等待日志落盘，同时提交的事务共用一次 fsync
+    wal_sync(pager->wal, commit_length);
+
+    // 6. 持续写入时后台检查点无法清空日志，日志过长时由提交者清空
+    //    取得写锁阻止新的追加（没有写者时也没有脏页可被读者淘汰），等其他提交落盘后写回，日志必然被清空
+    pthread_mutex_lock(&pager->wal->mutex);
+    bool wal_full = pager->wal->num_frames >= WAL_MAX_FRAMES;
+    pthread_mutex_unlock(&pager->wal->mutex);
+    if (wal_full) {
+        pthread_mutex_lock(&pager->write_mutex);
+        pthread_mutex_lock(&pager->wal->mutex);
+        wal_full = pager->wal->num_frames >= WAL_MAX_FRAMES;
+        off_t length = WAL_HEADER_SIZE + (off_t)pager->wal->num_frames * WAL_FRAME_SIZE;
+        pthread_mutex_unlock(&pager->wal->mutex);
+        if (wal_full) {
+            wal_sync(pager->wal, length);
+            wal_checkpoint(pager->wal);
+        }
+        pthread_mutex_unlock(&pager->write_mutex);
+    }
+}
+
+// 放弃当前写操作的修改，结束 pager_begin_write 开始的写操作
+// 写集合中每页第一次修改前保存的旧版本就是撤销日志：拷回旧版本，丢弃新分配的页，
+// 再按普通提交写入日志，覆盖读者淘汰脏页时已追加的未提交帧
+// pager: 分页器
+void pager_rollback(Pager* pager)
+{
+    if (pager->exclusive_write) {
+        printf("Tried to roll back an exclusive write\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // 1. 拷回旧版本，丢弃新分配的页
+    pager_restore_versions(pager, 0);
+    if (pager->num_pages > pager->write_num_pages) {
+        pager_truncate(pager, pager->write_num_pages);
+    }
+
+    // 2. 提交恢复后的页
+    pager_commit(pager);
+}
+
+// 把写集合中从 start 开始的页拷回旧版本，即写操作开始时的内容
+// 写者之外只有读者访问页，排他闩锁等待正在拷贝当前页的读者
+// pager: 分页器
+// start: 写集合中的起始位置
+void pager_restore_versions(Pager* pager, uint32_t start)
+{
+    uint64_t snapshot = pager->versions->commit_version;
+    for (uint32_t i = start; i < pager->write_set_size; i++) {
+        uint32_t page_num = pager->write_set[i];
+        if (page_num >= pager->write_num_pages) {
+            continue;
+        }
+        Frame* frame = pager_pin(pager, page_num);
+        pthread_rwlock_wrlock(&frame->latch);
+        version_store_read(pager->versions, page_num, snapshot, frame->data);
+        pthread_rwlock_unlock(&frame->latch);
+        pager_mark_dirty(pager, page_num);
+        unpin_page(pager, page_num);
+    }
+}
+
+// 在写操作中设置语句保存点，语句失败时只撤销该语句的修改
+// pager: 分页器
+void pager_savepoint(Pager* pager)
+{
+    pager->savepoint_active = true;
+    pager->savepoint_write_set_size = pager->write_set_size;
+    pager->savepoint_num_pages = pager->num_pages;
+    pager->savepoint_size = 0;
+    page_set_clear(&pager->savepoint_set);
+}
+
+// 语句中第一次修改保存点之前已修改过的页时，保存页的当前内容
+// pager: 分页器
+// page_num: 第几页
+void pager_savepoint_save(Pager* pager, uint32_t page_num)
+{
+    if (page_set_find(&pager->savepoint_set, page_num) != -1) {
+        return;
+    }
+    page_set_put(&pager->savepoint_set, page_num, pager->savepoint_size);
+    if (pager->savepoint_size == pager->savepoint_capacity) {
+        pager->savepoint_capacity *= 2;
+        pager->savepoint_pages = realloc(pager->savepoint_pages, pager->savepoint_capacity * sizeof(SavepointPage));
+    }
+    SavepointPage* saved = &pager->savepoint_pages[pager->savepoint_size++];
+    saved->page_num = page_num;
+    saved->data = malloc(PAGE_SIZE);
+    memcpy(saved->data, get_page(pager, page_num), PAGE_SIZE);
+    unpin_page(pager, page_num);
+}
+
+// 撤销保存点之后的修改，写操作继续
+// pager: 分页器
+void pager_rollback_savepoint(Pager* pager)
+{
+    // 1. 保存点之前修改过的页拷回另存的内容
+    //    语句执行中该页可能已被淘汰，失败语句的内容写进了日志，拷回后要重新标记为脏页，提交时覆盖日志中的帧
+    for (uint32_t i = 0; i < pager->savepoint_size; i++) {
+        SavepointPage* saved = &pager->savepoint_pages[i];
+        if (saved->page_num >= pager->savepoint_num_pages) {
+            continue;
+        }
+        Frame* frame = pager_pin(pager, saved->page_num);
+        pthread_rwlock_wrlock(&frame->latch);
+        memcpy(frame->data, saved->data, PAGE_SIZE);
+        pthread_rwlock_unlock(&frame->latch);
+        pthread_mutex_lock(&pager->mutex);
+        frame->dirty = true;
+        pthread_mutex_unlock(&pager->mutex);
+        unpin_page(pager, saved->page_num);
+    }
+
+    // 2. 保存点之后才修改的页拷回旧版本，丢弃之后分配的页
+    //    这些页留在写集合中，旧版本仍是写操作开始时的内容
+    pager_restore_versions(pager, pager->savepoint_write_set_size);
+    if (pager->num_pages > pager->savepoint_num_pages) {
+        pager_truncate(pager, pager->savepoint_num_pages);
+    }
+    pager_release_savepoint(pager);
+}
+
+// 释放保存点，保留之后的修改
+// pager: 分页器
+void pager_release_savepoint(Pager* pager)
+{
+    for (uint32_t i = 0; i < pager->savepoint_size; i++) {
+        free(pager->savepoint_pages[i].data);
+    }
+    pager->savepoint_size = 0;
+    page_set_clear(&pager->savepoint_set);
+    pager->savepoint_active = false;
+}
+
+// 丢弃页号不小于 num_pages 的页，并截断文件
+// 被丢弃的页不能处于固定状态
+// pager: 分页器
+// num_pages: 保留的页数
+void pager_truncate(Pager* pager, uint32_t num_pages)
+{
+    // 1. 从缓冲池中移除，读者正在写回的页暂时被固定，等写回完成
+    pthread_mutex_lock(&pager->mutex);
+    while (pager->num_flushing > 0) {
+        pthread_cond_wait(&pager->flushed, &pager->mutex);
+    }
+    for (uint32_t i = 0; i < pager->num_frames_used; i++) {
+        Frame* frame = &pager->frames[i];
+        if (!frame->in_use || frame->page_num < num_pages) {
+            continue;
+        }
+        if (frame->pin_count > 0) {
+            printf("Tried to truncate pinned page %d\n", frame->page_num);
+            exit(EXIT_FAILURE);
+        }
+        int32_t* link = &pager->page_table[frame->page_num & pager->page_table_mask];
+        while (*link != (int32_t)i) {
+            link = &pager->frames[*link].next;
+        }
+        *link = frame->next;
+        frame->in_use = false;
+        frame->dirty = false;
+    }
+    pthread_mutex_unlock(&pager->mutex);
+
+    // 2. 日志中的这些页也不再有效
+    wal_forget_pages(pager->wal, num_pages);
+
+    // 3. 截断文件，映射中超出文件的部分不能再访问
+    //    压缩存储时释放这些页占用的空间
+    off_t length = (off_t)num_pages * PAGE_SIZE;
+    if (pager->page_map != NULL) {
+        page_map_truncate(pager->page_map, num_pages);
+    }
+    else if (lseek(pager->file_descriptor, 0, SEEK_END) > length) {
+        if (ftruncate(pager->file_descriptor, length) == -1) {
+            printf("Error truncating file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (pager->map_length > length) {
+        pager->map_length = length;
+    }
+    pager->num_pages = num_pages;
+}
+
+// 按页号比较帧，用于排序
+int compare_frame_page_num(const void* a, const void* b)
+{
+    uint32_t page_a = (*(Frame**)a)->page_num;
+    uint32_t page_b = (*(Frame**)b)->page_num;
+    return (page_a > page_b) - (page_a < page_b);
+}
+
+// 按页号比较日志索引项，用于排序
+int compare_wal_entry_page_num(const void* a, const void* b)
+{
+    uint32_t page_a = ((WalIndexEntry*)a)->page_num;
+    uint32_t page_b = ((WalIndexEntry*)b)->page_num;
+    return (page_a > page_b) - (page_a < page_b);
+}
+
+// 打开数据库文件旁的日志文件，文件名为数据库文件名加 -wal
+// 文件头无效时重置日志
+// db_filename: 数据库文件名
+// db_file_descriptor: 数据库文件，检查点时写入
+// stats: 分页器的统计，记录读写的字节数
+Wal* wal_open(const char* db_filename, int db_file_descriptor, PagerStats* stats)
+{
+    // 1. 打开文件
+    Wal* wal = malloc(sizeof(Wal));
+    wal->filename = malloc(strlen(db_filename) + 5);
+    sprintf(wal->filename, "%s-wal", db_filename);
+    wal->file_descriptor = open(wal->filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    if (wal->file_descriptor == -1) {
+        printf("Unable to open wal file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // 2. 初始化状态和索引
+    wal->db_file_descriptor = db_file_descriptor;
+    wal->stats = stats;
+    pthread_mutex_init(&wal->mutex, NULL);
+    pthread_cond_init(&wal->synced, NULL);
+    pthread_cond_init(&wal->checkpoint_wanted, NULL);
+    pthread_mutex_init(&wal->checkpoint_mutex, NULL);
+    wal->checkpointer_running = false;
+    wal->stop_checkpointer = false;
+    wal->num_frames = 0;
+    wal->checkpointed_frames = 0;
+    wal->db_size = 0;
+    wal->uncommitted = false;
+    wal->syncing = false;
+    wal->synced_length = WAL_HEADER_SIZE;
+    wal->index_mask = 63;
+    wal->index_count = 0;
+    wal->index = malloc((wal->index_mask + 1) * sizeof(WalIndexEntry));
+    for (uint32_t i = 0; i <= wal->index_mask; i++) {
+        wal->index[i].page_num = INVALID_PAGE_NUM;
+    }
+
+    // 3. 校验文件头
+    uint32_t header[4];
+    ssize_t bytes_read = pread(wal->file_descriptor, header, WAL_HEADER_SIZE, 0);
+    stats_add(&stats->bytes_read, bytes_read > 0 ? bytes_read : 0);
+    if (bytes_read == WAL_HEADER_SIZE && header[0] == WAL_MAGIC &&
+        header[1] == WAL_VERSION && header[2] == PAGE_SIZE) {
+        wal->salt = header[3];
+    }
+    else {
+        wal->salt = (uint32_t)time(NULL) ^ (uint32_t)getpid();
+        wal_reset(wal);
+    }
+    return wal;
+}
+
+// 恢复日志：找到最后一个完整的提交帧，为它之前的帧建立索引
+// 提交帧之后的帧属于崩溃时未提交的修改，被丢弃
+// 之前的帧中也可能有读者淘汰的未提交的页，页号不小于最后一次提交的页数时是被回滚丢弃的页，不建立索引
+// wal: 日志
+// num_pages: 返回最后一次提交时数据库的页数，没有提交时不修改
+void wal_recover(Wal* wal, uint32_t* num_pages)
+{
+
+    // 1. 顺序扫描，盐值或校验和不符说明写到一半或是旧日志的帧
+    void* frame = malloc(WAL_FRAME_SIZE);
+    uint32_t* header = frame;
+    uint32_t* page_nums = NULL;
+    uint32_t num_frames = 0;
+    uint32_t num_committed = 0;
+    while (true) {
+        off_t offset = WAL_HEADER_SIZE + (off_t)num_frames * WAL_FRAME_SIZE;
+        if (pread(wal->file_descriptor, frame, WAL_FRAME_SIZE, offset) != WAL_FRAME_SIZE) {
+            break;
+        }
+        stats_add(&wal->stats->bytes_read, WAL_FRAME_SIZE);
+        if (header[2] != wal->salt || header[3] != wal_frame_checksum(header, frame + WAL_FRAME_HEADER_SIZE)) {
+            break;
+        }
+        if ((num_frames & (num_frames - 1)) == 0) {
+            page_nums = realloc(page_nums, (num_frames ? 2 * num_frames : 1) * sizeof(uint32_t));
+        }
+        page_nums[num_frames++] = header[0];
+        if (header[1] != 0) {
+            num_committed = num_frames;
+            *num_pages = header[1];
+        }
+    }
+
+    // 2. 为已提交的帧建立索引，同一页后面的帧覆盖前面的
+    wal->db_size = *num_pages;
+    for (uint32_t i = 0; i < num_committed; i++) {
+        if (page_nums[i] < wal->db_size) {
+            wal_index_put(wal, page_nums[i], i);
+        }
+    }
+    wal->num_frames = num_committed;
+    wal->synced_length = WAL_HEADER_SIZE + (off_t)num_committed * WAL_FRAME_SIZE;
+
+    free(page_nums);
+    free(frame);
+}
+
+// 追加帧到日志，并更新索引
+// db_size 不为0时最后一帧为提交帧，没有页时写一个不含页的提交帧
+// 返回追加后的日志长度，用于等待落盘
+// wal: 日志
+// frames: 要写入的帧
+// num_frames: 帧数
+// db_size: 提交后数据库的页数，0表示不提交
+off_t wal_append(Wal* wal, Frame** frames, uint32_t num_frames, uint32_t db_size)
+{
+    pthread_mutex_lock(&wal->mutex);
+
+    void* empty_page = NULL;
+    uint32_t num_records = num_frames;
+    if (num_frames == 0) {
+        empty_page = calloc(1, PAGE_SIZE);
+        num_records = 1;
+    }
+
+    // 每帧由帧头和页内容两段组成，多帧合并为一次 pwritev
+    uint32_t headers[PAGER_MAX_WRITE_RUN][4];
+    struct iovec iov[2 * PAGER_MAX_WRITE_RUN];
+    uint32_t start = 0;
+    while (start < num_records) {
+        uint32_t run_length = num_records - start;
+        if (run_length > PAGER_MAX_WRITE_RUN) {
+            run_length = PAGER_MAX_WRITE_RUN;
+        }
+
+        // 1. 填写帧头
+        for (uint32_t i = 0; i < run_length; i++) {
+            uint32_t record = start + i;
+            void* data = num_frames == 0 ? empty_page : frames[record]->data;
+            uint32_t* header = headers[i];
+            header[0] = num_frames == 0 ? INVALID_PAGE_NUM : frames[record]->page_num;
+            header[1] = record == num_records - 1 ? db_size : 0;
+            header[2] = wal->salt;
+            header[3] = wal_frame_checksum(header, data);
+            iov[2 * i].iov_base = header;
+            iov[2 * i].iov_len = WAL_FRAME_HEADER_SIZE;
+            iov[2 * i + 1].iov_base = data;
+            iov[2 * i + 1].iov_len = PAGE_SIZE;
+        }
+
+        // 2. 顺序写入日志尾部
+        off_t offset = WAL_HEADER_SIZE + (off_t)wal->num_frames * WAL_FRAME_SIZE;
+        ssize_t bytes_written = pwritev(wal->file_descriptor, iov, 2 * run_length, offset);
+        if (bytes_written != (ssize_t)run_length * WAL_FRAME_SIZE) {
+            printf("Error writing wal: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        stats_add(&wal->stats->bytes_written, bytes_written);
+
+        // 3. 之后读取这些页时从日志中读取
+        for (uint32_t i = 0; i < run_length; i++) {
+            if (headers[i][0] != INVALID_PAGE_NUM) {
+                wal_index_put(wal, headers[i][0], wal->num_frames + i);
+            }
+        }
+        wal->num_frames += run_length;
+        start += run_length;
+    }
+
+    wal->uncommitted = db_size == 0;
+    if (db_size != 0) {
+        wal->db_size = db_size;
+    }
+    off_t length = WAL_HEADER_SIZE + (off_t)wal->num_frames * WAL_FRAME_SIZE;
+    pthread_mutex_unlock(&wal->mutex);
+
+    free(empty_page);
+    return length;
+}
+
+// 等待日志落盘到指定长度（组提交）
+// 没有线程在 fsync 时，当前线程负责一次 fsync，覆盖此刻之前追加的所有提交
+// 否则等待正在进行的 fsync 完成后再检查
+// wal: 日志
+// length: 需要落盘的日志长度
+void wal_sync(Wal* wal, off_t length)
+{
+    pthread_mutex_lock(&wal->mutex);
+    while (wal->synced_length < length) {
+        if (wal->syncing) {
+            pthread_cond_wait(&wal->synced, &wal->mutex);
+            continue;
+        }
+
+        wal->syncing = true;
+        off_t target = WAL_HEADER_SIZE + (off_t)wal->num_frames * WAL_FRAME_SIZE;
+        pthread_mutex_unlock(&wal->mutex);
+        if (fdatasync(wal->file_descriptor) == -1) {
+            printf("Error syncing wal: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_lock(&wal->mutex);
+
+        wal->synced_length = target;
+        wal->syncing = false;
+        pthread_cond_broadcast(&wal->synced);
+        if (wal_checkpoint_ready(wal)) {
+            pthread_cond_signal(&wal->checkpoint_wanted);
+        }
+    }
+    pthread_mutex_unlock(&wal->mutex);
+}
+
+// 判断后台检查点是否应该工作，调用时需持有日志的锁
+// 只有所有帧都已提交且已落盘时才能写回，否则崩溃后文件中会出现未提交的修改
+// wal: 日志
+bool wal_checkpoint_ready(Wal* wal)
+{
+    off_t length = WAL_HEADER_SIZE + (off_t)wal->num_frames * WAL_FRAME_SIZE;
+    return !wal->uncommitted && wal->synced_length == length &&
+           wal->num_frames - wal->checkpointed_frames >= WAL_CHECKPOINT_FRAMES;
+}
+
+// 检查点：把日志中新写回边界之后的页写回数据库文件
+// 1. 持锁记录当前的帧数和这些帧中每页最新的帧
+// 2. 不持锁按页号排序写回，相邻的页合并为一次 pwritev，读者照常从日志读取这些页
+// 3. 文件落盘后推进写回边界，期间没有新帧则清空日志
+// 返回日志是否被清空
+// wal: 日志
+bool wal_checkpoint(Wal* wal)
+{
+    // 1. 收集已提交且已落盘的帧
+    pthread_mutex_lock(&wal->checkpoint_mutex);
+    pthread_mutex_lock(&wal->mutex);
+    off_t length = WAL_HEADER_SIZE + (off_t)wal->num_frames * WAL_FRAME_SIZE;
+    if (wal->uncommitted || wal->synced_length != length) {
+        pthread_mutex_unlock(&wal->mutex);
+        pthread_mutex_unlock(&wal->checkpoint_mutex);
+        return false;
+    }
+    //    超出提交时页数的页是回滚丢弃的页，不写回
+    uint32_t end_frame = wal->num_frames;
+    WalIndexEntry* entries = malloc((wal->index_count + 1) * sizeof(WalIndexEntry));
+    uint32_t num_entries = 0;
+    for (uint32_t i = 0; i <= wal->index_mask; i++) {
+        WalIndexEntry* entry = &wal->index[i];
+        if (entry->page_num != INVALID_PAGE_NUM && entry->frame_num != WAL_NO_FRAME &&
+            entry->frame_num >= wal->checkpointed_frames && entry->page_num < wal->db_size) {
+            entries[num_entries++] = *entry;
+        }
+    }
+    pthread_mutex_unlock(&wal->mutex);
+    qsort(entries, num_entries, sizeof(WalIndexEntry), compare_wal_entry_page_num);
+
+    // 2. 按连续页号分段写入，这些帧在清空日志前不会改变
+    //    开启压缩时逐页压缩后通过页映射写入
+    void* pages = malloc(PAGER_MAX_WRITE_RUN * PAGE_SIZE);
+    struct iovec iov[PAGER_MAX_WRITE_RUN];
+    uint32_t run_start = 0;
+    while (wal->page_map != NULL && run_start < num_entries) {
+        wal_read_frame(wal, entries[run_start].frame_num, pages);
+        page_map_write(wal->page_map, wal->db_file_descriptor, entries[run_start].page_num, pages);
+        run_start++;
+    }
+    while (run_start < num_entries) {
+        uint32_t run_length = 1;
+        while (run_start + run_length < num_entries && run_length < PAGER_MAX_WRITE_RUN &&
+               entries[run_start + run_length].page_num == entries[run_start].page_num + run_length) {
+            run_length++;
+        }
+
+        for (uint32_t i = 0; i < run_length; i++) {
+            iov[i].iov_base = pages + i * PAGE_SIZE;
+            iov[i].iov_len = PAGE_SIZE;
+            wal_read_frame(wal, entries[run_start + i].frame_num, iov[i].iov_base);
+        }
+        off_t offset = (off_t)entries[run_start].page_num * PAGE_SIZE;
+        ssize_t bytes_written = pwritev(wal->db_file_descriptor, iov, run_length, offset);
+        if (bytes_written != (ssize_t)run_length * PAGE_SIZE) {
+            printf("Error writing: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        stats_add(&wal->stats->bytes_written, bytes_written);
+        run_start += run_length;
+    }
+    free(pages);
+    free(entries);
+
+    // 3. 文件落盘后才能推进边界或清空日志
+    //    页映射中落盘前暂缓释放的空间，磁盘上的映射已不再指向，此时才能复用
+    uint32_t num_pending = wal->page_map != NULL ? page_map_num_pending(wal->page_map) : 0;
+    if (fsync(wal->db_file_descriptor) == -1 ||
+        (wal->page_map != NULL && fsync(wal->page_map->file_descriptor) == -1)) {
+        printf("Error syncing db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    if (wal->page_map != NULL) {
+        page_map_release_pending(wal->page_map, num_pending);
+    }
+    pthread_mutex_lock(&wal->mutex);
+    bool reset = wal->num_frames == end_frame && !wal->uncommitted;
+    if (reset) {
+        wal_reset(wal);
+    }
+    else {
+        wal->checkpointed_frames = end_frame;
+    }
+    pthread_mutex_unlock(&wal->mutex);
+    pthread_mutex_unlock(&wal->checkpoint_mutex);
+    return reset;
+}
+
+// 后台检查点线程，等到未写回的帧足够多时执行一次检查点
+// arg: 日志
+void* wal_checkpointer_main(void* arg)
+{
+    Wal* wal = arg;
+    pthread_mutex_lock(&wal->mutex);
+    while (!wal->stop_checkpointer) {
+        if (wal_checkpoint_ready(wal)) {
+            pthread_mutex_unlock(&wal->mutex);
+            wal_checkpoint(wal);
+            pthread_mutex_lock(&wal->mutex);
+            continue;
+        }
+        pthread_cond_wait(&wal->checkpoint_wanted, &wal->mutex);
+    }
+    pthread_mutex_unlock(&wal->mutex);
+    return NULL;
+}
+
+// 启动后台检查点线程
+// wal: 日志
+void wal_start_checkpointer(Wal* wal)
+{
+    if (pthread_create(&wal->checkpointer, NULL, wal_checkpointer_main, wal) != 0) {
+        printf("Error starting checkpointer\n");
+        exit(EXIT_FAILURE);
+    }
+    wal->checkpointer_running = true;
+}
+
+// 停止后台检查点线程，等待正在进行的检查点完成
+// wal: 日志
+void wal_stop_checkpointer(Wal* wal)
+{
+    if (!wal->checkpointer_running) {
+        return;
+    }
+    pthread_mutex_lock(&wal->mutex);
+    wal->stop_checkpointer = true;
+    pthread_cond_signal(&wal->checkpoint_wanted);
+    pthread_mutex_unlock(&wal->mutex);
+    pthread_join(wal->checkpointer, NULL);
+    wal->checkpointer_running = false;
+}
+
+// 清空日志，写入新的文件头，调用时需持有日志的锁或没有其他线程
+// 盐值加一，文件中残留的旧帧不会被误认为有效
+// 文件头不单独落盘，下一次提交的 fsync 会一起写入；
+// 在此之前崩溃时，旧帧要么盐值不符，要么内容已写回文件，重放也无害
+// wal: 日志
+void wal_reset(Wal* wal)
+{
+    // 1. 截断文件并写入文件头
+    wal->salt += 1;
+    uint32_t header[4] = { WAL_MAGIC, WAL_VERSION, PAGE_SIZE, wal->salt };
+    if (ftruncate(wal->file_descriptor, 0) == -1 ||
+        pwrite(wal->file_descriptor, header, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE) {
+        printf("Error resetting wal: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    stats_add(&wal->stats->bytes_written, WAL_HEADER_SIZE);
+
+    // 2. 清空状态和索引
+    wal->num_frames = 0;
+    wal->checkpointed_frames = 0;
+    wal->uncommitted = false;
+    wal->synced_length = WAL_HEADER_SIZE;
+    for (uint32_t i = 0; i <= wal->index_mask; i++) {
+        wal->index[i].page_num = INVALID_PAGE_NUM;
+    }
+    wal->index_count = 0;
+}
+
+// 关闭并删除日志，调用前日志需已写回数据库文件
+// wal: 日志
+void wal_close(Wal* wal)
+{
+    if (close(wal->file_descriptor) == -1) {
+        printf("Error closing wal file.\n");
+        exit(EXIT_FAILURE);
+    }
+    unlink(wal->filename);
+    pthread_mutex_destroy(&wal->mutex);
+    pthread_cond_destroy(&wal->synced);
+    pthread_cond_destroy(&wal->checkpoint_wanted);
+    pthread_mutex_destroy(&wal->checkpoint_mutex);
+    free(wal->index);
+    free(wal->filename);
+    free(wal);
+}
+
+// 读取日志中一帧的页内容
+// wal: 日志
+// frame_num: 第几帧
+// page: 页内存
+void wal_read_frame(Wal* wal, uint32_t frame_num, void* page)
+{
+    off_t offset = WAL_HEADER_SIZE + (off_t)frame_num * WAL_FRAME_SIZE + WAL_FRAME_HEADER_SIZE;
+    if (pread(wal->file_descriptor, page, PAGE_SIZE, offset) != PAGE_SIZE) {
+        printf("Error reading wal: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    stats_add(&wal->stats->bytes_read, PAGE_SIZE);
+}
+
+// 从日志中读取页最新的内容，页不在日志中返回 false
+// 查找和读取在锁内完成，检查点不会在两者之间清空日志
+// wal: 日志
+// page_num: 第几页
+// page: 页内存
+bool wal_read_page(Wal* wal, uint32_t page_num, void* page)
+{
+    pthread_mutex_lock(&wal->mutex);
+    uint32_t frame_num = WAL_NO_FRAME;
+    uint32_t slot = (page_num * 2654435761u) & wal->index_mask;
+    while (wal->index[slot].page_num != INVALID_PAGE_NUM) {
+        if (wal->index[slot].page_num == page_num) {
+            frame_num = wal->index[slot].frame_num;
+            break;
+        }
+        slot = (slot + 1) & wal->index_mask;
+    }
+    if (frame_num != WAL_NO_FRAME) {
+        wal_read_frame(wal, frame_num, page);
+    }
+    pthread_mutex_unlock(&wal->mutex);
+    return frame_num != WAL_NO_FRAME;
+}
+
+// 记录页在日志中最新的帧，调用时需持有日志的锁
+// 使用超过一半时哈希表扩大一倍
+// wal: 日志
+// page_num: 第几页
+// frame_num: 第几帧
+void wal_index_put(Wal* wal, uint32_t page_num, uint32_t frame_num)
+{
+    // 1. 扩容后重新插入
+    if (2 * (wal->index_count + 1) > wal->index_mask + 1) {
+        WalIndexEntry* old_index = wal->index;
+        uint32_t old_size = wal->index_mask + 1;
+        wal->index_mask = 2 * old_size - 1;
+        wal->index_count = 0;
+        wal->index = malloc(2 * old_size * sizeof(WalIndexEntry));
+        for (uint32_t i = 0; i <= wal->index_mask; i++) {
+            wal->index[i].page_num = INVALID_PAGE_NUM;
+        }
+        for (uint32_t i = 0; i < old_size; i++) {
+            if (old_index[i].page_num != INVALID_PAGE_NUM) {
+                wal_index_put(wal, old_index[i].page_num, old_index[i].frame_num);
+            }
+        }
+        free(old_index);
+    }
+
+    // 2. 线性探测，已存在则更新
+    uint32_t slot = (page_num * 2654435761u) & wal->index_mask;
+    while (wal->index[slot].page_num != INVALID_PAGE_NUM && wal->index[slot].page_num != page_num) {
+        slot = (slot + 1) & wal->index_mask;
+    }
+    if (wal->index[slot].page_num == INVALID_PAGE_NUM) {
+        wal->index[slot].page_num = page_num;
+        wal->index_count += 1;
+    }
+    wal->index[slot].frame_num = frame_num;
+}
+
+// 丢弃日志中页号不小于 num_pages 的页
+// wal: 日志
+// num_pages: 保留的页数
+void wal_forget_pages(Wal* wal, uint32_t num_pages)
+{
+    pthread_mutex_lock(&wal->mutex);
+    for (uint32_t i = 0; i <= wal->index_mask; i++) {
+        if (wal->index[i].page_num != INVALID_PAGE_NUM && wal->index[i].page_num >= num_pages) {
+            wal->index[i].frame_num = WAL_NO_FRAME;
+        }
+    }
+    pthread_mutex_unlock(&wal->mutex);
+}
+
+// 计算帧的校验和（FNV-1a），覆盖帧头前三个字段和页内容
+// header: 帧头
+// data: 页内容
+uint32_t wal_frame_checksum(uint32_t* header, void* data)
+{
+    uint32_t hash = 2166136261u;
+    uint8_t* bytes = (uint8_t*)header;
+    for (uint32_t i = 0; i < 3 * sizeof(uint32_t); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    bytes = data;
+    for (uint32_t i = 0; i < PAGE_SIZE; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// 打开数据库文件旁的页映射文件，文件名为数据库文件名加 -map
+// 映射文件不存在且不创建时返回 NULL，表示数据库不压缩
+// db_filename: 数据库文件名
+// create: 不存在时是否创建
+// stats: 分页器的统计，记录读写的字节数
+PageMap* page_map_open(const char* db_filename, bool create, PagerStats* stats)
+{
+    // 1. 打开文件
+    char* filename = malloc(strlen(db_filename) + 5);
+    sprintf(filename, "%s-map", db_filename);
+    int fd = open(filename, O_RDWR | (create ? O_CREAT : 0), S_IWUSR | S_IRUSR);
+    free(filename);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            return NULL;
+        }
+        printf("Unable to open page map file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // 2. 读取所有映射项
+    PageMap* page_map = malloc(sizeof(PageMap));
+    page_map->file_descriptor = fd;
+    page_map->stats = stats;
+    off_t file_length = lseek(fd, 0, SEEK_END);
+    page_map->num_entries = file_length / sizeof(PageMapEntry);
+    page_map->entries_capacity = page_map->num_entries > 16 ? page_map->num_entries : 16;
+    page_map->entries = calloc(page_map->entries_capacity, sizeof(PageMapEntry));
+    ssize_t bytes_read = pread(fd, page_map->entries, page_map->num_entries * sizeof(PageMapEntry), 0);
+    if (bytes_read != (ssize_t)(page_map->num_entries * sizeof(PageMapEntry))) {
+        printf("Error reading page map: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    stats_add(&stats->bytes_read, bytes_read);
+    pthread_mutex_init(&page_map->mutex, NULL);
+
+    // 3. 按位置排序已用的空间，之间的空隙即空闲空间
+    PageMapExtent* used = malloc((page_map->num_entries + 1) * sizeof(PageMapExtent));
+    uint32_t num_used = 0;
+    for (uint32_t i = 0; i < page_map->num_entries; i++) {
+        if (page_map->entries[i].length > 0) {
+            used[num_used].offset = page_map->entries[i].offset;
+            used[num_used].units = page_map->entries[i].capacity;
+            num_used++;
+        }
+    }
+    qsort(used, num_used, sizeof(PageMapExtent), compare_page_map_extent_offset);
+
+    page_map->num_free_extents = 0;
+    page_map->free_extents_capacity = 16;
+    page_map->free_extents = malloc(page_map->free_extents_capacity * sizeof(PageMapExtent));
+    page_map->num_pending_extents = 0;
+    page_map->pending_extents_capacity = 16;
+    page_map->pending_extents = malloc(page_map->pending_extents_capacity * sizeof(PageMapExtent));
+    page_map->end = 0;
+    for (uint32_t i = 0; i < num_used; i++) {
+        // 两页的空间重叠说明映射已损坏，写回其中一页会覆盖另一页
+        if (used[i].offset < page_map->end) {
+            printf("Page map is corrupt: pages overlap at offset %d\n", used[i].offset);
+            exit(EXIT_FAILURE);
+        }
+        if (used[i].offset > page_map->end) {
+            page_map_free(page_map, page_map->end, used[i].offset - page_map->end);
+        }
+        page_map->end = used[i].offset + used[i].units;
+    }
+    free(used);
+    return page_map;
+}
+
+// 关闭页映射，调用前检查点已把映射落盘
+// page_map: 页映射
+void page_map_close(PageMap* page_map)
+{
+    if (close(page_map->file_descriptor) == -1) {
+        printf("Error closing page map file.\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_destroy(&page_map->mutex);
+    free(page_map->entries);
+    free(page_map->free_extents);
+    free(page_map->pending_extents);
+    free(page_map);
+}
+
+// 读取并解压一页，不存在的页置零
+// page_map: 页映射
+// db_file_descriptor: 数据库文件
+// page_num: 第几页
+// page: 页内存
+void page_map_read(PageMap* page_map, int db_file_descriptor, uint32_t page_num, void* page)
+{
+    // 1. 查找位置
+    PageMapEntry entry = { 0, 0, 0 };
+    pthread_mutex_lock(&page_map->mutex);
+    if (page_num < page_map->num_entries) {
+        entry = page_map->entries[page_num];
+    }
+    pthread_mutex_unlock(&page_map->mutex);
+    if (entry.length == 0) {
+        memset(page, 0, PAGE_SIZE);
+        return;
+    }
+
+    // 2. 读取压缩后的数据，未压缩的页直接读入
+    uint8_t* compressed = entry.length == PAGE_SIZE ? page : malloc(entry.length);
+    ssize_t bytes_read = pread(db_file_descriptor, compressed, entry.length, (off_t)entry.offset * PAGE_MAP_UNIT);
+    if (bytes_read != entry.length) {
+        printf("Error reading file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    stats_add(&page_map->stats->bytes_read, bytes_read);
+    if (entry.length != PAGE_SIZE) {
+        page_decompress(compressed, entry.length, page);
+        free(compressed);
+    }
+}
+
+// 压缩并写入一页
+// 原位置放得下时原地覆盖，否则释放原位置并重新分配
+// 只在检查点中调用，被覆盖的页都还在日志中，写到一半崩溃时由重放恢复
+// page_map: 页映射
+// db_file_descriptor: 数据库文件
+// page_num: 第几页
+// page: 页内容
+void page_map_write(PageMap* page_map, int db_file_descriptor, uint32_t page_num, void* page)
+{
+    // 1. 压缩
+    uint8_t* compressed = malloc(PAGE_SIZE);
+    uint32_t length = page_compress(page, compressed);
+    uint32_t units = (length + PAGE_MAP_UNIT - 1) / PAGE_MAP_UNIT;
+
+    // 2. 确定位置
+    pthread_mutex_lock(&page_map->mutex);
+    PageMapEntry entry = { 0, 0, 0 };
+    if (page_num < page_map->num_entries) {
+        entry = page_map->entries[page_num];
+    }
+    if (entry.length == 0 || entry.capacity < units) {
+        if (entry.length > 0) {
+            page_map_free_later(page_map, entry.offset, entry.capacity);
+        }
+        entry.offset = page_map_allocate(page_map, units);
+        entry.capacity = units;
+    }
+    entry.length = length;
+    page_map_set_entry(page_map, page_num, &entry);
+    pthread_mutex_unlock(&page_map->mutex);
+
+    // 3. 写入数据和映射项
+    if (pwrite(db_file_descriptor, compressed, length, (off_t)entry.offset * PAGE_MAP_UNIT) != length ||
+        pwrite(page_map->file_descriptor, &entry, sizeof(PageMapEntry), (off_t)page_num * sizeof(PageMapEntry))
+            != sizeof(PageMapEntry)) {
+        printf("Error writing: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    stats_add(&page_map->stats->bytes_written, length + sizeof(PageMapEntry));
+    free(compressed);
+}
+
+// 丢弃页号不小于 num_pages 的页，释放占用的空间
+// page_map: 页映射
+// num_pages: 保留的页数
+void page_map_truncate(PageMap* page_map, uint32_t num_pages)
+{
+    pthread_mutex_lock(&page_map->mutex);
+    for (uint32_t i = num_pages; i < page_map->num_entries; i++) {
+        if (page_map->entries[i].length > 0) {
+            page_map_free_later(page_map, page_map->entries[i].offset, page_map->entries[i].capacity);
+        }
+    }
+    if (page_map->num_entries > num_pages) {
+        page_map->num_entries = num_pages;
+        if (ftruncate(page_map->file_descriptor, (off_t)num_pages * sizeof(PageMapEntry)) == -1) {
+            printf("Error truncating file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_mutex_unlock(&page_map->mutex);
+}
+
+// 分配空间，优先使用位置最靠前的足够大的空闲空间，否则追加到末尾
+// 调用时需持有页映射的锁
+// page_map: 页映射
+// units: 单位数
+uint32_t page_map_allocate(PageMap* page_map, uint32_t units)
+{
+    for (uint32_t i = 0; i < page_map->num_free_extents; i++) {
+        PageMapExtent* extent = &page_map->free_extents[i];
+        if (extent->units >= units) {
+            uint32_t offset = extent->offset;
+            extent->offset += units;
+            extent->units -= units;
+            // 用完的空间移除，保持按位置有序
+            if (extent->units == 0) {
+                page_map->num_free_extents--;
+                memmove(extent, extent + 1, (page_map->num_free_extents - i) * sizeof(PageMapExtent));
+            }
+            return offset;
+        }
+    }
+    uint32_t offset = page_map->end;
+    page_map->end += units;
+    return offset;
+}
+
+// 释放空间，调用时需持有页映射的锁
+// 空闲空间按位置有序，与相邻的空闲空间合并，位于末尾时直接缩短已使用空间
+// page_map: 页映射
+// offset: 起始位置
+// units: 单位数
+void page_map_free(PageMap* page_map, uint32_t offset, uint32_t units)
+{
+    PageMapExtent* extents = page_map->free_extents;
+
+    // 1. 二分查找插入位置，第一个位置大于 offset 的空间
+    uint32_t min_index = 0;
+    uint32_t max_index = page_map->num_free_extents;
+    while (min_index != max_index) {
+        uint32_t index = (min_index + max_index) / 2;
+        if (extents[index].offset > offset) {
+            max_index = index;
+        }
+        else {
+            min_index = index + 1;
+        }
+    }
+    uint32_t index = min_index;
+
+    // 2. 与前一段相邻时合并到前一段，再看能否与后一段合并
+    if (index > 0 && extents[index - 1].offset + extents[index - 1].units == offset) {
+        PageMapExtent* prev = &extents[index - 1];
+        prev->units += units;
+        if (index < page_map->num_free_extents && prev->offset + prev->units == extents[index].offset) {
+            prev->units += extents[index].units;
+            page_map->num_free_extents--;
+            memmove(&extents[index], &extents[index + 1],
+                    (page_map->num_free_extents - index) * sizeof(PageMapExtent));
+        }
+        index -= 1;
+    }
+    // 3. 与后一段相邻时合并到后一段
+    else if (index < page_map->num_free_extents && offset + units == extents[index].offset) {
+        extents[index].offset = offset;
+        extents[index].units += units;
+    }
+    // 4. 否则插入新的一段
+    else {
+        if (page_map->num_free_extents == page_map->free_extents_capacity) {
+            page_map->free_extents_capacity *= 2;
+            page_map->free_extents = realloc(page_map->free_extents,
+                                             page_map->free_extents_capacity * sizeof(PageMapExtent));
+            extents = page_map->free_extents;
+        }
+        memmove(&extents[index + 1], &extents[index],
+                (page_map->num_free_extents - index) * sizeof(PageMapExtent));
+        extents[index].offset = offset;
+        extents[index].units = units;
+        page_map->num_free_extents++;
+    }
+
+    // 5. 最后一段空闲空间到达末尾时，缩短已使用空间
+    if (index + 1 == page_map->num_free_extents && extents[index].offset + extents[index].units == page_map->end) {
+        page_map->end = extents[index].offset;
+        page_map->num_free_extents--;
+    }
+}
+
+// 暂缓释放空间，调用时需持有页映射的锁
+// 页移到新位置或被截断后，磁盘上的映射项在落盘前仍可能指向原来的空间，
+// 此时复用给其他页，崩溃后两页会指向同一位置，所以等检查点把数据和映射都落盘后再释放
+// page_map: 页映射
+// offset: 起始位置
+// units: 单位数
+void page_map_free_later(PageMap* page_map, uint32_t offset, uint32_t units)
+{
+    if (page_map->num_pending_extents == page_map->pending_extents_capacity) {
+        page_map->pending_extents_capacity *= 2;
+        page_map->pending_extents = realloc(page_map->pending_extents,
+                                            page_map->pending_extents_capacity * sizeof(PageMapExtent));
+    }
+    page_map->pending_extents[page_map->num_pending_extents].offset = offset;
+    page_map->pending_extents[page_map->num_pending_extents].units = units;
+    page_map->num_pending_extents++;
+}
+
+// 暂缓释放的空间数，检查点落盘前记下，落盘后只释放这些
+// page_map: 页映射
+uint32_t page_map_num_pending(PageMap* page_map)
+{
+    pthread_mutex_lock(&page_map->mutex);
+    uint32_t num_extents = page_map->num_pending_extents;
+    pthread_mutex_unlock(&page_map->mutex);
+    return num_extents;
+}
+
+// 数据和映射落盘后，释放最早暂缓的若干段空间
+// page_map: 页映射
+// num_extents: 落盘前暂缓的空间数
+void page_map_release_pending(PageMap* page_map, uint32_t num_extents)
+{
+    pthread_mutex_lock(&page_map->mutex);
+    for (uint32_t i = 0; i < num_extents; i++) {
+        page_map_free(page_map, page_map->pending_extents[i].offset, page_map->pending_extents[i].units);
+    }
+    page_map->num_pending_extents -= num_extents;
+    memmove(page_map->pending_extents, page_map->pending_extents + num_extents,
+            page_map->num_pending_extents * sizeof(PageMapExtent));
+    pthread_mutex_unlock(&page_map->mutex);
+}
+
+// 设置页的映射项，需要时扩大数组，调用时需持有页映射的锁
+// page_map: 页映射
+// page_num: 第几页
+// entry: 映射项
+void page_map_set_entry(PageMap* page_map, uint32_t page_num, PageMapEntry* entry)
+{
+    if (page_num >= page_map->entries_capacity) {
+        uint32_t capacity = page_map->entries_capacity;
+        while (capacity <= page_num) {
+            capacity *= 2;
+        }
+        page_map->entries = realloc(page_map->entries, capacity * sizeof(PageMapEntry));
+        memset(page_map->entries + page_map->entries_capacity, 0,
+               (capacity - page_map->entries_capacity) * sizeof(PageMapEntry));
+        page_map->entries_capacity = capacity;
+    }
+    page_map->entries[page_num] = *entry;
+    if (page_num >= page_map->num_entries) {
+        page_map->num_entries = page_num + 1;
+    }
+}
+
+// 按位置比较空间，用于排序
+int compare_page_map_extent_offset(const void* a, const void* b)
+{
+    uint32_t offset_a = ((PageMapExtent*)a)->offset;
+    uint32_t offset_b = ((PageMapExtent*)b)->offset;
+    return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+// 压缩一页（RLE）
+// 控制字节最高位为1时是重复段：后跟1个字节，重复 (控制字节 & 0x7f) + 3 次
+// 最高位为0时是字面段：后跟 控制字节 + 1 个原样的字节
+// 压缩后不比原页小时原样保存，返回 PAGE_SIZE
+// page: 页内容
+// out: 输出，至少 PAGE_SIZE 字节
+uint32_t page_compress(uint8_t* page, uint8_t* out)
+{
+    uint32_t in = 0;
+    uint32_t length = 0;
+    while (in < PAGE_SIZE) {
+        // 1. 至少3个相同的字节编码为重复段
+        uint32_t run = 1;
+        while (in + run < PAGE_SIZE && run < PAGE_COMPRESS_MAX_RUN && page[in + run] == page[in]) {
+            run++;
+        }
+        if (run >= 3) {
+            if (length + 2 >= PAGE_SIZE) {
+                break;
+            }
+            out[length++] = 0x80 | (run - 3);
+            out[length++] = page[in];
+            in += run;
+            continue;
+        }
+
+        // 2. 否则编码为字面段，直到遇到重复段或满128字节
+        uint32_t start = in;
+        while (in < PAGE_SIZE && in - start < 128) {
+            if (in + 2 < PAGE_SIZE && page[in] == page[in + 1] && page[in] == page[in + 2]) {
+                break;
+            }
+            in++;
+        }
+        uint32_t literal = in - start;
+        if (length + 1 + literal >= PAGE_SIZE) {
+            in = start;
+            break;
+        }
+        out[length++] = literal - 1;
+        memcpy(out + length, page + start, literal);
+        length += literal;
+    }
+
+    if (in < PAGE_SIZE) {
+        memcpy(out, page, PAGE_SIZE);
+        return PAGE_SIZE;
+    }
+    return length;
+}
+
+// 解压一页
+// in: 压缩后的数据
+// length: 压缩后的长度
+// page: 页内存
+void page_decompress(uint8_t* in, uint32_t length, uint8_t* page)
+{
+    uint32_t position = 0;
+    uint32_t out = 0;
+    while (position < length && out < PAGE_SIZE) {
+        uint8_t control = in[position++];
+        if (control & 0x80) {
+            uint32_t run = (control & 0x7f) + 3;
+            memset(page + out, in[position++], run);
+            out += run;
+        }
+        else {
+            uint32_t literal = control + 1;
+            memcpy(page + out, in + position, literal);
+            position += literal;
+            out += literal;
+        }
+    }
+    if (out != PAGE_SIZE) {
+        printf("Corrupt compressed page\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// 创建版本存储
+VersionStore* version_store_open(void)
+{
+    VersionStore* store = malloc(sizeof(VersionStore));
+    store->buckets = calloc(VERSION_STORE_BUCKETS, sizeof(PageVersion*));
+    store->oldest = NULL;
+    store->newest = NULL;
+    store->commit_version = 0;
+    store->num_snapshots = 0;
+    store->snapshots_capacity = 16;
+    store->snapshots = malloc(store->snapshots_capacity * sizeof(uint64_t));
+    store->free_versions = NULL;
+    store->num_free_versions = 0;
+    pthread_mutex_init(&store->mutex, NULL);
+    return store;
+}
+
+// 释放版本存储和所有旧版本
+// store: 版本存储
+void version_store_close(VersionStore* store)
+{
+    PageVersion* version = store->oldest;
+    while (version != NULL) {
+        PageVersion* next = version->next_reclaim;
+        free(version->data);
+        free(version);
+        version = next;
+    }
+    version = store->free_versions;
+    while (version != NULL) {
+        PageVersion* next = version->next;
+        free(version->data);
+        free(version);
+        version = next;
+    }
+    pthread_mutex_destroy(&store->mutex);
+    free(store->buckets);
+    free(store->snapshots);
+    free(store);
+}
+
+// 保存页的当前内容作为旧版本，由下一次提交替换
+// 调用时持有页的排他闩锁，页内容不会被读者以外的线程访问
+// 优先复用已回收的旧版本
+// store: 版本存储
+// page_num: 第几页
+// page: 页的当前内容
+void version_store_save(VersionStore* store, uint32_t page_num, void* page)
+{
+    pthread_mutex_lock(&store->mutex);
+    PageVersion* version = store->free_versions;
+    if (version != NULL) {
+        store->free_versions = version->next;
+        store->num_free_versions -= 1;
+    }
+    pthread_mutex_unlock(&store->mutex);
+
+    if (version == NULL) {
+        version = malloc(sizeof(PageVersion));
+        version->data = malloc(PAGE_SIZE);
+    }
+    version->page_num = page_num;
+    memcpy(version->data, page, PAGE_SIZE);
+    version->next_reclaim = NULL;
+
+    pthread_mutex_lock(&store->mutex);
+
+    // 1. 当前内容由上一个旧版本的替换者产生，没有旧版本时对所有快照可见
+    PageVersion** bucket = &store->buckets[page_num % VERSION_STORE_BUCKETS];
+    version->begin = 0;
+    for (PageVersion* older = *bucket; older != NULL; older = older->next) {
+        if (older->page_num == page_num) {
+            version->begin = older->end;
+            break;
+        }
+    }
+    version->end = store->commit_version + 1;
+
+    // 2. 插入哈希桶头部和回收链表尾部
+    version->next = *bucket;
+    *bucket = version;
+    if (store->newest == NULL) {
+        store->oldest = version;
+    }
+    else {
+        store->newest->next_reclaim = version;
+    }
+    store->newest = version;
+
+    pthread_mutex_unlock(&store->mutex);
+}
+
+// 读取页在快照中可见的旧版本
+// 快照之后页没有被修改过时返回 false，当前页即可见的版本
+// store: 版本存储
+// page_num: 第几页
+// snapshot: 快照
+// page: 目标内存
+bool version_store_read(VersionStore* store, uint32_t page_num, uint64_t snapshot, void* page)
+{
+    pthread_mutex_lock(&store->mutex);
+
+    // 同一页新的版本在前，找 end 大于快照的最旧版本
+    PageVersion* visible = NULL;
+    for (PageVersion* version = store->buckets[page_num % VERSION_STORE_BUCKETS]; version != NULL;
+         version = version->next) {
+        if (version->page_num != page_num) {
+            continue;
+        }
+        if (version->end <= snapshot) {
+            break;
+        }
+        visible = version;
+    }
+    if (visible != NULL) {
+        memcpy(page, visible->data, PAGE_SIZE);
+    }
+
+    pthread_mutex_unlock(&store->mutex);
+    return visible != NULL;
+}
+
+// 开始快照，看到已提交的修改，结束时调用 version_store_end_snapshot
+// store: 版本存储
+uint64_t version_store_begin_snapshot(VersionStore* store)
+{
+    pthread_mutex_lock(&store->mutex);
+    if (store->num_snapshots == store->snapshots_capacity) {
+        store->snapshots_capacity *= 2;
+        store->snapshots = realloc(store->snapshots, store->snapshots_capacity * sizeof(uint64_t));
+    }
+    uint64_t snapshot = store->commit_version;
+    store->snapshots[store->num_snapshots++] = snapshot;
+    pthread_mutex_unlock(&store->mutex);
+    return snapshot;
+}
+
+// 结束快照，回收不再需要的旧版本
+// store: 版本存储
+// snapshot: 快照
+void version_store_end_snapshot(VersionStore* store, uint64_t snapshot)
+{
+    pthread_mutex_lock(&store->mutex);
+    for (uint32_t i = 0; i < store->num_snapshots; i++) {
+        if (store->snapshots[i] == snapshot) {
+            store->snapshots[i] = store->snapshots[--store->num_snapshots];
+            break;
+        }
+    }
+    version_store_reclaim(store);
+    pthread_mutex_unlock(&store->mutex);
+}
+
+// 提交，本事务保存的旧版本从此被替换
+// store: 版本存储
+void version_store_commit(VersionStore* store)
+{
+    pthread_mutex_lock(&store->mutex);
+    store->commit_version += 1;
+    version_store_reclaim(store);
+    pthread_mutex_unlock(&store->mutex);
+}
+
+// 回收所有快照都看不到的旧版本，即 end 不大于最旧快照的版本
+// 回收链表按 end 递增，只需从头部回收；被回收的版本是同一页最旧的版本
+// 回收的版本留一部分给之后的 version_store_save 复用
+// 调用时需持有版本存储的锁
+// store: 版本存储
+void version_store_reclaim(VersionStore* store)
+{
+    uint64_t horizon = store->commit_version;
+    for (uint32_t i = 0; i < store->num_snapshots; i++) {
+        if (store->snapshots[i] < horizon) {
+            horizon = store->snapshots[i];
+        }
+    }
+
+    while (store->oldest != NULL && store->oldest->end <= horizon) {
+        PageVersion* version = store->oldest;
+        PageVersion** link = &store->buckets[version->page_num % VERSION_STORE_BUCKETS];
+        while (*link != version) {
+            link = &(*link)->next;
+        }
+        *link = version->next;
+
+        store->oldest = version->next_reclaim;
+        if (store->oldest == NULL) {
+            store->newest = NULL;
+        }
+        if (store->num_free_versions < VERSION_STORE_MAX_FREE) {
+            version->next = store->free_versions;
+            store->free_versions = version;
+            store->num_free_versions += 1;
+        }
+        else {
+            free(version->data);
+            free(version);
+        }
+    }
+}
+
+// 根据类型执行操作
+// in_transaction: 是否在显式事务中，返回执行后的状态
+ExecuteResult execute_statement(Statement* statement, Table* table, bool* in_transaction)
+{
+    switch(statement->type) {
+        case (STATEMENT_INSERT):
+            log_message(LOG_DEBUG, "insert %d %s %s", statement->row_to_insert.id, statement->row_to_insert.username, statement->row_to_insert.email);
+            return execute_insert(statement, table, *in_transaction);
+            break;
+        case (STATEMENT_SELECT):
+            log_message(LOG_DEBUG, "select");
+            return execute_select(statement, table, *in_transaction, stdout);
+            break;
+        default:
+            return execute_transaction(statement, table, in_transaction);
+    }
+}
+
+// 绑定整数参数
+// statement: 语句
+// index: 第几个 ?，从 1 开始
+// value: 值
+PrepareResult statement_bind_int(Statement* statement, uint32_t index, uint32_t value)
+{
+    if (index == 0 || index > statement->num_params) {
+        return PREPARE_BIND_ERROR;
+    }
+    switch (statement->params[index - 1]) {
+        case (PARAM_ID):
+            statement->row_to_insert.id = value;
+            return PREPARE_SUCCESS;
+        case (PARAM_LOWER):
+            statement->lower = value;
+            return PREPARE_SUCCESS;
+        case (PARAM_UPPER):
+            statement->upper = value;
+            return PREPARE_SUCCESS;
+        default:
+            return PREPARE_BIND_ERROR;
+    }
+}
+
+// 绑定文本参数
+// statement: 语句
+// index: 第几个 ?，从 1 开始
+// value: 文本，不需要以 0 结尾
+// length: 文本长度
+PrepareResult statement_bind_text(Statement* statement, uint32_t index, const char* value, uint32_t length)
+{
+    if (index == 0 || index > statement->num_params) {
+        return PREPARE_BIND_ERROR;
+    }
+    char* column;
+    switch (statement->params[index - 1]) {
+        case (PARAM_USERNAME):
+            if (length > COLUMN_USERNAME_SIZE) {
+                return PREPARE_STRING_TOO_LONG;
+            }
+            column = statement->row_to_insert.username;
+            break;
+        case (PARAM_EMAIL):
+            if (length > COLUMN_EMAIL_SIZE) {
+                return PREPARE_STRING_TOO_LONG;
+            }
+            column = statement->row_to_insert.email;
+            break;
+        default:
+            return PREPARE_BIND_ERROR;
+    }
+    memcpy(column, value, length);
+    column[length] = 0;
+    return PREPARE_SUCCESS;
+}
+
+// 执行语句，查询结果写入 stream
+// 参数保持绑定的值，可以只重新绑定部分参数后再次执行
+// statement: 语句
+// table: 表
+// in_transaction: 是否在显式事务中，返回执行后的状态
+// stream: 输出目标
+ExecuteResult statement_step(Statement* statement, Table* table, bool* in_transaction, FILE* stream)
+{
+    switch (statement->type) {
+        case (STATEMENT_INSERT):
+            return execute_insert(statement, table, *in_transaction);
+        case (STATEMENT_SELECT):
+            return execute_select(statement, table, *in_transaction, stream);
+        default:
+            return execute_transaction(statement, table, in_transaction);
+    }
+}
+
+// 创建语句缓存
+StatementCache* statement_cache_open()
+{
+    StatementCache* cache = malloc(sizeof(StatementCache));
+    for (uint32_t i = 0; i < STATEMENT_CACHE_SIZE; i++) {
+        cache->entries[i].sql = NULL;
+    }
+    cache->next_victim = 0;
+    return cache;
+}
+
+// 释放语句缓存
+// cache: 语句缓存
+void statement_cache_close(StatementCache* cache)
+{
+    for (uint32_t i = 0; i < STATEMENT_CACHE_SIZE; i++) {
+        free(cache->entries[i].sql);
+    }
+    free(cache);
+}
+
+// 根据文本准备语句，解析过的文本直接复制缓存的结果，不再分词
+// cache: 语句缓存
+// sql: 语句文本，不会被修改
+// statement: 返回的语句
+PrepareResult statement_cache_prepare(StatementCache* cache, char* sql, Statement* statement)
+{
+    // 1. 查找缓存
+    uint32_t hash = 2166136261u;
+    for (char* c = sql; *c != 0; c++) {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    for (uint32_t i = 0; i < STATEMENT_CACHE_SIZE; i++) {
+        StatementCacheEntry* entry = &cache->entries[i];
+        if (entry->sql != NULL && entry->hash == hash && strcmp(entry->sql, sql) == 0) {
+            *statement = entry->statement;
+            return PREPARE_SUCCESS;
+        }
+    }
+
+    // 2. 解析副本，解析会修改文本
+    InputBuffer input_buffer;
+    input_buffer.buffer = strdup(sql);
+    input_buffer.buffer_length = strlen(sql) + 1;
+    input_buffer.input_length = strlen(sql);
+    PrepareResult result = prepare_statement(&input_buffer, statement);
+    free(input_buffer.buffer);
+    if (result != PREPARE_SUCCESS) {
+        return result;
+    }
+
+    // 3. 放入缓存，满时轮流替换；多行插入持有行数组，不缓存
+    if (statement->rows != NULL) {
+        return PREPARE_SUCCESS;
+    }
+    StatementCacheEntry* entry = &cache->entries[cache->next_victim];
+    cache->next_victim = (cache->next_victim + 1) % STATEMENT_CACHE_SIZE;
+    free(entry->sql);
+    entry->sql = strdup(sql);
+    entry->hash = hash;
+    entry->statement = *statement;
+    return PREPARE_SUCCESS;
+}
+
+// 创建开始游标
+// table: 表
+// snapshot: 快照
+Cursor* table_start(Table* table, uint64_t snapshot)
+{
+    return table_seek(table, 0, snapshot);
+}
+
+// 返回快照中指向第一个键不小于 key 的行的游标，没有这样的行时游标位于表尾
+// table: 表
+// key: 键值
+// snapshot: 快照
+Cursor* table_seek(Table* table, uint32_t key, uint64_t snapshot)
+{
+    Cursor* cursor = table_find(table, key, snapshot);
+
+    // 键大于叶子节点中所有键时，位置在节点末尾，移到下一个叶子节点的开头
+    uint32_t num_cells = *leaf_node_num_cells(cursor->node);
+    cursor->end_of_table = false;
+    if (cursor->cell_num >= num_cells) {
+        cursor->cell_num = num_cells - 1;
+        if (num_cells == 0) {
+            cursor->end_of_table = true;
+        }
+        else {
+            cursor_advance(cursor);
+        }
+    }
+
+    return cursor;
+}
+
+// 创建结束游标
+Cursor* table_end(Table* table)
+{
+    Cursor* cursor = cursor_alloc();
+    cursor->table = table;
+    cursor->page_num = table->root_page_num;
+
+    void* root_node = get_page(table->pager, table->root_page_num);  // 由游标持有
+    uint32_t num_cells = *leaf_node_num_cells(root_node);
+    cursor->cell_num = num_cells;
+    cursor->end_of_table = true;
+    cursor->snapshot = 0;
+    cursor->node = NULL;
+    return cursor;
+}
+
+// 向前移动读者游标，到节点末尾时读取快照中的兄弟节点
+void cursor_advance(Cursor* cursor)
+{
+    cursor->cell_num += 1;
+    if (cursor->cell_num >= (*leaf_node_num_cells(cursor->node))) {
+        // 移动到下一个兄弟叶子节点
+        uint32_t next_page_num = *leaf_node_next_leaf(cursor->node);
+        if (next_page_num == 0) {
+            // 最右边节点
+            cursor->end_of_table = true;
+        }
+        else {
+            pager_read_page(cursor->table->pager, next_page_num, cursor->snapshot, cursor->node);
+            cursor->page_num = next_page_num;
+            cursor->cell_num = 0;
+        }
+    }
+}
+
+// 释放游标，读者游标释放副本，写者游标解除对当前页的固定
+void cursor_free(Cursor* cursor)
+{
+    if (cursor->node != NULL) {
+        page_buffer_free(cursor->node);
+    }
+    else {
+        unpin_page(cursor->table->pager, cursor->page_num);
+    }
+
+    ThreadPool* pool = thread_pool_get();
+    if (pool->num_cursors < CURSOR_POOL_SIZE) {
+        *(void**)cursor = pool->cursors;
+        pool->cursors = cursor;
+        pool->num_cursors += 1;
+    }
+    else {
+        free(cursor);
+    }
+}
+
+// 返回当前线程的游标和页缓冲池，第一次使用时登记线程退出时的释放
+ThreadPool* thread_pool_get(void)
+{
+    if (!thread_pool.registered) {
+        pthread_once(&thread_pool_once, thread_pool_create_key);
+        pthread_setspecific(thread_pool_key, &thread_pool);
+        thread_pool.registered = true;
+    }
+    return &thread_pool;
+}
+
+// 创建线程退出时释放池的键，只调用一次
+void thread_pool_create_key(void)
+{
+    pthread_key_create(&thread_pool_key, thread_pool_release);
+}
+
+// 线程退出时释放池中的游标和页缓冲
+// arg: 线程的池
+void thread_pool_release(void* arg)
+{
+    ThreadPool* pool = arg;
+    while (pool->cursors != NULL) {
+        void* next = *(void**)pool->cursors;
+        free(pool->cursors);
+        pool->cursors = next;
+    }
+    while (pool->page_buffers != NULL) {
+        void* next = *(void**)pool->page_buffers;
+        free(pool->page_buffers);
+        pool->page_buffers = next;
+    }
+    pool->num_cursors = 0;
+    pool->num_page_buffers = 0;
+}
+
+// 分配游标，优先从当前线程的池中取，由 cursor_free 归还
+Cursor* cursor_alloc(void)
+{
+    ThreadPool* pool = thread_pool_get();
+    if (pool->cursors == NULL) {
+        return malloc(sizeof(Cursor));
+    }
+    Cursor* cursor = pool->cursors;
+    pool->cursors = *(void**)cursor;
+    pool->num_cursors -= 1;
+    return cursor;
+}
+
+// 分配一页大小的缓冲，用于保存节点在快照中的副本，优先从当前线程的池中取
+void* page_buffer_alloc(void)
+{
+    ThreadPool* pool = thread_pool_get();
+    if (pool->page_buffers == NULL) {
+        return malloc(PAGE_SIZE);
+    }
+    void* page = pool->page_buffers;
+    pool->page_buffers = *(void**)page;
+    pool->num_page_buffers -= 1;
+    return page;
+}
+
+// 归还 page_buffer_alloc 分配的缓冲，池满时释放
+// page: 缓冲
+void page_buffer_free(void* page)
+{
+    ThreadPool* pool = thread_pool_get();
+    if (pool->num_page_buffers < PAGE_BUFFER_POOL_SIZE) {
+        *(void**)page = pool->page_buffers;
+        pool->page_buffers = page;
+        pool->num_page_buffers += 1;
+    }
+    else {
+        free(page);
+    }
+}
+
+// 叶子节点单元的数量
+// node: 节点
+uint32_t* leaf_node_num_cells(void* node)
+{
+    return node + LEAF_NODE_NUM_CELLS_OFFSET;
+}
+
+// 叶子节点单元内容区的起始位置
+// node: 节点
+uint16_t* leaf_node_content_start(void* node)
+{
+    return node + LEAF_NODE_CONTENT_START_OFFSET;
+}
+
+// 获取单元的槽
+// node: 节点
+// cell_num: 第几个cell
+void* leaf_node_cell(void* node, uint32_t cell_num)
+{
+    return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_SLOT_SIZE;
+}
+
+// 获取页节点键
+// node: 节点
+// cell_num: 第几个cell
+uint32_t* leaf_node_key(void* node, uint32_t cell_num)
+{
+    return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_OFFSET;
+}
+
+// 获取页节点数据，按槽中记录的位置找到
+// node: 节点
+// cell_num: 第几个cell
+void* leaf_node_value(void* node, uint32_t cell_num)
+{
+    uint16_t offset = *(uint16_t*)(leaf_node_cell(node, cell_num) + LEAF_NODE_VALUE_OFFSET_OFFSET);
+    return node + offset;
+}
+
+// 获取页节点数据的长度
+// node: 节点
+// cell_num: 第几个cell
+uint16_t* leaf_node_value_length(void* node, uint32_t cell_num)
+{
+    return leaf_node_cell(node, cell_num) + LEAF_NODE_VALUE_LENGTH_OFFSET;
+}
+
+// 叶子节点槽数组和内容区之间的空闲字节数
+// node: 节点
+uint32_t leaf_node_free_space(void* node)
+{
+    uint32_t slots_end = LEAF_NODE_HEADER_SIZE + *leaf_node_num_cells(node) * LEAF_NODE_SLOT_SIZE;
+    return *leaf_node_content_start(node) - slots_end;
+}
+
+// 在第 cell_num 个位置插入单元，调用前需确认空间足够
+// 数据从内容区向前分配，之后的槽后移一位
+// node: 节点
+// cell_num: 第几个cell
+// key: 键
+// value: 数据
+// length: 数据长度
+void leaf_node_insert_cell(void* node, uint32_t cell_num, uint32_t key, void* value, uint32_t length)
+{
+    uint32_t num_cells = *leaf_node_num_cells(node);
+
+    // 1. 写入数据
+    uint16_t offset = *leaf_node_content_start(node) - length;
+    memcpy(node + offset, value, length);
+    *leaf_node_content_start(node) = offset;
+
+    // 2. 槽后移，腾出位置
+    memmove(leaf_node_cell(node, cell_num + 1), leaf_node_cell(node, cell_num),
+            (num_cells - cell_num) * LEAF_NODE_SLOT_SIZE);
+
+    // 3. 写入槽
+    *leaf_node_key(node, cell_num) = key;
+    *(uint16_t*)(leaf_node_cell(node, cell_num) + LEAF_NODE_VALUE_OFFSET_OFFSET) = offset;
+    *leaf_node_value_length(node, cell_num) = length;
+    *leaf_node_num_cells(node) = num_cells + 1;
+}
+
+// 清空叶子节点的所有单元，空闲空间置零
+// node: 节点
+void leaf_node_clear_cells(void* node)
+{
+    *leaf_node_num_cells(node) = 0;
+    *leaf_node_content_start(node) = PAGE_SIZE;
+    memset(node + LEAF_NODE_HEADER_SIZE, 0, LEAF_NODE_SPACE_FOR_CELLS);
+}
+
+// 初始化叶子节点
+// 1. 设置节点类型
+// 2. 设置为非根节点
+// 3. 重置单元数
+// 4. 重置下一个兄弟节点
+// node: 节点
+void initialize_leaf_node(void* node)
+{
+    set_node_type(node, NODE_LEAF);
+    set_node_root(node, false);
+    leaf_node_clear_cells(node);
+    *leaf_node_next_leaf(node) = 0; // 0 表示没有兄弟节点
+}
+
+// 初始化内部节点
+// 1、设置节点类型
+// 2、设置为非根节点
+// 3、重置键数
+// node: 节点
+void initialize_internal_node(void* node)
+{
+    set_node_type(node, NODE_INTERNAL);
+    set_node_root(node, false);
+    *internal_node_num_keys(node) = 0;
+    *internal_node_right_child(node) = INVALID_PAGE_NUM; // 还没有子节点
+}
+
+// 是否是根节点
+// node: 节点
+bool is_node_root(void* node)
+{
+    uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
+    return (bool)value;
+}
+
+// 设置是否是根节点
+// node: 节点
+// is_root: 是否是根节点
+void set_node_root(void* node, bool is_root)
+{
+    uint8_t value = is_root;
+    *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
+}
+
+// 获取页类型
+// node: 节点
+NodeType get_node_type(void* node)
+{
+    uint8_t value =  *((uint8_t *)(node + NODE_TYPE_OFFSET));
+    return (NodeType)value;
+}
+
+// 设置页类型
+// node: 节点
+// type: 类型
+void set_node_type(void* node, NodeType type)
+{
+    uint8_t value = type;
+    *((uint8_t *)(node + NODE_TYPE_OFFSET)) = value;
+}
+
+// 父节点指针
+// node: 节点
+uint32_t* node_parent(void* node)
+{
+    return node + PARENT_POINTER_OFFSET;
+}
+
+// 设置节点的父节点
+// pager: 分页器
+// page_num: 节点所在页
+// parent_page_num: 父节点所在页
+void set_node_parent(Pager* pager, uint32_t page_num, uint32_t parent_page_num)
+{
+    void* node = get_page(pager, page_num);
+    if (*node_parent(node) != parent_page_num) {
+        pager_mark_dirty(pager, page_num);
+        *node_parent(node) = parent_page_num;
+    }
+    unpin_page(pager, page_num);
+}
+
+// 获取下一个兄弟页节点
+// node: 节点
+uint32_t* leaf_node_next_leaf(void* node)
+{
+    return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+}
+
+// 内部节点键的数量
+// node: 节点
+uint32_t* internal_node_num_keys(void* node)
+{
+    return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+}
+
+// 内部节点右节点
+// node: 节点
+uint32_t* internal_node_right_child(void* node)
+{
+    return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+}
+
+// 内部节点单元
+// node: 节点
+// cell_num: 第几个cell
+uint32_t* internal_node_cell(void* node, uint32_t cell_num)
+{
+    return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+}
+
+// 内部节点子节点
+// node: 节点
+// child_num: 子节点序号
+uint32_t* internal_node_child(void* node, uint32_t child_num)
+{
+    uint32_t num_keys = *internal_node_num_keys(node);
+    if (child_num > num_keys) {
+        printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
+        exit(EXIT_FAILURE);
+    } else if (child_num == num_keys) {
+        uint32_t* right_child = internal_node_right_child(node);
+        if (*right_child == INVALID_PAGE_NUM) {
+            printf("Tried to access right child of node, but was invalid page\n");
+            exit(EXIT_FAILURE);
+        }
+        return right_child;
+    } else {
+        return internal_node_cell(node, child_num);
+    }
+}
+
+// 叶节点插入
+// cursor: 游标
+// key: 键
+// value: 编码后的数据
+// length: 数据长度，不超过 LEAF_NODE_MAX_VALUE_SIZE
+void leaf_node_insert(Cursor* cursor, uint32_t key, void* value, uint32_t length) {
+    // 1. 获取页
+    void* node = get_page(cursor->table->pager, cursor->page_num);
+    // 2. 判断空闲空间是否够放数据和槽，不够则拆分页并插入
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    log_message(LOG_DEBUG, "leaf_node_insert cursor page_num: %d, cell_num: %d num_cells:%d key:%d", cursor->page_num, cursor->cell_num, num_cells, key);
+    if (leaf_node_free_space(node) < length + LEAF_NODE_SLOT_SIZE) {
+        unpin_page(cursor->table->pager, cursor->page_num);
+        leaf_node_split_and_insert(cursor, key, value, length);
+        return;
+    }
+
+    // 3. 插入单元，只移动槽，不移动数据
+    pager_mark_dirty(cursor->table->pager, cursor->page_num);
+    leaf_node_insert_cell(node, cursor->cell_num, key, value, length);
+    unpin_page(cursor->table->pager, cursor->page_num);
+}
+
+// 节点满后，按字节数平分为两个节点
+// 在最右叶子节点末尾追加时，老节点保持满，新节点只放新数据
+// cursor: 游标
+// key: 键
+// value: 编码后的数据
+// length: 数据长度
+void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, void* value, uint32_t length)
+{
+    // 1.根据游标获取老节点
+    // 2.创建新节点
+    Pager* pager = cursor->table->pager;
+    stats_add(&cursor->table->leaf_splits, 1);
+    void* old_node = get_page(pager, cursor->page_num);
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void* new_node = get_page(pager, new_page_num);
+    pager_mark_dirty(pager, cursor->page_num);
+    pager_mark_dirty(pager, new_page_num);
+    initialize_leaf_node(new_node);
+    *node_parent(new_node) = *node_parent(old_node);
+    uint32_t num_cells = *leaf_node_num_cells(old_node);
+    bool append = cursor->cell_num == num_cells && *leaf_node_next_leaf(old_node) == 0;
+    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+    *leaf_node_next_leaf(old_node) = new_page_num;
+
+    // 3. 把将要插入的数据算入，共 N+1 个单元，数据指向老节点的副本
+    void* copy = page_buffer_alloc();
+    memcpy(copy, old_node, PAGE_SIZE);
+    uint32_t total_cells = num_cells + 1;
+    uint32_t keys[ROW_BATCH_MAX_ROWS + 1];
+    void* values[ROW_BATCH_MAX_ROWS + 1];
+    uint32_t lengths[ROW_BATCH_MAX_ROWS + 1];
+    uint32_t total_bytes = 0;
+    for (uint32_t i = 0; i < total_cells; i++) {
+        if (i == cursor->cell_num) {
+            keys[i] = key;
+            values[i] = value;
+            lengths[i] = length;
+        }
+        else {
+            uint32_t source = i < cursor->cell_num ? i : i - 1;
+            keys[i] = *leaf_node_key(copy, source);
+            values[i] = leaf_node_value(copy, source);
+            lengths[i] = *leaf_node_value_length(copy, source);
+        }
+        total_bytes += lengths[i] + LEAF_NODE_SLOT_SIZE;
+    }
+
+    // 4. 确定左边的单元数
+    //    追加时左边保留全部老单元；否则左边装到一半字节数为止，两边都至少一个单元
+    uint32_t left_count = num_cells;
+    if (!append) {
+        uint32_t left_bytes = 0;
+        left_count = 0;
+        while (left_count < total_cells - 1 &&
+               (left_count == 0 || left_bytes + (lengths[left_count] + LEAF_NODE_SLOT_SIZE) / 2 <= total_bytes / 2)) {
+            left_bytes += lengths[left_count] + LEAF_NODE_SLOT_SIZE;
+            left_count++;
+        }
+    }
+
+    // 5. 重新装填两个节点
+    leaf_node_clear_cells(old_node);
+    for (uint32_t i = 0; i < total_cells; i++) {
+        void* destination_node = i < left_count ? old_node : new_node;
+        uint32_t index_within_node = *leaf_node_num_cells(destination_node);
+        leaf_node_insert_cell(destination_node, index_within_node, keys[i], values[i], lengths[i]);
+    }
+    page_buffer_free(copy);
+
+    bool old_is_root = is_node_root(old_node);
+    uint32_t new_max = get_node_max_key(pager, old_node);
+    uint32_t parent_page_num = *node_parent(old_node);
+    unpin_page(pager, cursor->page_num);
+    unpin_page(pager, new_page_num);
+
+    if (old_is_root) {
+        return create_new_root(cursor->table, new_page_num);
+    }
+    else {
+        // 老节点的最大键变小了，更新父节点中的键，再把新节点插入父节点中老节点之后
+        void* parent = get_page(pager, parent_page_num);
+        pager_mark_dirty(pager, parent_page_num);
+        update_internal_node_key(parent, cursor->page_num, new_max);
+        unpin_page(pager, parent_page_num);
+        internal_node_insert(cursor->table, parent_page_num, cursor->page_num, new_page_num);
+    }
+}
+
+
+// 处理分离根节点，左为根节点，右为新节点
+// 拷贝老的根节点到新的左节点
+// 初始化根节点为新的根节点
+// 新的根节点指向两个子节点
+// table: 表
+// right_child_page_num: 右节点num
+void create_new_root(Table* table, uint32_t right_child_page_num)
+{
+    // 获取根节点，创建左节点
+    Pager* pager = table->pager;
+    void* root = get_page(pager, table->root_page_num);
+    void* right_child = get_page(pager, right_child_page_num);
+    uint32_t left_child_page_num = get_unused_page_num(pager);
+    void* left_child = get_page(pager, left_child_page_num);
+    pager_mark_dirty(pager, table->root_page_num);
+    pager_mark_dirty(pager, right_child_page_num);
+    pager_mark_dirty(pager, left_child_page_num);
+
+    // 拷贝根节点数据到左节点
+    memcpy(left_child, root, PAGE_SIZE);
+    set_node_root(left_child, false);
+
+    // 左节点是内部节点时，它的子节点改为指向左节点
+    if (get_node_type(left_child) == NODE_INTERNAL) {
+        for (uint32_t i = 0; i <= *internal_node_num_keys(left_child); i++) {
+            set_node_parent(pager, *internal_node_child(left_child, i), left_child_page_num);
+        }
+    }
+
+    // 根节点包含一个键和两个子节点
+    uint32_t left_child_max_key = get_node_max_key(pager, left_child);
+    initialize_internal_node(root);
+    set_node_root(root, true);
+    *internal_node_num_keys(root) = 1;  // 内部节点的键数为1
+    *internal_node_child(root, 0) = left_child_page_num;  // 左节点存入内部节点体的第一个位置
+    *internal_node_key(root, 0) = left_child_max_key;  // 左节点最大键存入内部节点体的第一个位置
+    *internal_node_right_child(root) = right_child_page_num;  // 内部节点头部保存最右边的子节点
+    *node_parent(left_child) = table->root_page_num;
+    *node_parent(right_child) = table->root_page_num;
+
+    unpin_page(pager, table->root_page_num);
+    unpin_page(pager, right_child_page_num);
+    unpin_page(pager, left_child_page_num);
+}
+
+// 向内部节点插入子节点，节点满后分裂
+// 新子节点是 left_page_num 分裂出的右兄弟，按页号定位插入位置，索引树中相邻子节点的键可以相同
+// table: 表
+// parent_page_num: 内部节点所在页
+// left_page_num: 分裂的子节点所在页
+// child_page_num: 新子节点所在页
+void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t left_page_num, uint32_t child_page_num)
+{
+    Pager* pager = table->pager;
+    void* parent = get_page(pager, parent_page_num);
+    void* child = get_page(pager, child_page_num);
+    uint32_t child_max_key = get_node_max_key(pager, child);
+    unpin_page(pager, child_page_num);
+
+    uint32_t original_num_keys = *internal_node_num_keys(parent);
+    if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
+        unpin_page(pager, parent_page_num);
+        internal_node_split_and_insert(table, parent_page_num, left_page_num, child_page_num);
+        return;
+    }
+
+    pager_mark_dirty(pager, parent_page_num);
+    uint32_t right_child_page_num = *internal_node_right_child(parent);
+    if (right_child_page_num == INVALID_PAGE_NUM) {
+        // 空的内部节点，新子节点作为最右子节点
+        *internal_node_right_child(parent) = child_page_num;
+        unpin_page(pager, parent_page_num);
+        return;
+    }
+
+    uint32_t left_index = internal_node_child_index(parent, left_page_num);
+    *internal_node_num_keys(parent) = original_num_keys + 1;
+    if (left_index == original_num_keys) {
+        // 新子节点成为最右子节点，原最右子节点移入单元
+        void* right_child = get_page(pager, right_child_page_num);
+        uint32_t right_child_max_key = get_node_max_key(pager, right_child);
+        unpin_page(pager, right_child_page_num);
+        *internal_node_child(parent, original_num_keys) = right_child_page_num;
+        *internal_node_key(parent, original_num_keys) = right_child_max_key;
+        *internal_node_right_child(parent) = child_page_num;
+    }
+    else {
+        // 老节点之后的单元往后移动，腾出空间
+        uint32_t index = left_index + 1;
+        memmove(internal_node_cell(parent, index + 1), internal_node_cell(parent, index),
+                (original_num_keys - index) * INTERNAL_NODE_CELL_SIZE);
+        *internal_node_child(parent, index) = child_page_num;
+        *internal_node_key(parent, index) = child_max_key;
+    }
+    unpin_page(pager, parent_page_num);
+}
+
+// 内部节点满后，分裂为两个节点并插入子节点
+// 1. 把原有子节点和新子节点按键排好，左半部分留在老节点，右半部分移到新节点
+// 2. 移到新节点的子节点改为指向新节点
+// 3. 老节点是根节点时创建新的根节点，否则更新父节点中的键并把新节点插入父节点
+// table: 表
+// old_page_num: 满的内部节点所在页
+// left_page_num: 分裂的子节点所在页，新子节点排在它之后
+// child_page_num: 新子节点所在页
+void internal_node_split_and_insert(Table* table, uint32_t old_page_num, uint32_t left_page_num, uint32_t child_page_num)
+{
+    Pager* pager = table->pager;
+    stats_add(&table->internal_splits, 1);
+    void* old_node = get_page(pager, old_page_num);
+    uint32_t old_max = get_node_max_key(pager, old_node); // 即最右子节点的最大键
+    void* child = get_page(pager, child_page_num);
+    uint32_t child_max = get_node_max_key(pager, child);
+    unpin_page(pager, child_page_num);
+
+    // 1. 收集子节点和键，新子节点排在分裂的子节点之后，最后一个子节点的键不使用
+    uint32_t num_keys = *internal_node_num_keys(old_node);
+    uint32_t num_children = num_keys + 2;
+    uint32_t* children = malloc(num_children * sizeof(uint32_t));
+    uint32_t* keys = malloc(num_children * sizeof(uint32_t));
+    uint32_t left_index = internal_node_child_index(old_node, left_page_num);
+    uint32_t j = 0;
+    for (uint32_t i = 0; i <= num_keys; i++) {
+        children[j] = i < num_keys ? *internal_node_child(old_node, i) : *internal_node_right_child(old_node);
+        keys[j++] = i < num_keys ? *internal_node_key(old_node, i) : old_max;
+        if (i == left_index) {
+            children[j] = child_page_num;
+            keys[j++] = child_max;
+        }
+    }
+
+    // 2. 左边的数>=右边的数
+    //    在树的最右边追加时，老节点保持满，新节点只放新子节点
+    uint32_t right_count = num_children / 2;
+    if (children[num_children - 1] == child_page_num && node_is_rightmost(pager, child_page_num)) {
+        right_count = 1;
+    }
+    uint32_t left_count = num_children - right_count;
+
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void* new_node = get_page(pager, new_page_num);
+    pager_mark_dirty(pager, old_page_num);
+    pager_mark_dirty(pager, new_page_num);
+    initialize_internal_node(new_node);
+
+    *internal_node_num_keys(old_node) = left_count - 1;
+    for (uint32_t i = 0; i < left_count - 1; i++) {
+        *internal_node_child(old_node, i) = children[i];
+        *internal_node_key(old_node, i) = keys[i];
+    }
+    *internal_node_right_child(old_node) = children[left_count - 1];
+
+    *internal_node_num_keys(new_node) = right_count - 1;
+    for (uint32_t i = 0; i < right_count - 1; i++) {
+        *internal_node_child(new_node, i) = children[left_count + i];
+        *internal_node_key(new_node, i) = keys[left_count + i];
+    }
+    *internal_node_right_child(new_node) = children[num_children - 1];
+
+    // 3. 更新子节点的父指针，留在老节点的新子节点指向老节点
+    for (uint32_t i = 0; i < num_children; i++) {
+        if (i >= left_count) {
+            set_node_parent(pager, children[i], new_page_num);
+        }
+        else if (children[i] == child_page_num) {
+            set_node_parent(pager, children[i], old_page_num);
+        }
+    }
+
+    uint32_t new_max = keys[left_count - 1];
+    bool old_is_root = is_node_root(old_node);
+    uint32_t parent_page_num = *node_parent(old_node);
+    *node_parent(new_node) = parent_page_num;
+    free(children);
+    free(keys);
+    unpin_page(pager, old_page_num);
+    unpin_page(pager, new_page_num);
+
+    // 4. 向上更新父节点
+    if (old_is_root) {
+        create_new_root(table, new_page_num);
+    }
+    else {
+        void* parent = get_page(pager, parent_page_num);
+        pager_mark_dirty(pager, parent_page_num);
+        update_internal_node_key(parent, old_page_num, new_max);
+        unpin_page(pager, parent_page_num);
+        internal_node_insert(table, parent_page_num, old_page_num, new_page_num);
+    }
+}
+
+// 子节点分裂后，更新内部节点中该子节点的键
+// 子节点是最右子节点时没有键，不需要更新
+// node: 内部节点
+// child_page_num: 子节点所在页
+// new_key: 子节点现在的最大键
+void update_internal_node_key(void* node, uint32_t child_page_num, uint32_t new_key)
+{
+    uint32_t child_index = internal_node_child_index(node, child_page_num);
+    if (child_index < *internal_node_num_keys(node)) {
+        *internal_node_key(node, child_index) = new_key;
+    }
+}
+
+// 子节点在内部节点中的序号，最右子节点为键数
+// 按页号查找，索引树中相邻子节点的最大键可以相同，不能按键定位
+// node: 内部节点
+// child_page_num: 子节点所在页
+uint32_t internal_node_child_index(void* node, uint32_t child_page_num)
+{
+    uint32_t num_keys = *internal_node_num_keys(node);
+    for (uint32_t i = 0; i < num_keys; i++) {
+        if (*internal_node_child(node, i) == child_page_num) {
+            return i;
+        }
+    }
+    if (*internal_node_right_child(node) != child_page_num) {
+        printf("Page %d is not a child of the internal node\n", child_page_num);
+        exit(EXIT_FAILURE);
+    }
+    return num_keys;
+}
+
+// 从有序的行来源自底向上构建 B 树，只能导入空表
+// 每层只有最右边的节点处于装填中，节点装满后关闭并挂到上一层，
+// 顶层节点始终放在根节点所在页
+// table: 表
+// source: 行来源，键必须严格递增
+// context: 行来源的上下文
+// fill_factor: 节点装填百分比
+// num_rows: 返回导入的行数
+BulkLoadResult table_bulk_load(Table* table, RowSource source, void* context, uint32_t fill_factor, uint32_t* num_rows)
+{
+    Pager* pager = table->pager;
+    *num_rows = 0;
+
+    // 1. 检查是否为空表
+    void* root = get_page(pager, table->root_page_num);
+    bool empty = get_node_type(root) == NODE_LEAF && *leaf_node_num_cells(root) == 0;
+    if (!empty) {
+        unpin_page(pager, table->root_page_num);
+        return BULK_LOAD_TABLE_NOT_EMPTY;
+    }
+
+    // 保存空的根节点和索引根节点作为旧版本，快照读者看到空表，之后修改的页不再逐页保存
+    pager_mark_dirty(pager, table->root_page_num);
+    for (uint32_t i = 0; i < INDEX_COUNT; i++) {
+        if (table->indexes[i] != NULL) {
+            uint32_t index_root_page_num = table->indexes[i]->root_page_num;
+            get_page(pager, index_root_page_num);
+            pager_mark_dirty(pager, index_root_page_num);
+            unpin_page(pager, index_root_page_num);
+        }
+    }
+    pager->exclusive_write = true;
+    unpin_page(pager, table->root_page_num);
+
+    // 2. 初始化装填状态，空的根叶子节点作为第一个叶子节点
+    BulkLoader loader;
+    loader.table = table;
+    loader.fill_bytes = LEAF_NODE_SPACE_FOR_CELLS * fill_factor / 100;
+    loader.fill_children = (INTERNAL_NODE_MAX_CELLS + 1) * fill_factor / 100;
+    if (loader.fill_children < 2) {
+        loader.fill_children = 2;
+    }
+    loader.num_levels = 1;
+    loader.open_page[0] = table->root_page_num;
+    uint32_t original_num_pages = pager->num_pages;
+
+    // 3. 逐行追加到最右边的叶子节点
+    BulkLoadResult result = BULK_LOAD_SUCCESS;
+    Row row;
+    RowSourceResult source_result;
+    while ((source_result = source(context, &row)) == ROW_SOURCE_ROW) {
+        if (*num_rows > 0 && row.id <= loader.last_key) {
+            result = BULK_LOAD_UNSORTED;
+            break;
+        }
+
+        char value[sizeof(Row)];
+        uint32_t length = serialize_row(&row, value);
+
+        uint32_t leaf_page_num = loader.open_page[0];
+        void* leaf = get_page(pager, leaf_page_num);
+        uint32_t num_cells = *leaf_node_num_cells(leaf);
+        uint32_t used_bytes = LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(leaf);
+        unpin_page(pager, leaf_page_num);
+
+        // 叶子节点装满，关闭后开启新的叶子节点，每个叶子节点至少一个单元
+        if (num_cells > 0 && used_bytes + length + LEAF_NODE_SLOT_SIZE > loader.fill_bytes) {
+            uint32_t closed_page_num = bulk_load_close_node(&loader, 0);
+            leaf_page_num = get_unused_page_num(pager);
+            leaf = get_page(pager, leaf_page_num);
+            pager_mark_dirty(pager, leaf_page_num);
+            initialize_leaf_node(leaf);
+            unpin_page(pager, leaf_page_num);
+            loader.open_page[0] = leaf_page_num;
+
+            void* closed = get_page(pager, closed_page_num);
+            pager_mark_dirty(pager, closed_page_num);
+            *leaf_node_next_leaf(closed) = leaf_page_num;
+            unpin_page(pager, closed_page_num);
+            num_cells = 0;
+        }
+
+        leaf = get_page(pager, leaf_page_num);
+        pager_mark_dirty(pager, leaf_page_num);
+        leaf_node_insert_cell(leaf, num_cells, row.id, value, length);
+        unpin_page(pager, leaf_page_num);
+
+        loader.last_key = row.id;
+        *num_rows += 1;
+    }
+    if (source_result == ROW_SOURCE_ERROR) {
+        result = BULK_LOAD_SOURCE_ERROR;
+    }
+
+    // 4. 失败时恢复为空表
+    if (result != BULK_LOAD_SUCCESS) {
+        pager_truncate(pager, original_num_pages);
+        root = get_page(pager, table->root_page_num);
+        pager_mark_dirty(pager, table->root_page_num);
+        initialize_leaf_node(root);
+        set_node_root(root, true);
+        unpin_page(pager, table->root_page_num);
+        *num_rows = 0;
+        return result;
+    }
+
+    // 5. 自底向上关闭各层最右边的节点，顶层节点即根节点
+    for (uint32_t level = 0; level + 1 < loader.num_levels; level++) {
+        bulk_load_close_node(&loader, level);
+    }
+
+    // 6. 按导入的行建立二级索引
+    table_build_indexes(table);
+    return BULK_LOAD_SUCCESS;
 }
 
-// 是否是根节点
-// node: 节点
-bool is_node_root(void* node)
+// 关闭某层正在装填的节点，挂到上一层的节点上
+// 关闭的是顶层节点时，先把它从根节点所在页移到新页，根节点所在页成为新的顶层节点
+// 上一层节点已满时，先关闭它再开启新节点
+// loader: 装填状态
+// level: 层，0 为叶子
+// 返回关闭的节点所在页
+uint32_t bulk_load_close_node(BulkLoader* loader, uint32_t level)
 {
-    uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
-    return (bool)value;
+    Pager* pager = loader->table->pager;
+    uint32_t page_num = loader->open_page[level];
+    void* node = get_page(pager, page_num);
+    // 按键有序追加，叶子的最大键即上一行的键，内部节点的最大键在追加子节点时记下，不需要沿最右路径查找
+    uint32_t max_key = level == 0 ? loader->last_key : loader->open_max_key[level];
+
+    if (level + 1 == loader->num_levels) {
+        // 1. 顶层节点移出根节点所在页，它的子节点改为指向新页
+        uint32_t new_page_num = get_unused_page_num(pager);
+        void* new_node = get_page(pager, new_page_num);
+        pager_mark_dirty(pager, new_page_num);
+        pager_mark_dirty(pager, page_num);
+        memcpy(new_node, node, PAGE_SIZE);
+        set_node_root(new_node, false);
+        if (get_node_type(new_node) == NODE_INTERNAL) {
+            for (uint32_t i = 0; i <= *internal_node_num_keys(new_node); i++) {
+                set_node_parent(pager, *internal_node_child(new_node, i), new_page_num);
+            }
+        }
+        unpin_page(pager, new_page_num);
+
+        // 2. 根节点所在页成为新的顶层节点
+        initialize_internal_node(node);
+        set_node_root(node, true);
+        unpin_page(pager, page_num);
+        loader->open_page[level + 1] = page_num;
+        loader->num_levels += 1;
+        page_num = new_page_num;
+    }
+    else {
+        unpin_page(pager, page_num);
+
+        // 上一层节点已满，关闭它并开启新的内部节点
+        uint32_t parent_page_num = loader->open_page[level + 1];
+        void* parent = get_page(pager, parent_page_num);
+        uint32_t num_children = *internal_node_num_keys(parent) + 1;
+        unpin_page(pager, parent_page_num);
+        if (num_children >= loader->fill_children) {
+            bulk_load_close_node(loader, level + 1);
+            parent_page_num = get_unused_page_num(pager);
+            parent = get_page(pager, parent_page_num);
+            pager_mark_dirty(pager, parent_page_num);
+            initialize_internal_node(parent);
+            unpin_page(pager, parent_page_num);
+            loader->open_page[level + 1] = parent_page_num;
+        }
+    }
+
+    // 3. 挂到上一层节点
+    bulk_load_append_child(loader, level + 1, page_num, max_key);
+    return page_num;
 }
 
-// 设置是否是根节点
-// node: 节点
-// is_root: 是否是根节点
-void set_node_root(void* node, bool is_root)
+// 在某层正在装填的内部节点最右边追加子节点
+// loader: 装填状态
+// level: 内部节点所在层
+// child_page_num: 子节点所在页
+// child_max_key: 子节点的最大键
+void bulk_load_append_child(BulkLoader* loader, uint32_t level, uint32_t child_page_num, uint32_t child_max_key)
 {
-    uint8_t value = is_root;
-    *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
+    Pager* pager = loader->table->pager;
+    uint32_t parent_page_num = loader->open_page[level];
+    void* parent = get_page(pager, parent_page_num);
+    pager_mark_dirty(pager, parent_page_num);
+    uint32_t right_child_page_num = *internal_node_right_child(parent);
+    if (right_child_page_num != INVALID_PAGE_NUM) {
+        // 原最右子节点移入单元，它的最大键是上次追加时记下的
+        uint32_t num_keys = *internal_node_num_keys(parent);
+        *internal_node_num_keys(parent) = num_keys + 1;
+        *internal_node_child(parent, num_keys) = right_child_page_num;
+        *internal_node_key(parent, num_keys) = loader->open_max_key[level];
+    }
+    *internal_node_right_child(parent) = child_page_num;
+    loader->open_max_key[level] = child_max_key;
+    unpin_page(pager, parent_page_num);
+    set_node_parent(pager, child_page_num, parent_page_num);
 }
 
-// 获取页类型
-// node: 节点
-NodeType get_node_type(void* node)
+// 从文件中逐行读取数据，格式与 insert 语句相同，insert 关键字可省略
+// context: 导入文件的状态
+// row: 读出的行
+RowSourceResult file_row_source(void* context, Row* row)
 {
-    uint8_t value =  *((uint8_t *)(node + NODE_TYPE_OFFSET));
-    return (NodeType)value;
+    ImportFile* import = context;
+    ssize_t bytes_read;
+    while ((bytes_read = getline(&import->line, &import->line_length, import->file)) > 0) {
+        import->line_num += 1;
+        if (import->line[bytes_read - 1] == '\n') {
+            import->line[bytes_read - 1] = 0;
+        }
+
+        char* first = strtok(import->line, " ");
+        if (first == NULL) {
+            continue; // 空行
+        }
+        char* id_string = strcmp(first, "insert") == 0 ? strtok(NULL, " ") : first;
+        char* username = strtok(NULL, " ");
+        char* email = strtok(NULL, " ");
+        if (parse_row(id_string, username, email, row) != PREPARE_SUCCESS) {
+            return ROW_SOURCE_ERROR;
+        }
+        return ROW_SOURCE_ROW;
+    }
+    return ROW_SOURCE_END;
 }
 
-// 设置页类型
-// node: 节点
-// type: 类型
-void set_node_type(void* node, NodeType type)
+// 导入文件
+// table: 表
+// filename: 文件名
+// fill_factor: 节点装填百分比
+void import_file(Table* table, char* filename, uint32_t fill_factor)
 {
-    uint8_t value = type;
-    *((uint8_t *)(node + NODE_TYPE_OFFSET)) = value;
+    ImportFile import;
+    import.file = fopen(filename, "r");
+    if (import.file == NULL) {
+        printf("Unable to open file '%s'\n", filename);
+        return;
+    }
+    import.line = NULL;
+    import.line_length = 0;
+    import.line_num = 0;
+
+    uint32_t num_rows;
+    pager_begin_write(table->pager);
+    switch (table_bulk_load(table, file_row_source, &import, fill_factor, &num_rows)) {
+        case (BULK_LOAD_SUCCESS):
+            printf("Imported %d rows.\n", num_rows);
+            break;
+        case (BULK_LOAD_TABLE_NOT_EMPTY):
+            printf("Error: Table is not empty.\n");
+            break;
+        case (BULK_LOAD_UNSORTED):
+            printf("Error: Rows must be sorted by id without duplicates (line %d).\n", import.line_num);
+            break;
+        case (BULK_LOAD_SOURCE_ERROR):
+            printf("Error: Could not parse line %d.\n", import.line_num);
+            break;
+    }
+
+    // 导入失败时已回到空表，两种情况都提交
+    pager_commit(table->pager);
+
+    free(import.line);
+    fclose(import.file);
 }
 
-// 获取下一个兄弟页节点
+// 获取节点最大键值
+// 内部节点：最右子树的最大键
+// 叶子节点：最后一个键
+// pager: 分页器
 // node: 节点
-uint32_t* leaf_node_next_leaf(void* node)
+uint32_t get_node_max_key(Pager* pager, void* node)
 {
-    return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+    // 因为是排好序的，所以最后一个即最大的键值
+    if (get_node_type(node) == NODE_LEAF) {
+        return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+    }
+
+    // 沿最右子节点向下，同一时间只固定一页
+    uint32_t page_num = *internal_node_right_child(node);
+    while (true) {
+        void* child = get_page(pager, page_num);
+        if (get_node_type(child) == NODE_LEAF) {
+            uint32_t max_key = *leaf_node_key(child, *leaf_node_num_cells(child) - 1);
+            unpin_page(pager, page_num);
+            return max_key;
+        }
+        uint32_t right_child_page_num = *internal_node_right_child(child);
+        unpin_page(pager, page_num);
+        page_num = right_child_page_num;
+    }
 }
 
-// 内部节点键的数量
+// 内部节点键
 // node: 节点
-uint32_t* internal_node_num_keys(void* node)
+// key_num: 第几个key
+uint32_t* internal_node_key(void* node, uint32_t key_num)
 {
-    return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+    return (void*)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
 }
 
-// 内部节点右节点
-// node: 节点
-uint32_t* internal_node_right_child(void* node)
+// 获取未使用的页数
+uint32_t get_unused_page_num(Pager* pager)
 {
-    return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+    return pager->num_pages;
 }
 
-// 内部节点单元
-// node: 节点
-// cell_num: 第几个cell
-uint32_t* internal_node_cell(void* node, uint32_t cell_num)
+// 输出语句解析失败的原因
+// stream: 输出目标
+// result: 解析结果
+// input: 输入的语句
+void print_prepare_result(FILE* stream, PrepareResult result, char* input)
 {
-    return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+    switch (result) {
+        case (PREPARE_SUCCESS):
+            break;
+        case (PREPARE_SYNTAX_ERROR):
+            fprintf(stream, "Syntax error. Could not parse statement.\n");
+            break;
+        case (PREPARE_NEGATIVE_ID):
+            fprintf(stream, "ID must be positive\n");
+            break;
+        case (PREPARE_STRING_TOO_LONG):
+            fprintf(stream, "String is too long\n");
+            break;
+        case (PREPARE_UNRECOGNIZED_STATEMENT):
+            fprintf(stream, "Unrecognized keyword at start of '%s'.\n", input);
+            break;
+        case (PREPARE_BIND_ERROR):
+            fprintf(stream, "Parameters do not match statement.\n");
+            break;
+    }
 }
 
-// 内部节点子节点
-// node: 节点
-// child_num: 子节点序号
-uint32_t* internal_node_child(void* node, uint32_t child_num)
+// 输出语句的执行结果
+// stream: 输出目标
+// result: 执行结果
+void print_execute_result(FILE* stream, ExecuteResult result)
 {
-    uint32_t num_keys = *internal_node_num_keys(node);
-    if (child_num > num_keys) {
-        printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
-        exit(EXIT_FAILURE);
-    } else if (child_num == num_keys) {
-        return internal_node_right_child(node);
-    } else {
-        return internal_node_cell(node, child_num);
+    switch (result) {
+        case (EXECUTE_SUCCESS):
+            fprintf(stream, "Executed.\n");
+            break;
+        case (EXECUTE_ERROR):
+            fprintf(stream, "Error: Table full.\n");
+            break;
+        case (EXECUTE_DUPLICATE_KEY):
+            fprintf(stream, "Error: Duplicate key.\n");
+            break;
+        case (EXECUTE_NESTED_TRANSACTION):
+            fprintf(stream, "Error: Transaction already started.\n");
+            break;
+        case (EXECUTE_NO_TRANSACTION):
+            fprintf(stream, "Error: No transaction is active.\n");
+            break;
     }
 }
 
-// 叶节点插入
-// cursor: 游标
-// key: 键
-// value: 数据
-void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
-    // 1. 获取页
-    void* node = get_page(cursor->table->pager, cursor->page_num);
-    // 2. 判断是否满，满了则拆分页并插入
-    uint32_t num_cells = *leaf_node_num_cells(node);
-    printf("leaf_node_insert cursor page_num: %d, cell_num: %d num_cells:%d key:%d\n", cursor->page_num, cursor->cell_num, num_cells, key);
-    if (num_cells >= LEAF_NODE_MAX_CELLS) {
-        leaf_node_split_and_insert(cursor, key, value);
-        return;
+// 打开服务器，开始监听并启动工作线程
+// 地址全为数字时监听 127.0.0.1 的该端口，否则作为 Unix 域套接字的路径
+// table: 表
+// address: 端口或路径
+// num_workers: 工作线程数
+Server* server_open(Table* table, char* address, uint32_t num_workers)
+{
+    Server* server = malloc(sizeof(Server));
+    server->table = table;
+    server->socket_path = NULL;
+    server->queue_head = 0;
+    server->queue_length = 0;
+    server->stopping = false;
+    pthread_mutex_init(&server->mutex, NULL);
+    pthread_cond_init(&server->not_empty, NULL);
+    pthread_cond_init(&server->not_full, NULL);
+
+    // 1. 创建监听套接字
+    if (strspn(address, "0123456789") == strlen(address)) {
+        server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        int reuse = 1;
+        setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(atoi(address));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(server->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+            printf("Unable to bind port %s: %d\n", address, errno);
+            exit(EXIT_FAILURE);
+        }
     }
-    // 3. 如果是中间插入，数据往后移动，腾出空间
-    if (cursor->cell_num < num_cells) {
-        for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
-            memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i-1), LEAF_NODE_CELL_SIZE);
+    else {
+        struct sockaddr_un addr;
+        if (strlen(address) >= sizeof(addr.sun_path)) {
+            printf("Socket path is too long\n");
+            exit(EXIT_FAILURE);
         }
+        server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, address);
+        unlink(address); // 上次未正常退出时留下的套接字文件
+        if (bind(server->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+            printf("Unable to bind socket %s: %d\n", address, errno);
+            exit(EXIT_FAILURE);
+        }
+        server->socket_path = strdup(address);
+    }
+    if (listen(server->listen_fd, SERVER_BACKLOG) == -1 || pipe(server->wakeup) == -1) {
+        printf("Unable to listen: %d\n", errno);
+        exit(EXIT_FAILURE);
     }
 
-    // 4. 插入数据
-    // a. 数量加1
-    // b. 插入键
-    // c. 插入值
-    *(leaf_node_num_cells(node)) += 1;
-    *(leaf_node_key(node, cursor->cell_num)) = key;
-    serialize_row(value, leaf_node_value(node, cursor->cell_num));
+    // 2. 启动工作线程
+    server->num_workers = num_workers;
+    server->workers = malloc(sizeof(ServerWorker) * num_workers);
+    for (uint32_t i = 0; i < num_workers; i++) {
+        server->workers[i].server = server;
+        server->workers[i].connection = -1;
+        server->workers[i].statements = statement_cache_open();
+        server->workers[i].in_transaction = false;
+        if (pthread_create(&server->workers[i].thread, NULL, server_worker_main, &server->workers[i]) != 0) {
+            printf("Unable to start server worker\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return server;
 }
 
-// 节点满后，平分为两个节点
-// cursor: 游标
-// key: 键
-// value: 数据
-void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value)
+// 接受连接并交给工作线程，直到服务器停止
+// server: 服务器
+void server_run(Server* server)
 {
-    // 1.根据游标获取老节点
-    // 2.创建新节点
-    void* old_node = get_page(cursor->table->pager, cursor->page_num);
-    uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-    void* new_node = get_page(cursor->table->pager, new_page_num);
-    initialize_leaf_node(new_node);
-    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
-    *leaf_node_next_leaf(old_node) = new_page_num;
+    struct pollfd fds[2];
+    fds[0].fd = server->listen_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = server->wakeup[0];
+    fds[1].events = POLLIN;
 
-    // 把将要插入的数据算入，共循环N+1
-    // N = 6
-    // LEAF = (N + 1) - RIGHT = 4
-    // RIGHT = (N + 1) / 2 =  3
-    // |  left  |  right |
-    //  0,1,2,3,  4,5,6
-    //
-    // 注意 这里一定是 int 型而不是 uint型
-    for(int32_t i = LEAF_NODE_MAX_CELLS; i >=0; i--) {
-        void* destination_node;
-        if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
-            destination_node = new_node;
+    while (true) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("Error polling socket: %d\n", errno);
+            exit(EXIT_FAILURE);
         }
-        else {
-            destination_node = old_node;
+        if (fds[1].revents != 0) {
+            return;
+        }
+        int connection = accept(server->listen_fd, NULL, NULL);
+        if (connection == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            printf("Error accepting connection: %d\n", errno);
+            exit(EXIT_FAILURE);
         }
-        uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT; // 左边 >= 右边
-        void* destination = leaf_node_cell(destination_node, index_within_node);
 
-        if (i == cursor->cell_num) {
-            serialize_row(value, leaf_node_value(destination_node, index_within_node));
-            *leaf_node_key(destination_node, index_within_node) = key;
+        // 队列满时等待工作线程取走连接
+        pthread_mutex_lock(&server->mutex);
+        while (server->queue_length == SERVER_QUEUE_SIZE && !server->stopping) {
+            pthread_cond_wait(&server->not_full, &server->mutex);
         }
-        else if (i > cursor->cell_num) {
-            memcpy(destination, leaf_node_cell(old_node, i-1), LEAF_NODE_CELL_SIZE);
+        if (server->stopping) {
+            pthread_mutex_unlock(&server->mutex);
+            close(connection);
+            return;
         }
-        else {
-            memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+        server->queue[(server->queue_head + server->queue_length) % SERVER_QUEUE_SIZE] = connection;
+        server->queue_length += 1;
+        pthread_cond_signal(&server->not_empty);
+        pthread_mutex_unlock(&server->mutex);
+    }
+}
+
+// 停止服务器，可以在任意线程调用
+// 不再接受连接；正在服务的连接处理完当前请求后断开
+// server: 服务器
+void server_stop(Server* server)
+{
+    pthread_mutex_lock(&server->mutex);
+    server->stopping = true;
+    for (uint32_t i = 0; i < server->num_workers; i++) {
+        if (server->workers[i].connection != -1) {
+            shutdown(server->workers[i].connection, SHUT_RD);
         }
     }
+    pthread_cond_broadcast(&server->not_empty);
+    pthread_cond_broadcast(&server->not_full);
+    pthread_mutex_unlock(&server->mutex);
 
-    // 更新节点单元数
-    *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-    *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+    char byte = 0;
+    write(server->wakeup[1], &byte, 1);
+}
 
-    if (is_node_root(old_node)) {
-        return create_new_root(cursor->table, new_page_num);
+// 等待工作线程退出，关闭服务器，表由调用者关闭
+// server: 服务器
+void server_close(Server* server)
+{
+    // 1. 等待工作线程
+    server_stop(server);
+    for (uint32_t i = 0; i < server->num_workers; i++) {
+        pthread_join(server->workers[i].thread, NULL);
+        statement_cache_close(server->workers[i].statements);
     }
-    else {
-        printf("Need to implemnet updating parent after split\n");
-        exit(EXIT_FAILURE);
+
+    // 2. 关闭还在队列中的连接
+    while (server->queue_length > 0) {
+        close(server->queue[server->queue_head]);
+        server->queue_head = (server->queue_head + 1) % SERVER_QUEUE_SIZE;
+        server->queue_length -= 1;
     }
-}
 
+    // 3. 关闭套接字，释放内存
+    close(server->listen_fd);
+    close(server->wakeup[0]);
+    close(server->wakeup[1]);
+    if (server->socket_path != NULL) {
+        unlink(server->socket_path);
+        free(server->socket_path);
+    }
+    pthread_mutex_destroy(&server->mutex);
+    pthread_cond_destroy(&server->not_empty);
+    pthread_cond_destroy(&server->not_full);
+    free(server->workers);
+    free(server);
+}
 
-// 处理分离根节点，左为根节点，右为新节点
-// 拷贝老的根节点到新的左节点
-// 初始化根节点为新的根节点
-// 新的根节点指向两个子节点
-// table: 表
-// right_child_page_num: 右节点num
-void create_new_root(Table* table, uint32_t right_child_page_num)
+// 工作线程，每次从队列取一个连接，服务到连接断开
+// arg: 工作线程
+void* server_worker_main(void* arg)
 {
-    // 获取根节点，创建左节点
-    void* root = get_page(table->pager, table->root_page_num);
-    void* right_child = get_page(table->pager, right_child_page_num);
-    uint32_t left_child_page_num = get_unused_page_num(table->pager);
-    void* left_child = get_page(table->pager, left_child_page_num);
+    ServerWorker* worker = arg;
+    Server* server = worker->server;
+    while (true) {
+        pthread_mutex_lock(&server->mutex);
+        while (server->queue_length == 0 && !server->stopping) {
+            pthread_cond_wait(&server->not_empty, &server->mutex);
+        }
+        if (server->stopping) {
+            pthread_mutex_unlock(&server->mutex);
+            return NULL;
+        }
+        int connection = server->queue[server->queue_head];
+        server->queue_head = (server->queue_head + 1) % SERVER_QUEUE_SIZE;
+        server->queue_length -= 1;
+        worker->connection = connection;
+        pthread_cond_signal(&server->not_full);
+        pthread_mutex_unlock(&server->mutex);
 
-    // 拷贝根节点数据到左节点
-    memcpy(left_child, root, PAGE_SIZE);
-    set_node_root(left_child, false);
+        server_serve_connection(worker, connection);
 
-    // 根节点包含一个键和两个子节点
-    initialize_internal_node(root);
-    set_node_root(root, true);
-    *internal_node_num_keys(root) = 1;  // 内部节点的键数为1
-    *internal_node_child(root, 0) = left_child_page_num;  // 左节点存入内部节点体的第一个位置
-    uint32_t left_child_max_key = get_node_max_key(left_child);  // 左节点最大键存入内部节点体的第一个位置
-    *internal_node_key(root, 0) = left_child_max_key;
-    *internal_node_right_child(root) = right_child_page_num;  // 内部节点头部保存最右边的子节点
+        // 先清除再关闭，server_stop 不会 shutdown 已被复用的描述符
+        pthread_mutex_lock(&server->mutex);
+        worker->connection = -1;
+        pthread_mutex_unlock(&server->mutex);
+        close(connection);
+    }
 }
 
-// 获取节点最大键值
-// 内部节点：
-// 叶子节点：
-// node: 节点
-uint32_t get_node_max_key(void* node)
+// 处理一个连接上的请求
+// 请求：4 字节长度（网络字节序）+ 语句，语法与命令行相同；
+//       语句中有 ? 时，其后是一个 0 字节和按顺序排列的参数，见 server_bind_params
+// 响应：4 字节状态 + 4 字节长度（网络字节序）+ 与命令行相同的输出
+// worker: 工作线程
+// connection: 连接
+void server_serve_connection(ServerWorker* worker, int connection)
 {
-    // 因为是排好序的，所以最后一个即最大的键值
-    switch (get_node_type(node))
-    {
-        case NODE_INTERNAL:
-            return *internal_node_key(node, *internal_node_num_keys(node) - 1);
+    char* request = malloc(SERVER_MAX_REQUEST + 1);
+    while (true) {
+        // 1. 读取请求，连接断开或请求过长时结束
+        uint32_t length;
+        if (!server_read_full(connection, &length, sizeof(length))) {
             break;
-        case NODE_LEAF:
-            return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+        }
+        length = ntohl(length);
+        if (length > SERVER_MAX_REQUEST || !server_read_full(connection, request, length)) {
             break;
-        default:
+        }
+        request[length] = 0;
+
+        // 2. 执行，输出写入内存
+        char* response;
+        size_t response_length;
+        FILE* stream = open_memstream(&response, &response_length);
+        ServerStatus status = server_execute(worker, request, length, stream);
+        fclose(stream);
+
+        // 3. 写回响应
+        uint32_t header[2];
+        header[0] = htonl(status);
+        header[1] = htonl(response_length);
+        bool sent = server_write_full(connection, header, sizeof(header)) &&
+                    server_write_full(connection, response, response_length);
+        free(response);
+        if (!sent) {
             break;
+        }
+    }
+    free(request);
+
+    // 连接断开时未提交的事务回滚
+    if (worker->in_transaction) {
+        table_rollback(worker->server->table);
+        worker->in_transaction = false;
     }
 }
 
-// 内部节点键
-// node: 节点
-// key_num: 第几个key
-uint32_t* internal_node_key(void* node, uint32_t key_num)
+// 执行一个请求，结果写入 stream
+// 语句文本经过工作线程的语句缓存，相同文本只解析一次
+// worker: 工作线程
+// request: 请求，以 0 结尾
+// length: 请求长度，不含结尾的 0
+// stream: 输出目标
+ServerStatus server_execute(ServerWorker* worker, char* request, uint32_t length, FILE* stream)
 {
-    return internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+    // 1. 元命令只在命令行中可用
+    if (request[0] == '.') {
+        fprintf(stream, "Unrecognized command '%s'.\n", request);
+        return SERVER_ERROR;
+    }
+
+    // 2. 准备并绑定参数
+    Statement statement;
+    PrepareResult prepare_result = statement_cache_prepare(worker->statements, request, &statement);
+    if (prepare_result == PREPARE_SUCCESS) {
+        uint32_t sql_length = strlen(request);
+        uint32_t params_length = sql_length < length ? length - sql_length - 1 : 0;
+        prepare_result = server_bind_params(&statement, (uint8_t*)request + sql_length + 1, params_length);
+        if (prepare_result != PREPARE_SUCCESS) {
+            statement_free(&statement);
+        }
+    }
+    if (prepare_result != PREPARE_SUCCESS) {
+        print_prepare_result(stream, prepare_result, request);
+        return SERVER_ERROR;
+    }
+
+    // 3. 执行
+    ExecuteResult result = statement_step(&statement, worker->server->table, &worker->in_transaction, stream);
+    statement_free(&statement);
+    print_execute_result(stream, result);
+    return result == EXECUTE_SUCCESS ? SERVER_OK : SERVER_ERROR;
 }
 
-// 获取未使用的页数
-uint32_t get_unused_page_num(Pager* pager)
+// 按顺序绑定请求中的参数，个数必须与 ? 相同
+// 整数：'i' + 4 字节（网络字节序）；文本：'s' + 2 字节长度（网络字节序）+ 内容
+// statement: 语句
+// params: 参数
+// length: 参数的总长度
+PrepareResult server_bind_params(Statement* statement, uint8_t* params, uint32_t length)
 {
-    return pager->num_pages;
+    uint8_t* end = params + length;
+    uint32_t index = 0;
+    while (params < end) {
+        index += 1;
+        PrepareResult result;
+        if (*params == 'i' && end - params >= 5) {
+            uint32_t value;
+            memcpy(&value, params + 1, sizeof(value));
+            result = statement_bind_int(statement, index, ntohl(value));
+            params += 5;
+        }
+        else if (*params == 's' && end - params >= 3) {
+            uint16_t value_length;
+            memcpy(&value_length, params + 1, sizeof(value_length));
+            value_length = ntohs(value_length);
+            if (end - params - 3 < value_length) {
+                return PREPARE_BIND_ERROR;
+            }
+            result = statement_bind_text(statement, index, (char*)params + 3, value_length);
+            params += 3 + value_length;
+        }
+        else {
+            return PREPARE_BIND_ERROR;
+        }
+        if (result != PREPARE_SUCCESS) {
+            return result;
+        }
+    }
+    return index == statement->num_params ? PREPARE_SUCCESS : PREPARE_BIND_ERROR;
+}
+
+// 读满 length 字节，连接断开时返回 false
+// fd: 描述符
+// buffer: 缓存
+// length: 字节数
+bool server_read_full(int fd, void* buffer, size_t length)
+{
+    while (length > 0) {
+        ssize_t bytes_read = read(fd, buffer, length);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            return false;
+        }
+        buffer += bytes_read;
+        length -= bytes_read;
+    }
+    return true;
+}
+
+// 写出 length 字节，连接断开时返回 false
+// fd: 描述符
+// buffer: 缓存
+// length: 字节数
+bool server_write_full(int fd, void* buffer, size_t length)
+{
+    while (length > 0) {
+        ssize_t bytes_written = send(fd, buffer, length, MSG_NOSIGNAL);
+        if (bytes_written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_written <= 0) {
+            return false;
+        }
+        buffer += bytes_written;
+        length -= bytes_written;
+    }
+    return true;
 }
 
+// 等待 SIGINT 或 SIGTERM 后停止服务器
+// 信号在所有线程中屏蔽，只由该线程同步接收
+// arg: 服务器
+void* server_signal_main(void* arg)
+{
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    int signal_num;
+    sigwait(&signals, &signal_num);
+    server_stop(arg);
+    return NULL;
+}
+
+// 编译为库时（如 bench.c）定义 SQLIT_NO_MAIN，由调用者提供 main
+#ifndef SQLIT_NO_MAIN
 int main(int argc, char* argv[])
 {
-    Table* table = db_open("sqlite.db");
+    PagerOptions options;
+    options.max_frames = PAGER_DEFAULT_MAX_FRAMES;
+    options.use_mmap = false;
+    options.compress = false;
+    char* server_address = NULL;
+    uint32_t num_workers = SERVER_DEFAULT_WORKERS;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            options.max_frames = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--mmap") == 0) {
+            options.use_mmap = true;
+        }
+        else if (strcmp(argv[i], "--compress") == 0) {
+            options.compress = true;
+        }
+        else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            server_address = argv[++i];
+        }
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            num_workers = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--log") == 0 && i + 1 < argc && log_parse_level(argv[i + 1], &log_level)) {
+            i += 1;
+        }
+        else {
+            printf("Usage: %s [--frames N] [--mmap] [--compress] [--server PATH|PORT] [--workers N] [--log LEVEL]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // 服务器模式：打开数据库之前屏蔽信号，之后创建的线程都继承，由信号线程统一接收
+    if (server_address != NULL) {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+        Table* table = db_open("sqlite.db", &options);
+        Server* server = server_open(table, server_address, num_workers);
+        pthread_t signal_thread;
+        pthread_create(&signal_thread, NULL, server_signal_main, server);
+        printf("Listening on %s with %d workers.\n", server_address, num_workers);
+        fflush(stdout);
+
+        // 只有信号线程会停止服务器，等它退出后再释放
+        server_run(server);
+        pthread_join(signal_thread, NULL);
+        server_close(server);
+        db_close(table);
+        exit(EXIT_SUCCESS);
+    }
+
+    Table* table = db_open("sqlite.db", &options);
 
     InputBuffer* input_buffer = new_input_buffer();
+    bool in_transaction = false;
 
     while (true) {
         print_prompt();
         read_input(input_buffer);
 
         if (input_buffer->buffer[0] == '.') {
-            switch(do_meta_command(input_buffer, table)) {
+            switch(do_meta_command(input_buffer, table, in_transaction)) {
                 case (META_COMMAND_SUCCESS):
                     continue;
                 case (META_COMMAND_UNRECOGNIZED_COMMAND):
@@ -1004,35 +5301,18 @@ int main(int argc, char* argv[])
         }
 
         Statement statement;
-        switch (prepare_statement(input_buffer, &statement)) {
-            case (PREPARE_SUCCESS):
-                break;
-            case (PREPARE_SYNTAX_ERROR):
-                printf("Syntax error. Could not parse statement.\n");
-                continue;
-            case (PREPARE_NEGATIVE_ID):
-                printf("ID must be positive\n");
-                continue;
-            case (PREPARE_STRING_TOO_LONG):
-                printf("String is too long\n");
-                continue;
-            case (PREPARE_UNRECOGNIZED_STATEMENT):
-                printf("Unrecognized keyword at start of '%s'.\n", input_buffer->buffer);
-                continue;
-            default:
-                break;
+        PrepareResult prepare_result = prepare_statement(input_buffer, &statement);
+        if (prepare_result == PREPARE_SUCCESS && statement.num_params > 0) {
+            prepare_result = PREPARE_BIND_ERROR; // 命令行不能绑定参数
+            statement_free(&statement);
         }
-
-        switch (execute_statement(&statement, table)) {
-            case (EXECUTE_SUCCESS):
-                printf("Executed.\n");
-                break;
-            case (EXECUTE_ERROR):
-                printf("Error: Table full.\n");
-                break;
-            case (EXECUTE_DUPLICATE_KEY):
-                printf("Error: Duplicate key.\n");
-                break;
+        if (prepare_result != PREPARE_SUCCESS) {
+            print_prepare_result(stdout, prepare_result, input_buffer->buffer);
+            continue;
         }
+
+        print_execute_result(stdout, execute_statement(&statement, table, &in_transaction));
+        statement_free(&statement);
     }
 }
+#endif
@@ -1,10 +1,27 @@
+#define _GNU_SOURCE  // pthread_rwlockattr_setkind_np
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
@@ -12,7 +29,67 @@
 #define size_of_attribute(Struct, Attribute) sizeof( ((Struct*)0)->Attribute )
 
 #define PAGE_SIZE 4096
-#define TABLE_MAX_PAGES 100
+#define PAGER_DEFAULT_MAX_FRAMES 100   // 缓冲池默认帧数
+#define PAGER_MIN_FRAMES 16            // 缓冲池最少帧数，需容纳一次插入中同时固定的页和读者固定的页
+#define INVALID_FRAME_NUM (-1)
+#define INVALID_PAGE_NUM UINT32_MAX      // 内部节点中表示没有子节点
+#define SNAPSHOT_LATEST UINT64_MAX       // 读取当前页，只有持有写锁的线程可以使用
+#define PAGER_MAX_WRITE_RUN 64        // 一次 pwritev 最多合并的页数
+#define FRAME_SLAB_HUGE_PAGE_SIZE (2 << 20)  // 帧内存块不小于该大小时按大页对齐，可由透明大页支持
+
+#define DB_MAGIC 0x54494c53             // 数据库文件头魔数 "SLIT"
+#define DB_FORMAT_VERSION 2              // 2: 索引键为列值的哈希，允许重复；1: 索引线性探测；之前定长行格式的文件没有文件头
+#define DB_HEADER_PAGE_NUM 0             // 文件头所在页，表的根节点在它之后
+
+#define WAL_MAGIC 0x4c415753            // 日志文件头魔数 "SWAL"
+#define WAL_VERSION 1
+#define WAL_HEADER_SIZE 16               // 魔数、版本、页大小、盐值
+#define WAL_FRAME_HEADER_SIZE 16         // 页号、提交后的页数、盐值、校验和
+#define WAL_FRAME_SIZE (WAL_FRAME_HEADER_SIZE + PAGE_SIZE)
+#define WAL_NO_FRAME UINT32_MAX          // 页不在日志中
+#define WAL_CHECKPOINT_FRAMES 1000       // 未写回的帧达到该数量时后台检查点开始工作
+#define WAL_MAX_FRAMES (4 * WAL_CHECKPOINT_FRAMES)  // 持续写入时后台来不及清空日志，达到该帧数时由提交者执行检查点
+
+#define VERSION_STORE_BUCKETS 1024       // 版本存储哈希桶数
+#define VERSION_STORE_MAX_FREE 64        // 版本存储保留的空闲旧版本数，保存旧版本时复用
+
+#define PAGE_MAP_UNIT 256                // 压缩页在文件中的分配单位
+#define PAGE_COMPRESS_MAX_RUN 130        // RLE 一个重复段的最大长度
+
+#define INDEX_COUNT 2                    // 二级索引数：username、email
+
+#define STATEMENT_MAX_PARAMS 3           // 一条语句最多的 ? 参数
+#define STATEMENT_CACHE_SIZE 16          // 语句缓存的项数
+
+#define SERVER_DEFAULT_WORKERS 4         // 服务器默认工作线程数
+#define SERVER_QUEUE_SIZE 64             // 等待工作线程的连接数
+#define SERVER_MAX_REQUEST (1 << 20)     // 一个请求的最大长度，超过时断开连接
+#define SERVER_BACKLOG 64                // listen 的等待队列长度
+
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_DEBUG          // 编译时保留的最详细级别，-DLOG_MAX_LEVEL=LOG_ERROR 时调试日志被编译掉
+#endif
+#define LOG_DEFAULT_LEVEL LOG_WARN
+
+// 级别不超过 LOG_MAX_LEVEL 和运行时的 log_level 时才格式化输出，否则只有一次比较
+#define log_message(level, ...) \
+    do { \
+        if ((level) <= LOG_MAX_LEVEL && (level) <= log_level) { \
+            log_write((level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define NODE_SEARCH_WINDOW 16            // 节点内二分查找缩小到这么多个键后逐个比较计数
+#define NODE_CACHE_SIZE 64               // 上层节点缓存的项数
+#define NODE_CACHE_LEVELS 2              // 缓存从根节点开始的几层内部节点
+#define CURSOR_POOL_SIZE 16              // 每个线程保留的空闲游标数
+#define PAGE_BUFFER_POOL_SIZE 16         // 每个线程保留的空闲页缓冲数
+
+#define ROW_BATCH_MAX_ROWS (PAGE_SIZE / sizeof(uint32_t))  // 任何叶子布局下单页行数的上限
+#define OUTPUT_BUFFER_INITIAL_SIZE 4096
+
+#define BULK_LOAD_DEFAULT_FILL_FACTOR 100  // 批量导入时节点默认装填百分比
+#define BULK_LOAD_MAX_LEVELS 32            // 内部节点至少两个子节点，32层足够容纳所有键
 
 // 行
 typedef struct
@@ -22,6 +99,24 @@ typedef struct
     char email[COLUMN_EMAIL_SIZE + 1];
 } Row;
 
+// 建有二级索引的列
+typedef enum
+{
+    INDEX_USERNAME,
+    INDEX_EMAIL
+} IndexColumn;
+
+// 日志级别，数值越大越详细
+typedef enum
+{
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG
+} LogLevel;
+
+extern LogLevel log_level;
+
 // 输入缓存
 typedef struct
 {
@@ -44,45 +139,334 @@ typedef enum
     PREPARE_NEGATIVE_ID,
     PREPARE_SYNTAX_ERROR,
     PREPARE_STRING_TOO_LONG,
-    PREPARE_UNRECOGNIZED_STATEMENT
+    PREPARE_UNRECOGNIZED_STATEMENT,
+    PREPARE_BIND_ERROR
 } PrepareResult;
 
 // 语句类型
 typedef enum
 {
     STATEMENT_INSERT,
-    STATEMENT_SELECT
+    STATEMENT_SELECT,
+    STATEMENT_BEGIN,
+    STATEMENT_COMMIT,
+    STATEMENT_ROLLBACK
 } StatementType;
 
-// 语句
+// 查询条件
+typedef enum
+{
+    SELECT_ALL,
+    SELECT_EQUAL,
+    SELECT_BETWEEN,
+    SELECT_GREATER,
+    SELECT_GREATER_EQUAL,
+    SELECT_LESS,
+    SELECT_LESS_EQUAL,
+    SELECT_USERNAME_EQUAL,  // 操作数在 row_to_insert.username 中
+    SELECT_EMAIL_EQUAL      // 操作数在 row_to_insert.email 中
+} SelectOperator;
+
+// ? 参数绑定的位置
+typedef enum
+{
+    PARAM_ID,
+    PARAM_USERNAME,
+    PARAM_EMAIL,
+    PARAM_LOWER,
+    PARAM_UPPER
+} StatementParam;
+
+// 语句，解析一次后可以多次绑定参数并执行
 typedef struct
 {
     StatementType type;  // 语句类型
-    Row row_to_insert;   // 插入行的结构
+    Row row_to_insert;   // 插入行的结构，多行时为第一行
+    Row* rows;           // 多行插入的所有行，单行时为 NULL
+    uint32_t num_rows;   // 多行插入的行数
+    SelectOperator op;   // 查询条件
+    uint32_t lower;      // 条件的操作数，between 的下界
+    uint32_t upper;      // between 的上界
+    uint32_t num_params;                          // ? 的个数
+    StatementParam params[STATEMENT_MAX_PARAMS];  // 第 i 个 ? 绑定的位置
 } Statement;
 
+// 语句缓存的一项
+typedef struct
+{
+    char* sql;            // 语句文本，空项为 NULL
+    uint32_t hash;
+    Statement statement;  // 解析后的语句
+} StatementCacheEntry;
+
+// 语句缓存，按文本找到解析过的语句
+typedef struct
+{
+    StatementCacheEntry entries[STATEMENT_CACHE_SIZE];
+    uint32_t next_victim;  // 满时轮流替换
+} StatementCache;
+
+// 缓冲池帧
+typedef struct
+{
+    void* data;            // 页内容，指向 buffer 或文件映射
+    void* buffer;          // 帧自有的页内存，在缓冲池的内存块中
+    uint32_t page_num;     // 缓存的页号
+    uint32_t pin_count;    // 固定计数，大于0时不可被淘汰
+    bool dirty;            // 是否需要写回磁盘
+    bool referenced;       // CLOCK 引用位
+    bool in_use;           // 是否缓存了页
+    bool mapped;           // 页内容是否来自文件映射
+    bool loading;          // 是否正在从磁盘读入，读入完成前其他线程等待
+    int32_t next;          // 页表哈希桶中的下一帧
+    pthread_rwlock_t latch;  // 页闩锁，读者拷贝页时加共享锁，写者保存旧版本时加排他锁
+} Frame;
+
+// 日志索引项，记录页在日志中最新的帧
+typedef struct
+{
+    uint32_t page_num;   // 页号，INVALID_PAGE_NUM 表示空槽
+    uint32_t frame_num;  // 日志中的第几帧，WAL_NO_FRAME 表示页已被丢弃
+} WalIndexEntry;
+
+// 页的旧版本，写者在事务中第一次修改页之前保存
+typedef struct PageVersion
+{
+    uint32_t page_num;
+    uint64_t begin;                    // 产生该版本的提交
+    uint64_t end;                      // 替换该版本的提交，未提交时为事务将要使用的版本号
+    void* data;                        // 页内容
+    struct PageVersion* next;          // 哈希桶中的下一个版本，同一页新的版本在前
+    struct PageVersion* next_reclaim;  // 回收链表中的下一个版本，按 end 递增
+} PageVersion;
+
+// 版本存储
+// 读者在快照 s 中看到每页 begin <= s < end 的旧版本，没有这样的旧版本时看到当前页
+// 没有活跃快照需要的旧版本在提交和结束快照时回收
+typedef struct
+{
+    PageVersion** buckets;           // 页号 -> 旧版本
+    PageVersion* oldest;             // 回收链表头
+    PageVersion* newest;             // 回收链表尾
+    uint64_t commit_version;         // 最近一次提交的版本号
+    uint64_t* snapshots;             // 活跃的快照
+    uint32_t num_snapshots;
+    uint32_t snapshots_capacity;
+    PageVersion* free_versions;      // 回收后留待复用的旧版本，通过 next 链接
+    uint32_t num_free_versions;
+    pthread_mutex_t mutex;
+} VersionStore;
+
+// 压缩页在数据库文件中的位置
+typedef struct
+{
+    uint32_t offset;    // 起始位置，单位 PAGE_MAP_UNIT
+    uint16_t length;    // 压缩后的长度，0 表示页不存在，PAGE_SIZE 表示未压缩
+    uint16_t capacity;  // 占用的空间，单位 PAGE_MAP_UNIT
+} PageMapEntry;
+
+// 文件中的一段空闲空间
+typedef struct
+{
+    uint32_t offset;    // 单位 PAGE_MAP_UNIT
+    uint32_t units;
+} PageMapExtent;
+
+// 分页器统计，从打开数据库开始累计，各线程用 stats_add 原子地增加
+typedef struct
+{
+    uint64_t cache_hits;       // pager_pin 在缓冲池中找到页
+    uint64_t cache_misses;     // pager_pin 需要从日志或文件读入页
+    uint64_t bytes_read;       // 从日志和数据库文件读取的字节数，映射的页不计
+    uint64_t bytes_written;    // 写入日志和数据库文件的字节数
+    uint64_t flushes;          // pager_flush 的调用次数，即淘汰脏页时写回的次数
+    uint64_t node_cache_hits;  // 查找时在上层节点缓存中找到内部节点，不经过缓冲池
+} PagerStats;
+
+// 上层节点缓存项，页内容是版本 since 提交之后的当前页
+typedef struct
+{
+    uint32_t page_num;   // INVALID_PAGE_NUM 表示空
+    uint64_t since;      // 加入缓存时最近一次提交的版本号，不早于它的快照可以使用
+    void* data;          // 页内容的副本，按需分配
+} NodeCacheEntry;
+
+// 上层节点缓存，保存各树根节点附近的内部节点，查找时不必固定和拷贝这些页
+// 写者修改页之前使缓存项失效；写操作进行中不加入新项，加入的总是已提交的当前页
+typedef struct
+{
+    NodeCacheEntry entries[NODE_CACHE_SIZE];
+    uint32_t next_victim;    // 没有空项时轮流替换
+    uint64_t generation;     // 写操作开始和结束时各加 1，奇数表示有写者
+    pthread_rwlock_t lock;   // 查找时加共享锁，加入和失效时加排他锁
+} NodeCache;
+
+// 页映射
+// 开启压缩时，页压缩后紧凑存放在数据库文件中，位置记录在数据库文件旁的 -map 文件里
+// 空闲空间不落盘，打开时根据映射重新计算
+typedef struct
+{
+    int file_descriptor;
+    PageMapEntry* entries;          // 页号 -> 位置
+    uint32_t num_entries;
+    uint32_t entries_capacity;
+    PageMapExtent* free_extents;    // 空闲空间
+    uint32_t num_free_extents;
+    uint32_t free_extents_capacity;
+    PageMapExtent* pending_extents; // 已释放但磁盘上的映射可能仍指向的空间，检查点落盘后才并入空闲空间
+    uint32_t num_pending_extents;
+    uint32_t pending_extents_capacity;
+    uint32_t end;                   // 已使用空间的末尾，单位 PAGE_MAP_UNIT
+    pthread_mutex_t mutex;          // 检查点写入和前台读取之间的互斥
+    PagerStats* stats;              // 分页器的统计
+} PageMap;
+
+// 预写日志
+// 文件由文件头和若干帧组成，每帧是一页的完整内容
+// 提交帧记录提交后数据库的页数，提交帧之后的帧在恢复时被丢弃
+typedef struct
+{
+    char* filename;
+    int file_descriptor;
+    int db_file_descriptor;     // 检查点写入的数据库文件
+    PageMap* page_map;          // 开启压缩时检查点通过页映射写入，否则为 NULL
+    uint32_t salt;              // 每次重置日志时改变，用于识别旧帧
+    uint32_t num_frames;        // 已追加的帧数
+    uint32_t checkpointed_frames;  // 前多少帧已写回数据库文件
+    uint32_t db_size;           // 最近一次提交时数据库的页数，之后的页是回滚时丢弃的页，不能写回
+    bool uncommitted;           // 是否有未提交的帧
+    off_t synced_length;        // 已落盘的日志长度
+    bool syncing;               // 是否有线程正在 fsync
+    pthread_mutex_t mutex;      // 保护追加、索引和落盘状态
+    pthread_cond_t synced;      // fsync 完成时通知等待的提交
+    pthread_mutex_t checkpoint_mutex;  // 同一时间只执行一个检查点
+    pthread_t checkpointer;     // 后台检查点线程
+    bool checkpointer_running;  // 检查点线程是否已启动
+    bool stop_checkpointer;     // 通知检查点线程退出
+    pthread_cond_t checkpoint_wanted;  // 有足够的帧可以写回时通知检查点线程
+    WalIndexEntry* index;       // 页号 -> 帧的开放寻址哈希表
+    uint32_t index_mask;        // 哈希表大小 - 1
+    uint32_t index_count;       // 已使用的槽数
+    PagerStats* stats;          // 分页器的统计
+} Wal;
+
+// 保存点时页的内容
+typedef struct
+{
+    uint32_t page_num;
+    void* data;
+} SavepointPage;
+
+// 页集合的槽
+typedef struct
+{
+    uint32_t page_num;
+    uint32_t position;    // 页在对应数组中的下标
+    uint32_t generation;  // 与集合的代数相同时槽有效
+} PageSetSlot;
+
+// 页号 -> 数组下标的开放寻址哈希表，记录写集合和保存点中有哪些页
+// 清空时只增加代数，不需要逐槽清除
+typedef struct
+{
+    PageSetSlot* slots;
+    uint32_t mask;        // 槽数 - 1
+    uint32_t count;
+    uint32_t generation;
+} PageSet;
+
 // 分页器
 typedef struct
 {
     int file_descriptor;
-    uint32_t file_length;
     uint32_t num_pages;
-    void* pages[TABLE_MAX_PAGES];
+    Frame* frames;             // 帧数组
+    uint32_t max_frames;       // 帧预算
+    uint32_t num_frames_used;  // 已使用过的帧数
+    void* frame_slab;          // 所有帧的页内存，一次分配，未使用的部分不占物理内存
+    Frame** dirty_frames;      // 提交时收集脏帧的数组，容纳所有帧
+    uint32_t clock_hand;       // CLOCK 指针
+    int32_t* page_table;       // 页号 -> 帧下标的哈希桶
+    uint32_t page_table_mask;  // 哈希桶数 - 1
+    void* map;                 // 文件的私有映射，未开启时为 NULL
+    off_t map_length;          // 映射的长度
+    Wal* wal;                  // 预写日志，修改的页提交到日志，检查点时写回文件
+    PageMap* page_map;         // 开启压缩时的页映射，否则为 NULL
+    pthread_mutex_t mutex;     // 保护页表、帧状态、CLOCK 指针和页数
+    pthread_cond_t loaded;     // 帧读入完成时通知等待的线程
+    uint32_t num_flushing;     // 正在写回日志的脏页数，写回时不持有缓冲池锁
+    uint32_t num_committing;   // 提交时固定的脏页数，追加日志时不持有缓冲池锁
+    pthread_cond_t flushed;    // 脏页写回或提交追加完成时通知等待的提交、截断和淘汰
+    pthread_mutex_t write_mutex;  // 同一时间只有一个写者，从 pager_begin_write 持有到 pager_commit
+    VersionStore* versions;    // 页的旧版本，读者按快照读取
+    uint32_t* write_set;       // 本事务已保存旧版本的页
+    uint32_t write_set_size;
+    uint32_t write_set_capacity;
+    PageSet write_set_pages;   // 写集合中的页 -> 在 write_set 中的下标
+    bool exclusive_write;      // 写者已保存根节点的旧版本，快照读者到不了其他修改的页，不再逐页保存
+    uint32_t write_num_pages;  // 写操作开始时的页数，回滚时丢弃之后分配的页
+    bool savepoint_active;              // 语句保存点是否有效
+    uint32_t savepoint_write_set_size;  // 保存点时写集合的大小
+    uint32_t savepoint_num_pages;       // 保存点时的页数
+    SavepointPage* savepoint_pages;     // 保存点之前修改过、之后又修改的页在保存点时的内容
+    uint32_t savepoint_size;
+    uint32_t savepoint_capacity;
+    PageSet savepoint_set;              // 另存过的页 -> 在 savepoint_pages 中的下标
+    PagerStats stats;
+    NodeCache node_cache;
 } Pager;
 
-// 表
+// 分页器选项
 typedef struct
+{
+    uint32_t max_frames;  // 缓冲池帧预算
+    bool use_mmap;        // 是否通过 mmap 读取文件中已有的页
+    bool compress;        // 新建数据库时是否压缩存储页
+} PagerOptions;
+
+// 数据库文件头，存放在 0 号页开头
+// 打开时校验魔数、格式版本和页大小，不认识的文件（包括没有文件头的定长行格式的旧文件）拒绝打开
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t root_page_num;      // 表的根节点所在页
+    uint32_t index_root_page_nums[INDEX_COUNT];  // 二级索引的根节点所在页，0 表示没有该索引
+} DbHeader;
+
+// 表
+typedef struct Table
 {
     Pager *pager;
     uint32_t root_page_num;
+    uint32_t rightmost_leaf_page_num;  // 最近一次找到的最右叶子节点，用于追加插入
+    uint64_t leaf_splits;              // 叶子节点拆分次数
+    uint64_t internal_splits;          // 内部节点拆分次数
+    struct Table* indexes[INDEX_COUNT];  // 二级索引树，与表共用分页器；文件头中没有记录时为 NULL
 } Table;
 
+// 表统计，.stats 输出，嵌入时由 table_stats 填写
+typedef struct
+{
+    PagerStats pager;
+    uint64_t leaf_splits;
+    uint64_t internal_splits;
+    uint32_t tree_height;          // 从根节点到叶子节点的层数，根节点是叶子节点时为 1
+    uint32_t num_internal_nodes;
+    uint32_t num_leaf_nodes;
+    uint64_t num_rows;
+    double leaf_fill;              // 叶子节点已用空间占可用空间的平均比例
+} TableStats;
+
 // 命令执行结果
 typedef enum
 {
     EXECUTE_SUCCESS,
     EXECUTE_ERROR,
-    EXECUTE_DUPLICATE_KEY
+    EXECUTE_DUPLICATE_KEY,
+    EXECUTE_NESTED_TRANSACTION,
+    EXECUTE_NO_TRANSACTION
 } ExecuteResult;
 
 // 游标
@@ -92,10 +476,316 @@ typedef struct
     uint32_t page_num;  // 第几页
     uint32_t cell_num;  // 第几个单元
     bool end_of_table;  // 是否到表尾
+    uint64_t snapshot;  // 读者游标读取的快照
+    void* node;         // 读者游标：当前叶子节点在快照中的副本；写者游标为 NULL，游标存在期间该页保持固定
 } Cursor;
 
+// 线程本地的空闲游标和页缓冲，查找和插入时复用，不必每次向分配器申请
+// 空闲块的前 8 字节存放下一个空闲块，线程退出时全部释放
+typedef struct
+{
+    void* cursors;
+    uint32_t num_cursors;
+    void* page_buffers;
+    uint32_t num_page_buffers;
+    bool registered;    // 是否已登记线程退出时的释放
+} ThreadPool;
+
+// 一批行，来自同一个叶子节点
+typedef struct
+{
+    void* node;                            // 行所在叶子节点在快照中的副本
+    uint32_t num_rows;
+    uint32_t keys[ROW_BATCH_MAX_ROWS];     // 键
+    void* values[ROW_BATCH_MAX_ROWS];      // 指向页内序列化的行，不拷贝
+} RowBatch;
+
+// 输出缓存，一批行格式化后一次写出
+typedef struct
+{
+    char* data;
+    size_t length;
+    size_t capacity;
+    FILE* stream;
+} OutputBuffer;
+
 // 节点类型
 typedef enum {
     NODE_INTERNAL,
     NODE_LEAF
 } NodeType;
+
+// 行来源的读取结果
+typedef enum {
+    ROW_SOURCE_ROW,
+    ROW_SOURCE_END,
+    ROW_SOURCE_ERROR
+} RowSourceResult;
+
+// 行来源，批量导入时逐行读取
+typedef RowSourceResult (*RowSource)(void* context, Row* row);
+
+// 批量导入结果
+typedef enum {
+    BULK_LOAD_SUCCESS,
+    BULK_LOAD_TABLE_NOT_EMPTY,
+    BULK_LOAD_UNSORTED,
+    BULK_LOAD_SOURCE_ERROR
+} BulkLoadResult;
+
+// 批量导入的装填状态
+typedef struct
+{
+    Table* table;
+    uint32_t fill_bytes;                          // 叶子节点装填的字节数
+    uint32_t fill_children;                       // 内部节点装填的子节点数
+    uint32_t num_levels;                          // 层数，第0层为叶子
+    uint32_t open_page[BULK_LOAD_MAX_LEVELS];     // 每层正在装填的节点
+    uint32_t open_max_key[BULK_LOAD_MAX_LEVELS];  // 每层正在装填的内部节点最右子节点的最大键，即该节点的最大键
+    uint32_t last_key;                            // 上一行的键
+} BulkLoader;
+
+// 导入文件的状态
+typedef struct
+{
+    FILE* file;
+    char* line;
+    size_t line_length;
+    uint32_t line_num;
+} ImportFile;
+
+// 服务器响应状态
+typedef enum {
+    SERVER_OK,
+    SERVER_ERROR
+} ServerStatus;
+
+struct Server;
+
+// 服务器工作线程
+typedef struct
+{
+    struct Server* server;
+    pthread_t thread;
+    int connection;        // 正在服务的连接，空闲时为 -1
+    StatementCache* statements;  // 该线程解析过的语句，跨连接复用
+    bool in_transaction;         // 当前连接是否在显式事务中
+} ServerWorker;
+
+// 服务器，工作线程共用一个表
+typedef struct Server
+{
+    Table* table;
+    int listen_fd;
+    char* socket_path;                 // Unix 域套接字的路径，TCP 时为 NULL
+    int wakeup[2];                     // 停止时写入，唤醒接受连接的线程
+    ServerWorker* workers;
+    uint32_t num_workers;
+    int queue[SERVER_QUEUE_SIZE];      // 已接受、等待工作线程的连接
+    uint32_t queue_head;
+    uint32_t queue_length;
+    bool stopping;
+    pthread_mutex_t mutex;             // 保护队列、stopping 和工作线程的 connection
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} Server;
+
+// 函数声明，main.c 实现，bench.c 等直接调用引擎的程序共用
+void log_write(LogLevel level, const char* format, ...);
+bool log_parse_level(const char* name, LogLevel* level);
+const char* log_level_name(LogLevel level);
+InputBuffer* new_input_buffer(void);
+void print_prompt(void);
+void read_input(InputBuffer* input_buffer);
+void close_input_buffer(InputBuffer* input_buffer);
+Table* db_open(const char* filename, PagerOptions* options);
+void db_read_header(Pager* pager, const char* filename, DbHeader* header);
+void db_close(Table* table);
+MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table* table, bool in_transaction);
+PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement);
+bool prepare_tuple_end(char* token);
+void statement_free(Statement* statement);
+char* prepare_param(Statement* statement, char* token, StatementParam param, char* placeholder);
+PrepareResult parse_row(char* id_string, char* username, char* email, Row* row);
+PrepareResult prepare_select(InputBuffer *input_buffer, Statement *statement);
+PrepareResult parse_id(char* id_string, uint32_t* id);
+PrepareResult prepare_statement(InputBuffer *input_buffer, Statement *statement);
+PrepareResult prepare_transaction(InputBuffer *input_buffer, Statement *statement);
+void statement_select_range(Statement* statement, uint32_t* min_id, uint32_t* max_id);
+PrepareResult statement_bind_int(Statement* statement, uint32_t index, uint32_t value);
+PrepareResult statement_bind_text(Statement* statement, uint32_t index, const char* value, uint32_t length);
+ExecuteResult statement_step(Statement* statement, Table* table, bool* in_transaction, FILE* stream);
+StatementCache* statement_cache_open(void);
+void statement_cache_close(StatementCache* cache);
+PrepareResult statement_cache_prepare(StatementCache* cache, char* sql, Statement* statement);
+uint32_t serialize_row(Row* source, void* destination);
+void deserialize_row(void* source, Row* destination);
+void* get_page(Pager* pager, uint32_t page_num);
+void unpin_page(Pager* pager, uint32_t page_num);
+Frame* pager_pin(Pager* pager, uint32_t page_num);
+void pager_read_page(Pager* pager, uint32_t page_num, uint64_t snapshot, void* page);
+void node_cache_init(NodeCache* cache);
+void node_cache_close(NodeCache* cache);
+bool node_cache_find_child(Pager* pager, uint32_t page_num, uint64_t snapshot, uint32_t key, uint32_t* child_page_num, uint64_t* generation);
+void node_cache_put(Pager* pager, uint32_t page_num, void* node, uint64_t snapshot, uint64_t generation);
+void node_cache_invalidate(Pager* pager, uint32_t page_num);
+void node_cache_advance(Pager* pager);
+void pager_begin_write(Pager* pager);
+void pager_mark_dirty(Pager* pager, uint32_t page_num);
+void page_set_init(PageSet* set);
+void page_set_close(PageSet* set);
+void page_set_clear(PageSet* set);
+int32_t page_set_find(PageSet* set, uint32_t page_num);
+void page_set_put(PageSet* set, uint32_t page_num, uint32_t position);
+int32_t pager_lookup(Pager* pager, uint32_t page_num);
+uint32_t pager_find_victim(Pager* pager);
+void* row_slot(Table* table, uint32_t row_num);
+ExecuteResult execute_insert(Statement* statement, Table* table, bool in_transaction);
+ExecuteResult execute_transaction(Statement* statement, Table* table, bool* in_transaction);
+void table_rollback(Table* table);
+ExecuteResult table_insert_row(Table* table, Row* row, uint32_t* leaf_page_num);
+int compare_row_id(const void* a, const void* b);
+void print_row(Row* row);
+bool cursor_next_batch(Cursor* cursor, RowBatch* batch);
+OutputBuffer* new_output_buffer(FILE* stream);
+void output_reserve(OutputBuffer* output, size_t length);
+void output_row(OutputBuffer* output, uint32_t key, void* value);
+void output_flush(OutputBuffer* output);
+void close_output_buffer(OutputBuffer* output);
+ExecuteResult execute_select(Statement* statement, Table* table, bool in_transaction, FILE* stream);
+ExecuteResult execute_select_column(Statement* statement, Table* table, bool in_transaction, FILE* stream);
+Pager* pager_open(const char* filename, PagerOptions* options);
+void pager_flush(Pager* pager, uint32_t frame_num);
+void pager_commit(Pager* pager);
+void pager_rollback(Pager* pager);
+void pager_restore_versions(Pager* pager, uint32_t start);
+void pager_savepoint(Pager* pager);
+void pager_savepoint_save(Pager* pager, uint32_t page_num);
+void pager_rollback_savepoint(Pager* pager);
+void pager_release_savepoint(Pager* pager);
+void pager_truncate(Pager* pager, uint32_t num_pages);
+int compare_frame_page_num(const void* a, const void* b);
+int compare_wal_entry_page_num(const void* a, const void* b);
+Wal* wal_open(const char* db_filename, int db_file_descriptor, PagerStats* stats);
+void wal_recover(Wal* wal, uint32_t* num_pages);
+off_t wal_append(Wal* wal, Frame** frames, uint32_t num_frames, uint32_t db_size);
+void wal_sync(Wal* wal, off_t length);
+bool wal_checkpoint_ready(Wal* wal);
+bool wal_checkpoint(Wal* wal);
+void* wal_checkpointer_main(void* arg);
+void wal_start_checkpointer(Wal* wal);
+void wal_stop_checkpointer(Wal* wal);
+void wal_reset(Wal* wal);
+void wal_close(Wal* wal);
+void wal_read_frame(Wal* wal, uint32_t frame_num, void* page);
+bool wal_read_page(Wal* wal, uint32_t page_num, void* page);
+void wal_index_put(Wal* wal, uint32_t page_num, uint32_t frame_num);
+void wal_forget_pages(Wal* wal, uint32_t num_pages);
+uint32_t wal_frame_checksum(uint32_t* header, void* data);
+VersionStore* version_store_open(void);
+void version_store_close(VersionStore* store);
+void version_store_save(VersionStore* store, uint32_t page_num, void* page);
+bool version_store_read(VersionStore* store, uint32_t page_num, uint64_t snapshot, void* page);
+uint64_t version_store_begin_snapshot(VersionStore* store);
+void version_store_end_snapshot(VersionStore* store, uint64_t snapshot);
+void version_store_commit(VersionStore* store);
+void version_store_reclaim(VersionStore* store);
+PageMap* page_map_open(const char* db_filename, bool create, PagerStats* stats);
+void page_map_close(PageMap* page_map);
+void page_map_read(PageMap* page_map, int db_file_descriptor, uint32_t page_num, void* page);
+void page_map_write(PageMap* page_map, int db_file_descriptor, uint32_t page_num, void* page);
+void page_map_truncate(PageMap* page_map, uint32_t num_pages);
+uint32_t page_map_allocate(PageMap* page_map, uint32_t units);
+void page_map_free(PageMap* page_map, uint32_t offset, uint32_t units);
+void page_map_free_later(PageMap* page_map, uint32_t offset, uint32_t units);
+uint32_t page_map_num_pending(PageMap* page_map);
+void page_map_release_pending(PageMap* page_map, uint32_t num_extents);
+void page_map_set_entry(PageMap* page_map, uint32_t page_num, PageMapEntry* entry);
+int compare_page_map_extent_offset(const void* a, const void* b);
+uint32_t page_compress(uint8_t* page, uint8_t* out);
+void page_decompress(uint8_t* in, uint32_t length, uint8_t* page);
+ExecuteResult execute_statement(Statement* statement, Table* table, bool* in_transaction);
+Cursor* table_start(Table* table, uint64_t snapshot);
+Cursor* table_seek(Table* table, uint32_t key, uint64_t snapshot);
+Cursor* table_end(Table* table);
+void cursor_advance(Cursor* cursor);
+void* cursor_value(Cursor* cursor);
+void cursor_free(Cursor* cursor);
+ThreadPool* thread_pool_get(void);
+void thread_pool_release(void* arg);
+void thread_pool_create_key(void);
+Cursor* cursor_alloc(void);
+void* page_buffer_alloc(void);
+void page_buffer_free(void* page);
+void print_constants(void);
+void table_open_indexes(Table* table, DbHeader* header);
+void table_build_indexes(Table* table);
+char* row_column(Row* row, IndexColumn column);
+uint32_t index_key(const char* value);
+void index_insert(Table* index, uint32_t id, const char* value);
+uint32_t index_find(Table* index, const char* value, uint64_t snapshot, uint32_t** ids);
+int compare_id(const void* a, const void* b);
+void stats_add(uint64_t* counter, uint64_t value);
+void table_stats(Table* table, TableStats* stats);
+void table_stats_visit(Table* table, uint32_t page_num, uint32_t depth, uint64_t snapshot, TableStats* stats, uint64_t* used_bytes);
+void print_stats(TableStats* stats);
+void print_leaf_node(void* node);
+
+uint32_t* leaf_node_num_cells(void* node);
+void* leaf_node_cell(void* node, uint32_t cell_num);
+uint32_t* leaf_node_key(void* node, uint32_t cell_num);
+void* leaf_node_value(void* node, uint32_t cell_num);
+uint16_t* leaf_node_value_length(void* node, uint32_t cell_num);
+uint16_t* leaf_node_content_start(void* node);
+uint32_t leaf_node_free_space(void* node);
+void leaf_node_insert_cell(void* node, uint32_t cell_num, uint32_t key, void* value, uint32_t length);
+void leaf_node_clear_cells(void* node);
+void initialize_leaf_node(void* node);
+NodeType get_node_type(void* node);
+void set_node_type(void* node, NodeType type);
+void leaf_node_insert(Cursor* cursor, uint32_t key, void* value, uint32_t length);
+Cursor* table_find(Table* table, uint32_t key, uint64_t snapshot);
+Cursor* table_find_append(Table* table, uint32_t key);
+Cursor* table_find_for_insert(Table* table, uint32_t key);
+bool node_is_rightmost(Pager* pager, uint32_t page_num);
+Cursor* leaf_node_find(Table* table, uint32_t page_num, void* node, uint32_t key);
+void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, void* value, uint32_t length);
+uint32_t get_unused_page_num(Pager* pager);
+bool is_node_root(void* node);
+void set_node_root(void* node, bool is_root);
+void create_new_root(Table* table, uint32_t page_num);
+void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t left_page_num, uint32_t child_page_num);
+void internal_node_split_and_insert(Table* table, uint32_t parent_page_num, uint32_t left_page_num, uint32_t child_page_num);
+uint32_t internal_node_find_child(void* node, uint32_t key);
+uint32_t node_lower_bound(uint8_t* cells, uint32_t cell_size, uint32_t key_offset, uint32_t num_keys, uint32_t key);
+void update_internal_node_key(void* node, uint32_t child_page_num, uint32_t new_key);
+uint32_t internal_node_child_index(void* node, uint32_t child_page_num);
+void set_node_parent(Pager* pager, uint32_t page_num, uint32_t parent_page_num);
+uint32_t* node_parent(void* node);
+uint32_t* internal_node_child(void* node, uint32_t child_num);
+uint32_t* internal_node_key(void* node, uint32_t key_num);
+uint32_t* internal_node_cell(void* node, uint32_t cell_num);
+uint32_t get_node_max_key(Pager* pager, void* node);
+BulkLoadResult table_bulk_load(Table* table, RowSource source, void* context, uint32_t fill_factor, uint32_t* num_rows);
+uint32_t bulk_load_close_node(BulkLoader* loader, uint32_t level);
+void bulk_load_append_child(BulkLoader* loader, uint32_t level, uint32_t child_page_num, uint32_t child_max_key);
+RowSourceResult file_row_source(void* context, Row* row);
+void import_file(Table* table, char* filename, uint32_t fill_factor);
+uint32_t* internal_node_right_child(void* node);
+uint32_t* internal_node_num_keys(void* node);
+void indent(uint32_t level);
+void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level);
+uint32_t* leaf_node_next_leaf(void* node);
+void print_prepare_result(FILE* stream, PrepareResult result, char* input);
+void print_execute_result(FILE* stream, ExecuteResult result);
+Server* server_open(Table* table, char* address, uint32_t num_workers);
+void server_run(Server* server);
+void server_stop(Server* server);
+void server_close(Server* server);
+void* server_worker_main(void* arg);
+void server_serve_connection(ServerWorker* worker, int connection);
+ServerStatus server_execute(ServerWorker* worker, char* request, uint32_t length, FILE* stream);
+PrepareResult server_bind_params(Statement* statement, uint8_t* params, uint32_t length);
+bool server_read_full(int fd, void* buffer, size_t length);
+bool server_write_full(int fd, void* buffer, size_t length);
+void* server_signal_main(void* arg);
@@ -0,0 +1,311 @@
+#include <stdatomic.h>
+
+#include "../main.h"
+
+// 并发测试：写线程按事务插入行的同时，多个读线程在快照下查找和扫描，检查读到的总是某次提交后的完整状态
+// 编译：gcc -O2 -DSQLIT_NO_MAIN tests/concurrency.c main.c -lpthread -o concurrency
+
+#define CONCURRENCY_DB_FILENAME "concurrency.db"
+#define CONCURRENCY_MAX_READERS 64
+#define CONCURRENCY_FINDS_PER_SNAPSHOT 100   // 每个快照中查找的次数
+
+typedef struct {
+    Table* table;
+    uint32_t* keys;                 // 写线程插入 id 的顺序
+    uint32_t* positions;            // id 在 keys 中的位置，id 为偶数的项不用
+    uint32_t num_rows;
+    uint32_t batch;                 // 每个事务插入的行数
+    atomic_uint num_committed;      // 已提交的行数，写线程在提交返回后更新
+    atomic_bool done;
+} Workload;
+
+typedef struct {
+    Workload* workload;
+    uint32_t seed;
+    uint64_t num_scans;
+    uint64_t num_finds;
+} Reader;
+
+void concurrency_reset(const char* filename);
+void concurrency_fail(const char* message, uint32_t key);
+void concurrency_check_row(Row* row, uint32_t key);
+uint32_t concurrency_scan(Workload* workload, uint64_t snapshot);
+void concurrency_find(Workload* workload, uint64_t snapshot, uint32_t num_committed, uint32_t* seed);
+void* concurrency_reader(void* arg);
+void concurrency_write(Workload* workload);
+
+// 删除上一次测试留下的数据库、日志和页映射文件
+// filename: 数据库文件名
+void concurrency_reset(const char* filename)
+{
+    char path[256];
+    unlink(filename);
+    snprintf(path, sizeof(path), "%s-wal", filename);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s-map", filename);
+    unlink(path);
+}
+
+// 输出错误并退出
+// message: 错误信息
+// key: 出错的 id
+void concurrency_fail(const char* message, uint32_t key)
+{
+    fprintf(stderr, "%s: %u\n", message, key);
+    exit(EXIT_FAILURE);
+}
+
+// 检查读到的行是否与插入时生成的值一致
+// row: 读到的行
+// key: 行所在单元格的键
+void concurrency_check_row(Row* row, uint32_t key)
+{
+    char username[COLUMN_USERNAME_SIZE + 1];
+    char email[COLUMN_EMAIL_SIZE + 1];
+    snprintf(username, sizeof(username), "user%u", key);
+    snprintf(email, sizeof(email), "person%u@example.com", key);
+    if (row->id != key || strcmp(row->username, username) != 0 || strcmp(row->email, email) != 0) {
+        concurrency_fail("Row does not match its key", key);
+    }
+}
+
+// 在快照下用 table_start 和 cursor_advance 扫描全表
+// 提交按 keys 的顺序进行，快照看到的必须恰好是 keys 的某个前缀，且长度是 batch 的整数倍或全部行
+// workload: 测试负载
+// snapshot: 快照
+// 返回扫描的行数
+uint32_t concurrency_scan(Workload* workload, uint64_t snapshot)
+{
+    // 1. 检查顺序、内容和事务边界
+    Cursor* cursor = table_start(workload->table, snapshot);
+    uint32_t num_rows = 0;
+    uint32_t last_key = 0;
+    Row row;
+    while (!cursor->end_of_table) {
+        uint32_t key = *leaf_node_key(cursor->node, cursor->cell_num);
+        if (num_rows > 0 && key <= last_key) {
+            concurrency_fail("Scan out of order at key", key);
+        }
+        deserialize_row(cursor_value(cursor), &row);
+        concurrency_check_row(&row, key);
+        last_key = key;
+        num_rows += 1;
+        cursor_advance(cursor);
+    }
+    cursor_free(cursor);
+
+    if (num_rows % workload->batch != 0 && num_rows != workload->num_rows) {
+        concurrency_fail("Scan saw part of a transaction, rows", num_rows);
+    }
+
+    // 2. 行数为 n 且每个 id 都在前 n 个中，说明看到的正好是前 n 个
+    cursor = table_start(workload->table, snapshot);
+    while (!cursor->end_of_table) {
+        uint32_t key = *leaf_node_key(cursor->node, cursor->cell_num);
+        if (workload->positions[key] >= num_rows) {
+            concurrency_fail("Scan saw a row committed after the snapshot", key);
+        }
+        cursor_advance(cursor);
+    }
+    cursor_free(cursor);
+    return num_rows;
+}
+
+// 在快照下随机查找已提交的行：按 id 用 table_find，按 email 用 index_find；不存在的 id 必须找不到
+// workload: 测试负载
+// snapshot: 快照
+// num_committed: 取快照前已提交的行数
+// seed: 随机数种子
+void concurrency_find(Workload* workload, uint64_t snapshot, uint32_t num_committed, uint32_t* seed)
+{
+    char email[COLUMN_EMAIL_SIZE + 1];
+    Row row;
+    for (uint32_t i = 0; i < CONCURRENCY_FINDS_PER_SNAPSHOT; i++) {
+        // 1. 按 id 查找
+        uint32_t key = workload->keys[rand_r(seed) % num_committed];
+        Cursor* cursor = table_find(workload->table, key, snapshot);
+        if (cursor->cell_num >= *leaf_node_num_cells(cursor->node) ||
+            *leaf_node_key(cursor->node, cursor->cell_num) != key) {
+            concurrency_fail("Committed key not found", key);
+        }
+        deserialize_row(cursor_value(cursor), &row);
+        concurrency_check_row(&row, key);
+        cursor_free(cursor);
+
+        // 2. 按 email 查找
+        snprintf(email, sizeof(email), "person%u@example.com", key);
+        uint32_t* ids;
+        uint32_t num_ids = index_find(workload->table->indexes[INDEX_EMAIL], email, snapshot, &ids);
+        if (num_ids != 1 || ids[0] != key) {
+            concurrency_fail("Committed email not found for key", key);
+        }
+        free(ids);
+
+        // 3. 偶数 id 从未插入
+        cursor = table_find(workload->table, key + 1, snapshot);
+        if (cursor->cell_num < *leaf_node_num_cells(cursor->node) &&
+            *leaf_node_key(cursor->node, cursor->cell_num) == key + 1) {
+            concurrency_fail("Found key that was never inserted", key + 1);
+        }
+        cursor_free(cursor);
+    }
+}
+
+// 读线程：直到写线程结束，交替做全表扫描和随机查找
+// arg: Reader
+void* concurrency_reader(void* arg)
+{
+    Reader* reader = arg;
+    Workload* workload = reader->workload;
+    VersionStore* versions = workload->table->pager->versions;
+    while (!atomic_load(&workload->done)) {
+        // 先读提交行数再取快照，快照至少能看到这些行
+        uint32_t num_committed = atomic_load(&workload->num_committed);
+        uint64_t snapshot = version_store_begin_snapshot(versions);
+        if (rand_r(&reader->seed) % 4 == 0) {
+            if (concurrency_scan(workload, snapshot) < num_committed) {
+                concurrency_fail("Scan missed committed rows, committed", num_committed);
+            }
+            reader->num_scans += 1;
+        }
+        else if (num_committed > 0) {
+            concurrency_find(workload, snapshot, num_committed, &reader->seed);
+            reader->num_finds += CONCURRENCY_FINDS_PER_SNAPSHOT;
+        }
+        version_store_end_snapshot(versions, snapshot);
+    }
+    return NULL;
+}
+
+// 写线程：按 keys 的顺序插入，每 batch 行一个显式事务
+// workload: 测试负载
+void concurrency_write(Workload* workload)
+{
+    Statement begin = { .type = STATEMENT_BEGIN };
+    Statement commit = { .type = STATEMENT_COMMIT };
+    Statement insert = { .type = STATEMENT_INSERT };
+    bool in_transaction = false;
+
+    for (uint32_t i = 0; i < workload->num_rows; i++) {
+        uint32_t key = workload->keys[i];
+        insert.row_to_insert.id = key;
+        snprintf(insert.row_to_insert.username, sizeof(insert.row_to_insert.username), "user%u", key);
+        snprintf(insert.row_to_insert.email, sizeof(insert.row_to_insert.email), "person%u@example.com", key);
+
+        if (i % workload->batch == 0) {
+            execute_transaction(&begin, workload->table, &in_transaction);
+        }
+        if (execute_insert(&insert, workload->table, in_transaction) != EXECUTE_SUCCESS) {
+            concurrency_fail("Insert failed", key);
+        }
+        if (i % workload->batch == workload->batch - 1 || i == workload->num_rows - 1) {
+            execute_transaction(&commit, workload->table, &in_transaction);
+            atomic_store(&workload->num_committed, i + 1);
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    PagerOptions options;
+    options.max_frames = PAGER_MIN_FRAMES;
+    options.use_mmap = false;
+    options.compress = false;
+    uint32_t num_readers = 4;
+    uint32_t num_rows = 20000;
+    uint32_t batch = 50;
+    uint32_t seed = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            options.max_frames = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--readers") == 0 && i + 1 < argc &&
+                 atoi(argv[i + 1]) > 0 && atoi(argv[i + 1]) <= CONCURRENCY_MAX_READERS) {
+            num_readers = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            num_rows = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            batch = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--mmap") == 0) {
+            options.use_mmap = true;
+        }
+        else if (strcmp(argv[i], "--compress") == 0) {
+            options.compress = true;
+        }
+        else {
+            printf("Usage: %s [--frames N] [--readers N] [--rows N] [--batch N] [--seed N] [--mmap] [--compress]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // 1. 奇数 id 按随机顺序插入，插入位置分散在整棵树上
+    Workload workload;
+    workload.num_rows = num_rows;
+    workload.batch = batch;
+    workload.keys = malloc(sizeof(uint32_t) * num_rows);
+    workload.positions = malloc(sizeof(uint32_t) * (2 * num_rows + 2));
+    srand(seed);
+    for (uint32_t i = 0; i < num_rows; i++) {
+        workload.keys[i] = 2 * i + 1;
+    }
+    for (uint32_t i = num_rows - 1; i > 0; i--) {
+        uint32_t j = rand() % (i + 1);
+        uint32_t key = workload.keys[i];
+        workload.keys[i] = workload.keys[j];
+        workload.keys[j] = key;
+    }
+    for (uint32_t i = 0; i < num_rows; i++) {
+        workload.positions[workload.keys[i]] = i;
+    }
+    atomic_init(&workload.num_committed, 0);
+    atomic_init(&workload.done, false);
+
+    concurrency_reset(CONCURRENCY_DB_FILENAME);
+    workload.table = db_open(CONCURRENCY_DB_FILENAME, &options);
+
+    // 2. 读线程与写线程同时运行
+    pthread_t threads[CONCURRENCY_MAX_READERS];
+    Reader readers[CONCURRENCY_MAX_READERS];
+    for (uint32_t i = 0; i < num_readers; i++) {
+        readers[i].workload = &workload;
+        readers[i].seed = seed + i;
+        readers[i].num_scans = 0;
+        readers[i].num_finds = 0;
+        pthread_create(&threads[i], NULL, concurrency_reader, &readers[i]);
+    }
+    concurrency_write(&workload);
+    atomic_store(&workload.done, true);
+
+    uint64_t num_scans = 0;
+    uint64_t num_finds = 0;
+    for (uint32_t i = 0; i < num_readers; i++) {
+        pthread_join(threads[i], NULL);
+        num_scans += readers[i].num_scans;
+        num_finds += readers[i].num_finds;
+    }
+
+    // 3. 关闭后重新打开，所有行都在
+    db_close(workload.table);
+    workload.table = db_open(CONCURRENCY_DB_FILENAME, &options);
+    VersionStore* versions = workload.table->pager->versions;
+    uint64_t snapshot = version_store_begin_snapshot(versions);
+    uint32_t num_scanned = concurrency_scan(&workload, snapshot);
+    version_store_end_snapshot(versions, snapshot);
+    if (num_scanned != num_rows) {
+        concurrency_fail("Rows after reopen", num_scanned);
+    }
+    db_close(workload.table);
+
+    printf("rows %u, readers %u, frames %u: %lu scans, %lu finds\n",
+           num_rows, num_readers, options.max_frames, (unsigned long)num_scans, (unsigned long)num_finds);
+    concurrency_reset(CONCURRENCY_DB_FILENAME);
+    free(workload.keys);
+    free(workload.positions);
+    return 0;
+}
@@ -0,0 +1,542 @@
+# 回归测试：通过命令行驱动编译好的数据库
+# 运行：gcc main.c -lpthread && python3 -m unittest discover tests
+# SQLIT_BIN 指定可执行文件，默认为仓库根目录下的 a.out
+
+import os
+import pty
+import random
+import re
+import shutil
+import socket
+import struct
+import subprocess
+import tempfile
+import threading
+import unittest
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+BINARY = os.path.abspath(os.environ.get('SQLIT_BIN', os.path.join(ROOT, 'a.out')))
+
+
+def rows_sql(ids, tag='u'):
+    return ', '.join('%d %s%d e%d@x' % (i, tag, i, i) for i in ids)
+
+
+def recv_full(sock, length):
+    data = b''
+    while len(data) < length:
+        chunk = sock.recv(length - len(data))
+        if not chunk:
+            raise ConnectionError('connection closed')
+        data += chunk
+    return data
+
+
+# 编码 ? 参数：整数为 'i' + 4 字节，文本为 's' + 2 字节长度 + 内容
+def params(*values):
+    data = b''
+    for value in values:
+        if isinstance(value, int):
+            data += b'i' + struct.pack('!I', value)
+        else:
+            data += b's' + struct.pack('!H', len(value.encode())) + value.encode()
+    return data
+
+
+# 向服务器发送一个请求，返回状态和输出
+def request(sock, sql, params=b''):
+    data = sql.encode() + (b'\0' + params if params else b'')
+    sock.sendall(struct.pack('!I', len(data)) + data)
+    status, length = struct.unpack('!II', recv_full(sock, 8))
+    return status, recv_full(sock, length).decode()
+
+
+class DbTest(unittest.TestCase):
+    def setUp(self):
+        self.dir = tempfile.mkdtemp()
+
+    def tearDown(self):
+        shutil.rmtree(self.dir)
+
+    # 执行一组命令，返回标准输出
+    def run_db(self, commands, args=(), check=True):
+        result = subprocess.run([BINARY] + list(args), input='\n'.join(commands) + '\n',
+                                capture_output=True, text=True, cwd=self.dir, timeout=120)
+        if check:
+            self.assertEqual(result.returncode, 0, result.stdout + result.stderr)
+        return result.stdout
+
+    # 启动数据库进程，输出接到伪终端上按行缓冲，可以等到某条语句的输出后再杀掉进程
+    def start_db(self, args=()):
+        master, slave = pty.openpty()
+        process = subprocess.Popen([BINARY] + list(args), stdin=subprocess.PIPE, stdout=slave,
+                                   stderr=subprocess.DEVNULL, cwd=self.dir, text=True)
+        os.close(slave)
+        process.pty = master
+        return process
+
+    # 写入命令后读取输出，直到出现 text
+    def send_until(self, process, commands, text):
+        process.stdin.write('\n'.join(commands) + '\n')
+        process.stdin.flush()
+        return self.read_until(process, text)
+
+    # 读取输出，直到出现 text
+    def read_until(self, process, text):
+        output = b''
+        while text.encode() not in output:
+            data = os.read(process.pty, 65536)
+            self.assertTrue(data, output)
+            output += data
+        return output.decode()
+
+    # 模拟崩溃：直接杀掉进程，不写回也不删除日志
+    def kill_db(self, process):
+        process.kill()
+        process.wait()
+        process.stdin.close()
+        os.close(process.pty)
+
+    # 以服务器方式启动，在临时目录的 Unix 域套接字上监听，返回进程和套接字路径
+    def start_server(self, workers):
+        path = os.path.join(self.dir, 'db.sock')
+        process = self.start_db(['--server', path, '--workers', str(workers)])
+        self.read_until(process, 'Listening')
+        return process, path
+
+    # 发送 SIGTERM，服务器应关闭数据库后正常退出
+    def stop_server(self, process):
+        process.terminate()
+        self.assertEqual(process.wait(timeout=30), 0)
+        process.stdin.close()
+        os.close(process.pty)
+
+    def connect(self, path):
+        sock = socket.socket(socket.AF_UNIX)
+        sock.settimeout(60)
+        sock.connect(path)
+        return sock
+
+    # 按 id 顺序列出所有行的 id
+    def select_ids(self, args=(), where=''):
+        output = self.run_db(['select' + where, '.exit'], args)
+        return [int(m) for m in re.findall(r'\((\d+) ', output)]
+
+    # 语句失败时只撤销该语句：失败的语句修改了事务中已修改过的页，缓冲池很小，执行中这些页被淘汰写进日志
+    def test_savepoint_with_small_buffer_pool(self):
+        evens = list(range(2, 4002, 2))
+        odds = list(range(1, 4001, 2))
+        commands = ['begin']
+        for i in range(0, len(evens), 100):
+            commands.append('insert ' + rows_sql(evens[i:i + 100]))
+        commands.append('insert ' + rows_sql(odds) + ', 4000 dup dup@x')
+        commands += ['commit', '.exit']
+        output = self.run_db(commands, ['--frames', '16'])
+        self.assertIn('Duplicate key', output)
+
+        self.assertEqual(self.select_ids(), evens)
+        self.assertEqual(self.select_ids(where=' where username = u1'), [])
+        self.assertEqual(self.select_ids(where=' where username = u2'), [2])
+
+    # 事务中被淘汰写进日志的新页在回滚时丢弃，崩溃恢复后不能被写回数据库文件
+    def test_recovery_ignores_pages_discarded_by_rollback(self):
+        process = self.start_db(['--frames', '16'])
+        commands = ['insert 1 a a@x', 'begin']
+        for i in range(2, 3002, 100):
+            commands.append('insert ' + rows_sql(range(i, i + 100)))
+        commands += ['rollback', 'insert 5000 b b@x', 'select where id = 5000']
+        self.send_until(process, commands, '(5000 ')
+        self.kill_db(process)
+        self.assertGreater(os.path.getsize(os.path.join(self.dir, 'sqlite.db-wal')), 0)
+
+        self.assertEqual(self.select_ids(), [1, 5000])
+        # 文件头，表和两个索引各一个根节点
+        self.assertEqual(os.path.getsize(os.path.join(self.dir, 'sqlite.db')), 4 * 4096)
+
+    # 崩溃时事务还没有提交：缓冲池很小，事务中的页已被淘汰写进日志，恢复时这些没有提交帧的帧被丢弃
+    def test_crash_before_commit(self):
+        wal = os.path.join(self.dir, 'sqlite.db-wal')
+        process = self.start_db(['--frames', '16'])
+        self.send_until(process, ['insert ' + rows_sql(range(1, 101))], 'Executed.')
+        committed_size = os.path.getsize(wal)
+        commands = ['begin']
+        for i in range(101, 3101, 100):
+            commands.append('insert ' + rows_sql(range(i, i + 100), 'v'))
+        commands.append('select where id = 3100')
+        self.send_until(process, commands, '(3100 ')
+        self.kill_db(process)
+        self.assertGreater(os.path.getsize(wal), committed_size)
+
+        self.assertEqual(self.select_ids(), list(range(1, 101)))
+        self.assertEqual(self.select_ids(where=' where username = v101'), [])
+        self.assertEqual(self.select_ids(where=' where username = u7'), [7])
+
+    # 崩溃时事务已经提交：提交返回前日志已落盘，还没有写回数据库文件的页在恢复时从日志重放
+    def test_crash_after_commit(self):
+        process = self.start_db(['--frames', '16'])
+        commands = ['begin']
+        for i in range(1, 3001, 100):
+            commands.append('insert ' + rows_sql(range(i, i + 100)))
+        commands += ['commit', 'insert 5000 b b@x', 'select where id = 5000']
+        self.send_until(process, commands, '(5000 ')
+        self.kill_db(process)
+        self.assertGreater(os.path.getsize(os.path.join(self.dir, 'sqlite.db-wal')), 0)
+
+        self.assertEqual(self.select_ids(), list(range(1, 3001)) + [5000])
+        self.assertEqual(self.select_ids(where=' where email = e2999@x'), [2999])
+        # 恢复后可以继续写入
+        self.run_db(['insert 5001 c c@x', '.exit'])
+        self.assertEqual(self.select_ids(where=' where id = 5001'), [5001])
+
+    # 回滚丢弃整个事务：事务中修改的页大多已被淘汰，回滚后表和索引都回到事务开始时的内容
+    def test_rollback_with_small_buffer_pool(self):
+        commands = ['insert ' + rows_sql(range(2, 1002, 2))]
+        commands.append('begin')
+        for i in range(1, 3001, 100):
+            commands.append('insert ' + rows_sql(range(i, i + 200, 2), 'v'))
+        commands += ['rollback', 'insert 3001 w w@x', '.exit']
+        self.run_db(commands, ['--frames', '16'])
+
+        expected = list(range(2, 1002, 2)) + [3001]
+        self.assertEqual(self.select_ids(['--frames', '16']), expected)
+        self.assertEqual(self.select_ids(where=' where username = v1'), [])
+        self.assertEqual(self.select_ids(where=' where email = e1@x'), [])
+        self.assertEqual(self.select_ids(where=' where username = u500'), [500])
+
+    # 压缩存储：写入后重新打开，行和索引与写入的一致，变长的行压缩后文件比不压缩时小
+    def test_compressed_round_trip(self):
+        ids = list(range(1, 4001))
+        commands = ['insert ' + rows_sql(ids[i:i + 200]) for i in range(0, len(ids), 200)]
+        self.run_db(commands + ['.exit'], ['--compress'])
+        self.run_db(['insert 5000 b b@x', '.exit'], ['--compress'])
+
+        self.assertEqual(self.select_ids(['--compress']), ids + [5000])
+        self.assertEqual(self.select_ids(['--compress'], ' where username = u1234'), [1234])
+        self.assertEqual(self.select_ids(['--compress'], ' where id = 5000'), [5000])
+        compressed_size = os.path.getsize(os.path.join(self.dir, 'sqlite.db'))
+
+        os.mkdir(os.path.join(self.dir, 'plain'))
+        plain = os.path.join(self.dir, 'plain')
+        subprocess.run([BINARY], input='\n'.join(commands + ['.exit']) + '\n', capture_output=True,
+                       text=True, cwd=plain, timeout=120, check=True)
+        self.assertLess(compressed_size, os.path.getsize(os.path.join(plain, 'sqlite.db')))
+
+    # 内存映射读取：检查点写回数据库文件后，重新打开时从映射中读出同样的内容
+    def test_mmap_round_trip(self):
+        ids = list(range(1, 3001))
+        self.run_db(['insert ' + rows_sql(ids[i:i + 200]) for i in range(0, len(ids), 200)] + ['.exit'])
+        self.assertEqual(self.select_ids(['--mmap']), ids)
+        self.run_db(['insert 5000 b b@x', '.exit'], ['--mmap'])
+        self.assertEqual(self.select_ids(['--mmap'], ' where username = u2500'), [2500])
+        self.assertEqual(self.select_ids(), ids + [5000])
+
+    # 按 id 查找：乱序插入后节点中的键有多种分布，查找存在和不存在的键，都与内容一致
+    def test_find_by_id_after_random_inserts(self):
+        rng = random.Random(7)
+        ids = rng.sample(range(1, 100000), 3000)
+        commands = ['insert ' + rows_sql(ids[i:i + 100]) for i in range(0, len(ids), 100)]
+        present = set(ids)
+        probes = rng.sample(ids, 100) + [min(ids) - 1, max(ids) + 1] + \
+            [k for k in rng.sample(range(1, 100000), 100) if k not in present]
+        commands += ['select where id = %d' % k for k in probes]
+        output = self.run_db(commands + ['.exit'])
+        found = [int(m) for m in re.findall(r'\((\d+) ', output)]
+        self.assertEqual(found, [k for k in probes if k in present])
+        self.assertEqual(self.select_ids(), sorted(ids))
+
+    # 超出范围的 id 使语句失败，不会回绕成另一个 id
+    def test_insert_rejects_out_of_range_id(self):
+        output = self.run_db(['insert 4294967297 a a@x', 'insert 12x a a@x', 'insert -1 a a@x',
+                              'insert 1 b b@x, 99999999999 c c@x', 'insert 4294967295 d d@x', '.exit'])
+        self.assertEqual(output.count('Syntax error'), 3)
+        self.assertIn('ID must be positive', output)
+        self.assertEqual(self.select_ids(), [4294967295])
+
+    # 没有文件头的文件（定长行格式的旧文件）拒绝打开，不会按新格式误读，也不会被修改
+    def test_rejects_file_without_header(self):
+        path = os.path.join(self.dir, 'sqlite.db')
+        # 旧格式的根叶子节点：节点类型、是否为根、父节点、单元数、一个定长的行
+        old_page = bytes([1, 1]) + bytes(4) + (1).to_bytes(4, 'little') + (7).to_bytes(4, 'little') + \
+            (7).to_bytes(4, 'little') + b'user7'.ljust(33, b'\0') + b'u7@x'.ljust(256, b'\0')
+        with open(path, 'wb') as f:
+            f.write(old_page.ljust(4096, b'\0'))
+        result = subprocess.run([BINARY], input='select\n.exit\n', capture_output=True, text=True,
+                                cwd=self.dir, timeout=120)
+        self.assertNotEqual(result.returncode, 0)
+        self.assertIn('older format', result.stdout)
+        with open(path, 'rb') as f:
+            self.assertEqual(f.read(), old_page.ljust(4096, b'\0'))
+
+    # 表和索引的根节点所在页记录在文件头中：魔数、版本、页大小、表的根、两个索引的根
+    def test_header_records_roots(self):
+        self.run_db(['insert ' + rows_sql(range(1, 2001)), '.exit'])
+        with open(os.path.join(self.dir, 'sqlite.db'), 'rb') as f:
+            header = [int.from_bytes(f.read(4), 'little') for _ in range(6)]
+        self.assertEqual(header, [0x54494c53, 2, 4096, 1, 2, 3])
+        self.assertEqual(self.select_ids(where=' where email = e1999@x'), [1999])
+
+    # 压缩存储时在检查点进行中杀掉进程：页在检查点中变大后移到新位置，重新打开时映射中的空间不重叠，已提交的行都在
+    def test_compressed_kill_during_checkpoint(self):
+        rng = random.Random(3)
+        sent = set()
+        committed = set()
+        for round in range(6):
+            process = self.start_db(['--compress', '--frames', '16'])
+            for batch in range(rng.randint(8, 20)):
+                ids = [i for i in rng.sample(range(1, 200000), 200) if i not in sent]
+                sent.update(ids)
+                # 用户名长短不一，页的压缩长度随插入变化
+                rows = ', '.join('%d %s e%d@x' % (i, 'n' * rng.randint(1, 30), i) for i in ids)
+                self.send_until(process, ['insert ' + rows], 'Executed.')
+                committed.update(ids)
+            # 再发一批不等待，让进程在写入和检查点中途被杀掉
+            process.stdin.write('insert ' + rows_sql([i for i in range(200000, 200100)]) + '\n')
+            process.stdin.flush()
+            sent.update(range(200000, 200100))
+            self.kill_db(process)
+
+            found = set(self.select_ids(['--compress']))
+            self.assertTrue(committed <= found <= sent)
+            committed = found
+            sent = set(found)
+
+    # 页映射中两页的空间重叠时拒绝打开，不会把一页写到另一页的位置上
+    def test_rejects_overlapping_page_map(self):
+        self.run_db(['insert ' + rows_sql(range(1, 2001)), '.exit'], ['--compress'])
+        path = os.path.join(self.dir, 'sqlite.db-map')
+        with open(path, 'r+b') as f:
+            entries = f.read()
+            # 每项 8 字节：位置、长度、容量，让 2 号页指向 1 号页的位置
+            f.seek(2 * 8)
+            f.write(entries[8:12])
+        result = subprocess.run([BINARY, '--compress'], input='select\n.exit\n', capture_output=True,
+                                text=True, cwd=self.dir, timeout=120)
+        self.assertNotEqual(result.returncode, 0)
+        self.assertIn('Page map is corrupt', result.stdout)
+
+    # id 的等值和范围条件：边界包含与否、跨叶子的范围、空范围和超出 id 取值范围的边界
+    def test_select_range_predicates(self):
+        ids = list(range(3, 6000, 3))
+        random.Random(9).shuffle(ids)
+        self.run_db(['insert ' + rows_sql(ids[i:i + 500]) for i in range(0, len(ids), 500)] + ['.exit'])
+        ids.sort()
+        cases = [
+            (' where id = 300', [300]),
+            (' where id = 301', []),
+            (' where id between 300 and 3300', [i for i in ids if 300 <= i <= 3300]),
+            (' where id between 301 and 302', []),
+            (' where id between 3300 and 300', []),
+            (' where id > 5997', []),
+            (' where id > 5994', [5997]),
+            (' where id >= 5994', [5994, 5997]),
+            (' where id < 3', []),
+            (' where id <= 3', [3]),
+            (' where id < 1000', [i for i in ids if i < 1000]),
+            (' where id > 4294967295', []),
+            (' where id < 0', []),
+            (' where id >= 0', ids),
+            ('', ids),
+        ]
+        output = self.run_db(['select' + where for where, _ in cases] + ['.exit'])
+        results = output.split('Executed.')[:-1]
+        self.assertEqual(len(results), len(cases), output[-500:])
+        for (where, expected), result in zip(cases, results):
+            self.assertEqual([int(m) for m in re.findall(r'\((\d+) ', result)], expected, where)
+
+        output = self.run_db(['select where id between 5 or 6', 'select where id > x', 'select where name = 3',
+                              'select where id = 3 4', '.exit'])
+        self.assertEqual(output.count('Syntax error'), 4, output)
+        self.assertEqual(output.count('Executed.'), 0, output)
+
+    # 连接数多于工作线程时排队等待，各连接并发插入和查询；未提交的事务对其他连接不可见，断开时回滚
+    # 收到 SIGTERM 后关闭数据库、删除套接字文件，重新打开时数据都在
+    def test_server_worker_pool(self):
+        process, path = self.start_server(3)
+        try:
+            errors = []
+
+            def client(number):
+                with self.connect(path) as sock:
+                    for i in range(number * 1000 + 1, number * 1000 + 101):
+                        status, output = request(sock, 'insert %d u%d e%d@x' % (i, i, i))
+                        if (status, output) != (0, 'Executed.\n'):
+                            errors.append(output)
+                    status, output = request(sock, 'select where id between %d and %d' % (number * 1000, number * 1000 + 999))
+                    if status != 0 or output.count('\n') != 101:
+                        errors.append(output)
+
+            clients = [threading.Thread(target=client, args=(n,)) for n in range(8)]
+            for thread in clients:
+                thread.start()
+            for thread in clients:
+                thread.join()
+            self.assertEqual(errors, [])
+
+            with self.connect(path) as writer, self.connect(path) as reader:
+                self.assertEqual(request(writer, 'insert 1 dup dup@x'), (1, 'Error: Duplicate key.\n'))
+                self.assertEqual(request(writer, '.exit')[0], 1)
+                self.assertEqual(request(writer, 'select where id <')[0], 1)
+                self.assertEqual(request(writer, 'begin'), (0, 'Executed.\n'))
+                self.assertEqual(request(writer, 'insert 9999 t t@x'), (0, 'Executed.\n'))
+                self.assertEqual(request(writer, 'select where id = 9999'), (0, '(9999 t t@x)\nExecuted.\n'))
+                self.assertEqual(request(reader, 'select where id = 9999'), (0, 'Executed.\n'))
+            # 插入要等断开的连接回滚后才能拿到写锁，能插入说明事务已撤销
+            with self.connect(path) as sock:
+                self.assertEqual(request(sock, 'insert 9999 r r@x'), (0, 'Executed.\n'))
+                self.assertEqual(request(sock, 'select where id = 9999'), (0, '(9999 r r@x)\nExecuted.\n'))
+                status, output = request(sock, 'select')
+                self.assertEqual(status, 0)
+                self.assertEqual(output.count('\n'), 802)
+        finally:
+            self.stop_server(process)
+        self.assertFalse(os.path.exists(path))
+        expected = [n * 1000 + i for n in range(8) for i in range(1, 101)]
+        self.assertEqual(self.select_ids(), expected + [9999])
+
+    # 语句中的 ? 由请求中的参数绑定，同一文本的语句从缓存中取出后每次重新绑定
+    # 参数个数或类型不符、文本过长时报错，出错不影响之后使用同一条缓存的语句
+    def test_server_bound_parameters(self):
+        process, path = self.start_server(1)
+        try:
+            with self.connect(path) as sock:
+                for i in range(1, 51):
+                    self.assertEqual(request(sock, 'insert ? ? ?', params(i, 'u%d' % i, 'e%d@x' % i)),
+                                     (0, 'Executed.\n'))
+                self.assertEqual(request(sock, 'insert ? fixed ?', params(51, 'e51@x')), (0, 'Executed.\n'))
+                self.assertEqual(request(sock, 'insert ? ? ?', params(52, 'has space', 'e52@x')), (0, 'Executed.\n'))
+
+                for i in (1, 25, 50, 60):
+                    expected = '(%d u%d e%d@x)\n' % (i, i, i) if i <= 50 else ''
+                    self.assertEqual(request(sock, 'select where id = ?', params(i)), (0, expected + 'Executed.\n'))
+                status, output = request(sock, 'select where id between ? and ?', params(10, 19))
+                self.assertEqual(re.findall(r'\((\d+) ', output), [str(i) for i in range(10, 20)])
+                self.assertEqual(request(sock, 'select where id > ?', params(50)),
+                                 (0, '(51 fixed e51@x)\n(52 has space e52@x)\nExecuted.\n'))
+                self.assertEqual(request(sock, 'select where username = ?', params('has space')),
+                                 (0, '(52 has space e52@x)\nExecuted.\n'))
+                self.assertEqual(request(sock, 'select where email = ?', params('e7@x')),
+                                 (0, '(7 u7 e7@x)\nExecuted.\n'))
+
+                mismatch = (1, 'Parameters do not match statement.\n')
+                self.assertEqual(request(sock, 'select where id = ?'), mismatch)
+                self.assertEqual(request(sock, 'select where id = ?', params(1, 2)), mismatch)
+                self.assertEqual(request(sock, 'select where id = ?', params('1')), mismatch)
+                self.assertEqual(request(sock, 'select where username = ?', params(1)), mismatch)
+                self.assertEqual(request(sock, 'select where id = ?', params(1)[:3]), mismatch)
+                self.assertEqual(request(sock, 'select where id = 1', params(1)), mismatch)
+                self.assertEqual(request(sock, 'insert ? ? ?', params(99, 'u' * 33, 'e')),
+                                 (1, 'String is too long\n'))
+                self.assertEqual(request(sock, 'select where id = ?', params(2)), (0, '(2 u2 e2@x)\nExecuted.\n'))
+
+                # 超过缓存容量的不同语句轮流替换缓存项，被替换的语句再次使用时重新解析
+                for _ in range(2):
+                    for i in range(1, 21):
+                        self.assertEqual(request(sock, 'select where id = %d' % i),
+                                         (0, '(%d u%d e%d@x)\nExecuted.\n' % (i, i, i)))
+                        self.assertEqual(request(sock, 'select where id between ? and %d' % i, params(i)),
+                                         (0, '(%d u%d e%d@x)\nExecuted.\n' % (i, i, i)))
+        finally:
+            self.stop_server(process)
+
+        # 命令行中不能绑定参数
+        output = self.run_db(['insert ? ? ?', 'select where id = ?', '.exit'])
+        self.assertEqual(output.count('Parameters do not match statement.'), 2, output)
+
+    # 多行插入是一条语句：任何一行重复或解析失败时整条语句不生效，主键和索引中都没有留下其中的行
+    # 缓冲池很小，失败前插入的行已经引起分裂并被写回日志
+    def test_multi_row_insert_is_atomic(self):
+        args = ['--frames', '16']
+        self.run_db(['insert ' + rows_sql(range(1, 11)), '.exit'], args)
+        ids = list(range(1001, 3001))
+        random.Random(17).shuffle(ids)
+        output = self.run_db(['insert 11 a a@x, 12 b b@x, 11 c c@x',
+                              'insert ' + rows_sql(ids) + ', 5 dup dup@x',
+                              'insert 20 a a@x, 21 b',
+                              'select where username = u1500',
+                              'select where email = e2000@x',
+                              '.exit'], args)
+        self.assertEqual(output.count('Duplicate key'), 2, output)
+        self.assertEqual(output.count('Syntax error'), 1, output)
+        self.assertEqual(output.count('('), 0, output)
+        self.assertEqual(self.select_ids(args), list(range(1, 11)))
+
+        # 事务中失败的多行插入只撤销它自己，之前和之后的语句随事务提交
+        output = self.run_db(['begin', 'insert 100 a a@x, 101 b b@x',
+                              'insert ' + rows_sql(ids) + ', 100 dup dup@x',
+                              'insert 102 c c@x', 'commit', '.exit'], args)
+        self.assertEqual(output.count('Duplicate key'), 1, output)
+        self.assertEqual(self.select_ids(args), list(range(1, 11)) + [100, 101, 102])
+
+    # 并发的读者看到多行插入的全部行或一行都看不到
+    def test_multi_row_insert_is_atomic_to_readers(self):
+        process, path = self.start_server(2)
+        try:
+            counts = []
+            done = threading.Event()
+
+            def reader():
+                with self.connect(path) as sock:
+                    while not done.is_set():
+                        counts.append(request(sock, 'select')[1].count('('))
+
+            thread = threading.Thread(target=reader)
+            thread.start()
+            with self.connect(path) as sock:
+                for start in range(1, 6001, 200):
+                    ids = list(range(start, start + 200))
+                    random.Random(start).shuffle(ids)
+                    self.assertEqual(request(sock, 'insert ' + rows_sql(ids)), (0, 'Executed.\n'))
+                    status, output = request(sock, 'insert ' + rows_sql(range(start + 200, start + 400)) + ', 1 d d@x')
+                    self.assertEqual(status, 1, output)
+            done.set()
+            thread.join()
+        finally:
+            self.stop_server(process)
+        self.assertTrue(counts)
+        self.assertEqual([n for n in counts if n % 200 != 0], [])
+        self.assertEqual(self.select_ids(), list(range(1, 6001)))
+
+    # 按列值查找时返回所有值相同的行：相同值的索引项跨过多个叶子，随机顺序插入，缓冲池很小，每次查找都重新打开
+    # 事务中插入的重复值对本事务可见，回滚后消失
+    def test_index_lookup_with_duplicate_values(self):
+        args = ['--frames', '16']
+        ids = list(range(1, 3001))
+        random.Random(23).shuffle(ids)
+        groups = {'even': [i for i in ids if i % 2 == 0], 'third': [i for i in ids if i % 6 in (1, 3)],
+                  'rest': [i for i in ids if i % 6 == 5]}
+        group = {i: name for name, members in groups.items() for i in members}
+        rows = ['%d %s e%d@x' % (i, group[i], i) for i in ids]
+        self.run_db(['insert ' + ', '.join(rows[i:i + 300]) for i in range(0, len(rows), 300)] + ['.exit'], args)
+
+        for name, members in groups.items():
+            self.assertEqual(self.select_ids(args, ' where username = ' + name), sorted(members), name)
+        self.assertEqual(self.select_ids(args, ' where username = none'), [])
+        self.assertEqual(self.select_ids(args, ' where email = e1234@x'), [1234])
+
+        output = self.run_db(['begin', 'insert 5000 rest e5000@x, 5001 rest e5001@x',
+                              'select where username = rest', 'rollback',
+                              'select where username = rest', '.exit'], args)
+        results = output.split('Executed.')
+        self.assertEqual([int(m) for m in re.findall(r'\((\d+) ', results[2])],
+                         sorted(groups['rest']) + [5000, 5001])
+        self.assertEqual([int(m) for m in re.findall(r'\((\d+) ', results[4])],
+                         sorted(groups['rest']))
+        self.assertEqual(self.select_ids(args, ' where username = rest'), sorted(groups['rest']))
+
+    # 写者按事务插入的同时多个读者在快照下查找和扫描，每个快照看到的必须正好是若干个完整的事务
+    # 缓冲池取最小值，提交时固定的脏页可能占满所有帧，读者要等提交完成而不是报缓冲池耗尽
+    def test_concurrent_readers_and_writer(self):
+        compiler = shutil.which(os.environ.get('CC', 'gcc'))
+        if compiler is None:
+            self.skipTest('C compiler not found')
+        harness = os.path.join(self.dir, 'concurrency')
+        subprocess.run([compiler, '-O2', '-DSQLIT_NO_MAIN', os.path.join(ROOT, 'tests', 'concurrency.c'),
+                        os.path.join(ROOT, 'main.c'), '-lpthread', '-o', harness], check=True)
+        for args in ([], ['--mmap'], ['--compress']):
+            result = subprocess.run([harness, '--rows', '5000'] + args, capture_output=True, text=True,
+                                    cwd=self.dir, timeout=120)
+            self.assertEqual(result.returncode, 0, result.stdout + result.stderr)
+
+
+if __name__ == '__main__':
+    unittest.main()